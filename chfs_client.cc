@@ -159,22 +159,24 @@ int chfs_client::setattr(inum ino, size_t size)
      * note: get the content of inode ino, and modify its content
      * according to the size (<, =, or >) content length.
      */
-    std::string buf;
-    if(ec->get(ino, buf) != extent_protocol::OK){
-        debug_log(false, "file not exist\n");
+    if(ec->truncate(ino, size) != extent_protocol::OK){
+        debug_log(false, "truncate error\n");
         r = IOERR;
         goto release;
     }
 
-    buf.resize(size);
+release:
+    return r;
+}
+
+int chfs_client::statfs(extent_protocol::fsstat &st)
+{
+    int r = OK;
 
-    if(ec->put(ino, buf) != OK){
-        debug_log(false, "write back error\n");
+    if(ec->statfs(st) != extent_protocol::OK){
+        debug_log(false, "statfs error\n");
         r = IOERR;
-        goto release;
     }
-
-release:
     return r;
 }
 
@@ -205,7 +207,7 @@ int chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_ou
         goto release;
     }
 
-    if(ec->create(extent_protocol::T_FILE, new_file) != OK){
+    if(ec->create(extent_protocol::T_FILE, parent, new_file) != OK){
         debug_log(false, "create new file error\n");
         r = IOERR;
         goto release;
@@ -252,7 +254,7 @@ chfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
         goto release;
     }
 
-    if(ec->create(extent_protocol::T_DIR, new_dir) != OK){
+    if(ec->create(extent_protocol::T_DIR, parent, new_dir) != OK){
         debug_log(false, "create new directory error\n");
         r = IOERR;
         goto release;
@@ -363,15 +365,11 @@ chfs_client::read(inum ino, size_t size, off_t off, std::string &data)
      * your code goes here.
      * note: read using ec->get().
      */
-    std::string buf;
-    if(ec->get(ino, buf) != OK){
+    debug_log(true, "read file %lld\tsize is %ld\toffset is %ld\n", ino, size, off);
+    if(ec->read(ino, off, size, data) != OK){
         r = NOENT;
         goto release;
     }
-    debug_log(true, "read file %lld\tsize is %ld\toffset is %ld\tfile size is %ld\n", ino, size, off, buf.size());
-    if(off <= buf.size()){
-        data = buf.substr(off, size);
-    }
 
 release:
     return r;
@@ -388,28 +386,34 @@ chfs_client::write(inum ino, size_t size, off_t off, const char *data,
      * note: write using ec->put().
      * when off > length of original file, fill the holes with '\0'.
      */
-    std::string buf;
-    if(ec->get(ino, buf) != OK){
-        r = NOENT;
-        goto release;
-    }
-    if(buf.size() < off){
-        // bytes_written += off - buf.size();
-        buf.resize(off);
-    }
-    buf.replace(off, size, data, size);
-    bytes_written += size;
-    debug_log(true, "write bytes is %ld\n", bytes_written);
-    if(ec->put(ino, buf) != OK){
+    // the server writes only the blocks in range and zero-fills a gap
+    // past the old end of the file
+    if(ec->write(ino, off, std::string(data, size)) != OK){
         debug_log(false, "write file failed\n");
         r = IOERR;
         goto release;
     }
+    bytes_written += size;
     debug_log(true, "write file succeed\n");
 release:
     return r;
 }
 
+// Make file dst a copy of file src, as cp --reflink does. The server
+// shares the blocks instead of the content going through the client.
+// Mounted, it is reached by setting the user.chfs.clone attribute.
+int chfs_client::clone(inum src, inum dst)
+{
+    int r = OK;
+
+    debug_log(true, "clone file %lld to %lld\n", src, dst);
+    if(ec->clone(src, dst) != extent_protocol::OK){
+        debug_log(false, "clone error\n");
+        r = IOERR;
+    }
+    return r;
+}
+
 int chfs_client::unlink(inum parent, const char *name)
 {
     int r = OK;
@@ -500,7 +504,7 @@ int chfs_client::symlink(inum parent, const char *link, const char* name, inum &
         goto release;
     }
 
-    if(ec->create(extent_protocol::T_SYMLINK, new_symlink) != OK){
+    if(ec->create(extent_protocol::T_SYMLINK, parent, new_symlink) != OK){
         debug_log(false, "create new symlink error\n");
         r = IOERR;
         goto release;
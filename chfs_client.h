@@ -45,6 +45,8 @@ class chfs_client {
 
  public:
   chfs_client(std::string);
+  const ec_stats &rpc_stats() const { return ec->stats(); }
+  void flush() { ec->flush(); }
 
   bool isfile(inum);
   bool isdir(inum);
@@ -54,6 +56,7 @@ class chfs_client {
   int getsymlink(inum, symlinkinfo &);
 
   int setattr(inum, size_t);
+  int statfs(extent_protocol::fsstat &);
   int lookup(inum, const char *, bool &, inum &);
   int create(inum, const char *, mode_t, inum &);
   int readdir(inum, std::list<dirent> &);
@@ -61,6 +64,7 @@ class chfs_client {
   int read(inum, size_t, off_t, std::string &);
   int unlink(inum,const char *);
   int mkdir(inum , const char *, mode_t , inum &);
+  int clone(inum, inum);
   
   /** you may need to add symbolic link related methods here.*/
   int readlink(inum, std::string &);
@@ -0,0 +1,135 @@
+// CRC32C, the checksum of the block layer. Built with optimization
+// even in debug builds (see GNUmakefile), as it runs over every block
+// moved to or from the disk.
+
+#include "crc32c.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY   0x82f63b78  // Castagnoli, bit-reversed
+#define CRC32C_STRIDE 256         // bytes per stream of the SSE4.2 kernel
+
+// Lookup tables, built before main. slice[t][i] is the CRC register
+// after byte i and t zero bytes, so crc32c_sw can take 8 bytes a step;
+// shift[k][i] is register (i << 8k) after CRC32C_STRIDE zero bytes,
+// which the SSE4.2 kernel uses to join its streams.
+static struct crc32c_tables {
+  uint32_t slice[8][256];
+  uint32_t shift[4][256];
+  bool hw;
+
+  crc32c_tables() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+      slice[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++) {
+      for (uint32_t i = 0; i < 256; i++)
+        slice[t][i] = (slice[t - 1][i] >> 8) ^ slice[0][slice[t - 1][i] & 0xff];
+    }
+    for (int k = 0; k < 4; k++) {
+      for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i << (8 * k);
+        for (int n = 0; n < CRC32C_STRIDE; n++)
+          c = (c >> 8) ^ slice[0][c & 0xff];
+        shift[k][i] = c;
+      }
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    hw = __builtin_cpu_supports("sse4.2");
+#else
+    hw = false;
+#endif
+  }
+} crc_tables;
+
+static inline uint64_t load64(const unsigned char *p)
+{
+  uint64_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+// The CRC register c after the len bytes at p, a byte at a time to an
+// 8-byte boundary and then 8 at a time; the wide steps read the bytes
+// as a little-endian word.
+static uint32_t crc32c_raw_sw(uint32_t c, const unsigned char *p, size_t len)
+{
+  const uint32_t (*t)[256] = crc_tables.slice;
+
+  for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+    c = (c >> 8) ^ t[0][(c ^ *p++) & 0xff];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t w = load64(p) ^ c;
+    c = t[7][w & 0xff] ^ t[6][(w >> 8) & 0xff] ^
+        t[5][(w >> 16) & 0xff] ^ t[4][(w >> 24) & 0xff] ^
+        t[3][(w >> 32) & 0xff] ^ t[2][(w >> 40) & 0xff] ^
+        t[1][(w >> 48) & 0xff] ^ t[0][w >> 56];
+  }
+#endif
+  for (; len > 0; len--)
+    c = (c >> 8) ^ t[0][(c ^ *p++) & 0xff];
+  return c;
+}
+
+#if defined(__x86_64__)
+// Register c after CRC32C_STRIDE zero bytes.
+static inline uint32_t crc32c_shift(uint32_t c)
+{
+  const uint32_t (*t)[256] = crc_tables.shift;
+
+  return t[0][c & 0xff] ^ t[1][(c >> 8) & 0xff] ^
+         t[2][(c >> 16) & 0xff] ^ t[3][c >> 24];
+}
+
+// The crc32 instruction takes 8 bytes a cycle but only gives its result
+// 3 cycles later, so one chain of them runs at a third of its speed.
+// Three strides are run side by side instead, the second and third from
+// 0, and then joined: the CRC of a|b is shift(crc(a)) ^ crc(b) when b
+// starts from 0.
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_raw_hw(uint32_t c, const unsigned char *p, size_t len)
+{
+  for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+    c = _mm_crc32_u8(c, *p++);
+  for (; len >= 3 * CRC32C_STRIDE; len -= 3 * CRC32C_STRIDE, p += 3 * CRC32C_STRIDE) {
+    uint64_t a = c, b = 0, d = 0;
+    for (int i = 0; i < CRC32C_STRIDE; i += 8) {
+      a = _mm_crc32_u64(a, load64(p + i));
+      b = _mm_crc32_u64(b, load64(p + CRC32C_STRIDE + i));
+      d = _mm_crc32_u64(d, load64(p + 2 * CRC32C_STRIDE + i));
+    }
+    c = crc32c_shift(crc32c_shift(a) ^ b) ^ d;
+  }
+  for (; len >= 8; len -= 8, p += 8)
+    c = _mm_crc32_u64(c, load64(p));
+  for (; len > 0; len--)
+    c = _mm_crc32_u8(c, *p++);
+  return c;
+}
+#endif
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+  return ~crc32c_raw_sw(~crc, (const unsigned char *)buf, len);
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+#if defined(__x86_64__)
+  if (crc_tables.hw)
+    return ~crc32c_raw_hw(~crc, (const unsigned char *)buf, len);
+#endif
+  return crc32c_sw(crc, buf, len);
+}
+
+bool crc32c_hw()
+{
+  return crc_tables.hw;
+}
@@ -0,0 +1,16 @@
+// CRC32C checksums.
+
+#ifndef crc32c_h
+#define crc32c_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli) of len bytes, continuing from crc, which is 0 to
+// start. crc32c uses SSE4.2 where the CPU has it and crc32c_sw, a
+// table-driven version, elsewhere; crc32c_hw tells which.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+bool crc32c_hw();
+
+#endif
@@ -6,6 +6,16 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <vector>
+#include <arpa/inet.h>
+#include "slock.h"
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 extent_client::extent_client(std::string dst)
 {
@@ -15,14 +25,252 @@ extent_client::extent_client(std::string dst)
   if (cl->bind() != 0) {
     printf("extent_client: bind failed\n");
   }
+  epoch = 0;
+  recalled = 0;
+  recalled_epoch = 0;
+  cached_bytes = 0;
+  cache_bytes = EXTENT_CACHE_BYTES;
+  VERIFY(pthread_mutex_init(&attr_m, 0) == 0);
+  VERIFY(pthread_mutex_init(&cache_m, 0) == 0);
+  VERIFY(pthread_cond_init(&cache_c, 0) == 0);
+
+  // the server calls back here, on this host
+  rsrv = new rpcs(0);
+  rsrv->reg(rextent_protocol::recall, this, &extent_client::recall);
+  rsrv->reg(rextent_protocol::drop_attr, this, &extent_client::drop_attr);
+  char addr[32];
+  snprintf(addr, sizeof(addr), "127.0.0.1:%d", ntohs(rsrv->port()));
+  cbaddr = addr;
+}
+
+extent_client::~extent_client()
+{
+  flush();
+}
+
+// Drop the cached attributes of eid, which this client is changing.
+void extent_client::forget(extent_protocol::extentid_t eid)
+{
+  ScopedLock ml(&attr_m);
+  attrs.erase(eid);
+  epoch++;
+}
+
+// The cached copy of eid, or NULL if there is none, once any fetch or
+// release of it is over. Called with cache_m held.
+extent_client::cached_extent *
+extent_client::lookup(extent_protocol::extentid_t eid)
+{
+  std::map<extent_protocol::extentid_t, cached_extent>::iterator it;
+  while ((it = cache.find(eid)) != cache.end() && it->second.state != CACHED)
+    VERIFY(pthread_cond_wait(&cache_c, &cache_m) == 0);
+  if (it == cache.end())
+    return NULL;
+  lru.splice(lru.begin(), lru, it->second.pos);
+  return &it->second;
+}
+
+// Take the copy at it out of the cache. Called with cache_m held.
+void extent_client::drop(std::map<extent_protocol::extentid_t, cached_extent>::iterator it)
+{
+  if (it->second.listed) {
+    lru.erase(it->second.pos);
+    cached_bytes -= it->second.data.size();
+  }
+  cache.erase(it);
+}
+
+// Account for e's content having changed from old bytes. Called with
+// cache_m held.
+void extent_client::resized(cached_extent *e, size_t old)
+{
+  cached_bytes += e->data.size();
+  cached_bytes -= old;
+}
+
+// Give back the least recently used extents until what is cached fits
+// in cache_bytes again, writing back those that changed.
+void extent_client::trim()
+{
+  for (;;) {
+    extent_protocol::extentid_t eid = 0;
+    bool found = false;
+    {
+      ScopedLock ml(&cache_m);
+      if (cached_bytes <= cache_bytes)
+        return;
+      std::list<extent_protocol::extentid_t>::reverse_iterator it;
+      for (it = lru.rbegin(); it != lru.rend() && !found; ++it) {
+        if (cache[*it].state == CACHED) {
+          eid = *it;
+          found = true;
+        }
+      }
+    }
+    if (!found)
+      return;
+    cstats.evictions++;
+    if (give_back(eid) != extent_protocol::OK) {
+      ScopedLock ml(&cache_m);
+      lost.insert(eid);
+    }
+  }
+}
+
+// Whether eid's changes were lost when it was given back, which is
+// then reported only once. Called with cache_m held.
+bool extent_client::was_lost(extent_protocol::extentid_t eid)
+{
+  return lost.erase(eid) > 0;
+}
+
+// Set e to the cached copy of eid, fetching it from the server if
+// there is none. Called with cache_m held, which is let go during the
+// fetch.
+extent_protocol::status
+extent_client::hold(extent_protocol::extentid_t eid, cached_extent *&e)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  extent_protocol::extent x;
+
+  if (was_lost(eid))
+    return extent_protocol::IOERR;
+  e = lookup(eid);
+  if (e != NULL) {
+    cstats.cache_hits++;
+    return ret;
+  }
+  cache[eid].state = FETCHING;
+  VERIFY(pthread_mutex_unlock(&cache_m) == 0);
+  ret = cl->call(extent_protocol::fetch, eid, cl->id(), cbaddr, x);
+  cstats.rpcs++;
+  VERIFY(pthread_mutex_lock(&cache_m) == 0);
+  VERIFY(pthread_cond_broadcast(&cache_c) == 0);
+  if (ret != extent_protocol::OK) {
+    cache.erase(eid);
+    return ret;
+  }
+  forget(eid);  // the cached copy's attributes take over from here on
+  e = &cache[eid];
+  e->state = CACHED;
+  e->dirty = false;
+  e->epoch = x.epoch;
+  e->a = x.a;
+  e->data.swap(x.data);
+  e->listed = true;
+  e->pos = lru.insert(lru.begin(), eid);
+  cached_bytes += e->data.size();
+  return ret;
+}
+
+// Give the cached copy of eid, if any, back to the server. IOERR if
+// the server had taken it back already, without its changes; the copy
+// is dropped all the same.
+extent_protocol::status
+extent_client::give_back(extent_protocol::extentid_t eid)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  extent_protocol::writeback wb;
+  unsigned int epoch;
+  int r;
+  {
+    ScopedLock ml(&cache_m);
+    cached_extent *e = lookup(eid);
+    if (e == NULL)
+      return ret;
+    e->state = RELEASING;
+    epoch = e->epoch;
+    wb.dirty = e->dirty;
+    if (e->dirty)
+      wb.data = e->data;
+  }
+  ret = cl->call(extent_protocol::release, eid, cl->id(), epoch, wb, r);
+  cstats.rpcs++;
+  if (ret == extent_protocol::IOERR) {
+    printf("extent_client: changes to %llu were lost\n", eid);
+    forget(eid);
+  }
+  ScopedLock ml(&cache_m);
+  drop(cache.find(eid));
+  VERIFY(pthread_cond_broadcast(&cache_c) == 0);
+  return ret;
+}
+
+// Give every cached extent back to the server.
+void extent_client::flush()
+{
+  std::vector<extent_protocol::extentid_t> eids;
+  {
+    ScopedLock ml(&cache_m);
+    std::map<extent_protocol::extentid_t, cached_extent>::iterator it;
+    for (it = cache.begin(); it != cache.end(); ++it)
+      eids.push_back(it->first);
+  }
+  for (size_t i = 0; i < eids.size(); i++) {
+    if (give_back(eids[i]) != extent_protocol::OK) {
+      ScopedLock ml(&cache_m);
+      lost.insert(eids[i]);
+    }
+  }
+}
+
+// The server takes eid, which it handed out under epoch, back for
+// another request; hand it what changed. A fetch of eid still under way
+// has been answered, and is waited for. One being given back is left to
+// finish, but its release will be ignored, so what changed goes back
+// here. The same recall made again gets the same answer; one for an
+// epoch since given back gets nothing.
+int extent_client::recall(extent_protocol::extentid_t eid, unsigned int epoch,
+                          extent_protocol::writeback &wb)
+{
+  ScopedLock ml(&cache_m);
+  std::map<extent_protocol::extentid_t, cached_extent>::iterator it;
+  while ((it = cache.find(eid)) != cache.end() && it->second.state == FETCHING)
+    VERIFY(pthread_cond_wait(&cache_c, &cache_m) == 0);
+  if (eid == recalled && epoch == recalled_epoch) {
+    wb = recalled_wb;
+    return rextent_protocol::OK;
+  }
+  wb.dirty = 0;
+  recalled_epoch = 0;
+  recalled_wb.data.clear();
+  if (it == cache.end() || it->second.epoch != epoch)
+    return rextent_protocol::OK;
+  cstats.recalls++;
+  if (it->second.dirty) {
+    wb.dirty = 1;
+    wb.data = it->second.data;
+  }
+  if (it->second.state == CACHED)
+    drop(it);
+  else
+    it->second.dirty = false;
+  recalled = eid;
+  recalled_epoch = epoch;
+  recalled_wb = wb;
+  return rextent_protocol::OK;
+}
+
+// The server takes back the attribute lease on eid, as it is about to
+// change. As it calls a client back one call at a time, it has the
+// answer to the last recall by now.
+int extent_client::drop_attr(extent_protocol::extentid_t eid, int &)
+{
+  forget(eid);
+  ScopedLock ml(&cache_m);
+  recalled_epoch = 0;
+  recalled_wb.data.clear();
+  return rextent_protocol::OK;
 }
 
 extent_protocol::status
-extent_client::create(uint32_t type, extent_protocol::extentid_t &id)
+extent_client::create(uint32_t type, extent_protocol::extentid_t parent,
+                      extent_protocol::extentid_t &id)
 {
   extent_protocol::status ret = extent_protocol::OK;
   // Your lab2 part1 code goes here
-  ret = cl->call(extent_protocol::create, type, id);
+  ret = cl->call(extent_protocol::create, type, parent, id);
+  cstats.rpcs++;
   return ret;
 }
 
@@ -31,17 +279,61 @@ extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
   // Your lab2 part1 code goes here
-  ret = cl->call(extent_protocol::get, eid, buf);
+  {
+    ScopedLock ml(&cache_m);
+    cached_extent *e;
+    ret = hold(eid, e);
+    if (ret == extent_protocol::OK)
+      buf = e->data;
+  }
+  trim();
   return ret;
 }
 
+// Served from the extent cache, or from the attribute cache while the
+// lease lasts; otherwise fetched with a new lease.
 extent_protocol::status
 extent_client::getattr(extent_protocol::extentid_t eid, 
 		       extent_protocol::attr &attr)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  // Your lab2 part1 code goes here
-  ret = cl->call(extent_protocol::getattr, eid, attr);
+  extent_protocol::lease_attr la;
+  double t = now();
+  uint64_t start;
+  {
+    ScopedLock ml(&cache_m);
+    if (was_lost(eid))
+      return extent_protocol::IOERR;
+    cached_extent *e = lookup(eid);
+    if (e != NULL) {
+      attr = e->a;
+      cstats.cache_hits++;
+      return ret;
+    }
+  }
+  {
+    ScopedLock ml(&attr_m);
+    std::map<extent_protocol::extentid_t, cached_attr>::iterator it = attrs.find(eid);
+    if (it != attrs.end() && t < it->second.expires) {
+      attr = it->second.a;
+      cstats.attr_hits++;
+      return ret;
+    }
+    if (it != attrs.end())
+      attrs.erase(it);
+    start = epoch;
+  }
+  ret = cl->call(extent_protocol::getattr_lease, eid, cl->id(), cbaddr, la);
+  cstats.rpcs++;
+  if (ret != extent_protocol::OK)
+    return ret;
+  attr = la.a;
+  ScopedLock ml(&attr_m);
+  if (la.lease_ms > 0 && epoch == start) {
+    cached_attr &c = attrs[eid];
+    c.a = la.a;
+    c.expires = t + la.lease_ms / 1000.0;
+  }
   return ret;
 }
 
@@ -50,8 +342,19 @@ extent_client::put(extent_protocol::extentid_t eid, std::string buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
   // Your lab2 part1 code goes here
-  int r;
-  ret = cl->call(extent_protocol::put, eid, buf, r);
+  {
+    ScopedLock ml(&cache_m);
+    cached_extent *e;
+    ret = hold(eid, e);
+    if (ret != extent_protocol::OK)
+      return ret;
+    e->data.swap(buf);
+    resized(e, buf.size());
+    e->dirty = true;
+    e->a.size = e->data.size();
+    e->a.atime = e->a.mtime = e->a.ctime = time(0);
+  }
+  trim();
   return ret;
 }
 
@@ -61,6 +364,140 @@ extent_client::remove(extent_protocol::extentid_t eid)
   extent_protocol::status ret = extent_protocol::OK;
   // Your lab2 part1 code goes here
   int r;
-  ret = cl->call(extent_protocol::remove, eid, r);
+  {
+    // what was cached goes, and requests for eid wait for the server
+    ScopedLock ml(&cache_m);
+    was_lost(eid);
+    lookup(eid);
+    cached_extent &e = cache[eid];
+    e.state = RELEASING;
+    e.dirty = false;
+  }
+  forget(eid);
+  ret = cl->call(extent_protocol::remove, eid, cl->id(), r);
+  cstats.rpcs++;
+  forget(eid);
+  ScopedLock ml(&cache_m);
+  drop(cache.find(eid));
+  VERIFY(pthread_cond_broadcast(&cache_c) == 0);
   return ret;
-}
\ No newline at end of file
+}
+
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, unsigned int off,
+                    unsigned int len, std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  {
+    ScopedLock ml(&cache_m);
+    if (was_lost(eid))
+      return extent_protocol::IOERR;
+    cached_extent *e = lookup(eid);
+    if (e != NULL) {
+      buf = off < e->data.size() ? e->data.substr(off, len) : "";
+      cstats.cache_hits++;
+      return ret;
+    }
+  }
+  ret = cl->call(extent_protocol::read, eid, off, len, buf);
+  cstats.rpcs++;
+  return ret;
+}
+
+extent_protocol::status
+extent_client::write(extent_protocol::extentid_t eid, unsigned int off,
+                     std::string buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  bool hit = false;
+  {
+    ScopedLock ml(&cache_m);
+    if (was_lost(eid))
+      return extent_protocol::IOERR;
+    cached_extent *e = lookup(eid);
+    if (e != NULL) {
+      size_t old = e->data.size();
+      if (old < off + buf.size())
+        e->data.resize(off + buf.size());
+      e->data.replace(off, buf.size(), buf);
+      resized(e, old);
+      e->dirty = true;
+      e->a.size = e->data.size();
+      e->a.atime = e->a.mtime = e->a.ctime = time(0);
+      cstats.cache_hits++;
+      hit = true;
+    }
+  }
+  if (hit) {
+    trim();
+    return ret;
+  }
+  forget(eid);
+  ret = cl->call(extent_protocol::write, eid, off, buf, cl->id(), r);
+  cstats.rpcs++;
+  forget(eid);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::truncate(extent_protocol::extentid_t eid, unsigned int size)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  bool hit = false;
+  {
+    ScopedLock ml(&cache_m);
+    if (was_lost(eid))
+      return extent_protocol::IOERR;
+    cached_extent *e = lookup(eid);
+    if (e != NULL) {
+      size_t old = e->data.size();
+      e->data.resize(size);
+      resized(e, old);
+      e->dirty = true;
+      e->a.size = size;
+      e->a.mtime = e->a.ctime = time(0);
+      cstats.cache_hits++;
+      hit = true;
+    }
+  }
+  if (hit) {
+    trim();
+    return ret;
+  }
+  forget(eid);
+  ret = cl->call(extent_protocol::truncate, eid, size, cl->id(), r);
+  cstats.rpcs++;
+  forget(eid);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::statfs(extent_protocol::fsstat &st)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = cl->call(extent_protocol::statfs, 0, st);
+  cstats.rpcs++;
+  return ret;
+}
+
+extent_protocol::status
+extent_client::clone(extent_protocol::extentid_t src, extent_protocol::extentid_t dst)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  {
+    ScopedLock ml(&cache_m);
+    bool gone = was_lost(src);
+    if (was_lost(dst) || gone)
+      return extent_protocol::IOERR;
+  }
+  if (give_back(src) != extent_protocol::OK || give_back(dst) != extent_protocol::OK)
+    return extent_protocol::IOERR;
+  forget(dst);
+  ret = cl->call(extent_protocol::clone, src, dst, cl->id(), r);
+  cstats.rpcs++;
+  forget(dst);
+  return ret;
+}
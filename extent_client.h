@@ -4,23 +4,116 @@
 #define extent_client_h
 
 #include <string>
+#include <map>
+#include <list>
+#include <set>
+#include <atomic>
 #include "extent_protocol.h"
 #include "extent_server.h"
 
+// How many bytes of extents an extent_client caches, by default.
+#define EXTENT_CACHE_BYTES (16 << 20)
+
+// RPCs an extent_client sent; getattrs it answered from its attribute
+// cache, and requests from its extent cache, instead; extents the
+// server called back; and extents given back to make room.
+struct ec_stats {
+  std::atomic<uint64_t> rpcs;
+  std::atomic<uint64_t> attr_hits;
+  std::atomic<uint64_t> cache_hits;
+  std::atomic<uint64_t> recalls;
+  std::atomic<uint64_t> evictions;
+
+  ec_stats() : rpcs(0), attr_hits(0), cache_hits(0), recalls(0), evictions(0) {}
+};
+
 class extent_client {
  private:
   rpcc *cl;
 
+  // Attributes leased from the server, with when each lease runs out
+  // by this client's clock, counted from when it was asked for. A change
+  // made through this client drops the extent's entry before and after
+  // the RPC and bumps epoch, so a getattr that overlaps it does not
+  // cache what it got back. Under attr_m.
+  struct cached_attr {
+    extent_protocol::attr a;
+    double expires;
+  };
+  std::map<extent_protocol::extentid_t, cached_attr> attrs;
+  uint64_t epoch;
+  pthread_mutex_t attr_m;
+  struct ec_stats cstats;
+
+  // Extents cached whole by get and put, as the server handed them out
+  // with fetch (see extent_server.h). Changes stay here, marked dirty,
+  // until the extent is given back with release or the server recalls
+  // it; reads, writes and getattrs of a cached extent are answered here
+  // too. Requests for an extent being fetched or given back wait for
+  // that to finish. Once the cached content passes cache_bytes, the
+  // least recently used extents are given back; lru runs from the most
+  // to the least recently used. The last recall answered is kept, in
+  // case the server did not get the answer and asks again. lost holds
+  // extents whose changes the server had taken back without, which the
+  // next request for each reports. Under cache_m.
+  enum { FETCHING, CACHED, RELEASING };
+  struct cached_extent {
+    int state;
+    bool dirty;
+    unsigned int epoch;
+    extent_protocol::attr a;
+    std::string data;
+    bool listed;  // in lru, at pos
+    std::list<extent_protocol::extentid_t>::iterator pos;
+  };
+  std::map<extent_protocol::extentid_t, cached_extent> cache;
+  std::list<extent_protocol::extentid_t> lru;
+  extent_protocol::extentid_t recalled;
+  unsigned int recalled_epoch;
+  extent_protocol::writeback recalled_wb;
+  std::set<extent_protocol::extentid_t> lost;
+  size_t cached_bytes;
+  size_t cache_bytes;
+  pthread_mutex_t cache_m;
+  pthread_cond_t cache_c;
+  rpcs *rsrv;
+  std::string cbaddr;
+
+  void forget(extent_protocol::extentid_t eid);
+  cached_extent *lookup(extent_protocol::extentid_t eid);
+  void drop(std::map<extent_protocol::extentid_t, cached_extent>::iterator it);
+  void resized(cached_extent *e, size_t old);
+  void trim();
+  bool was_lost(extent_protocol::extentid_t eid);
+  extent_protocol::status hold(extent_protocol::extentid_t eid, cached_extent *&e);
+  extent_protocol::status give_back(extent_protocol::extentid_t eid);
+  int recall(extent_protocol::extentid_t eid, unsigned int epoch,
+             extent_protocol::writeback &wb);
+  int drop_attr(extent_protocol::extentid_t eid, int &);
+
  public:
   extent_client(std::string dst);
+  ~extent_client();
+  const struct ec_stats &stats() const { return cstats; }
+  void flush();
+  void set_cache_bytes(size_t n) { cache_bytes = n; }
 
-  extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
+  extent_protocol::status create(uint32_t type, extent_protocol::extentid_t parent,
+                                extent_protocol::extentid_t &eid);
   extent_protocol::status get(extent_protocol::extentid_t eid, 
 			                        std::string &buf);
   extent_protocol::status getattr(extent_protocol::extentid_t eid, 
 				                          extent_protocol::attr &a);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
+  extent_protocol::status read(extent_protocol::extentid_t eid, unsigned int off,
+                               unsigned int len, std::string &buf);
+  extent_protocol::status write(extent_protocol::extentid_t eid, unsigned int off,
+                                std::string buf);
+  extent_protocol::status truncate(extent_protocol::extentid_t eid, unsigned int size);
+  extent_protocol::status statfs(extent_protocol::fsstat &st);
+  extent_protocol::status clone(extent_protocol::extentid_t src,
+                                extent_protocol::extentid_t dst);
 };
 
 #endif
\ No newline at end of file
@@ -15,7 +15,15 @@ class extent_protocol {
     get,
     getattr,
     remove,
-    create
+    create,
+    read,
+    write,
+    truncate,
+    statfs,
+    clone,
+    getattr_lease,
+    fetch,
+    release
   };
 
   enum types {
@@ -31,6 +39,37 @@ class extent_protocol {
     unsigned int ctime;
     unsigned int size;
   };
+
+  // Attributes, and how many milliseconds from when they were asked for
+  // the client may keep using them; 0 for not at all.
+  struct lease_attr {
+    attr a;
+    unsigned int lease_ms;
+  };
+
+  // An extent's attributes and content, for a client to cache, and the
+  // epoch it is handed out under.
+  struct extent {
+    attr a;
+    std::string data;
+    unsigned int epoch;
+  };
+
+  // What a client caching an extent hands back when it gives it up:
+  // the content, if it changed it.
+  struct writeback {
+    int dirty;
+    std::string data;
+  };
+
+  // Capacity of the file system, for statfs.
+  struct fsstat {
+    unsigned int block_size;
+    unsigned int blocks;
+    unsigned int free_blocks;
+    unsigned int inodes;
+    unsigned int free_inodes;
+  };
 };
 
 inline unmarshall &
@@ -55,4 +94,87 @@ operator<<(marshall &m, extent_protocol::attr a)
   return m;
 }
 
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::lease_attr &l)
+{
+  u >> l.a;
+  u >> l.lease_ms;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::lease_attr l)
+{
+  m << l.a;
+  m << l.lease_ms;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::extent &e)
+{
+  u >> e.a;
+  u >> e.data;
+  u >> e.epoch;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::extent &e)
+{
+  m << e.a;
+  m << e.data;
+  m << e.epoch;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::writeback &w)
+{
+  u >> w.dirty;
+  u >> w.data;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::writeback &w)
+{
+  m << w.dirty;
+  m << w.data;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::fsstat &s)
+{
+  u >> s.block_size;
+  u >> s.blocks;
+  u >> s.free_blocks;
+  u >> s.inodes;
+  u >> s.free_inodes;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::fsstat s)
+{
+  m << s.block_size;
+  m << s.blocks;
+  m << s.free_blocks;
+  m << s.inodes;
+  m << s.free_inodes;
+  return m;
+}
+
+// Calls the extent server makes back to clients that cache extents.
+class rextent_protocol {
+ public:
+  typedef int status;
+  enum xxstatus { OK, RPCERR };
+  enum rpc_numbers {
+    recall = 0x8001,
+    drop_attr
+  };
+};
+
 #endif 
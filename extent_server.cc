@@ -8,28 +8,275 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
+#include <algorithm>
+#include <sys/socket.h>
+#include "slock.h"
+#include "method_thread.h"
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 extent_server::extent_server() 
 {
   im = new inode_manager();
+  init();
+}
+
+extent_server::extent_server(const fs_options &opts)
+{
+  im = new inode_manager(opts);
+  init();
+}
+
+void extent_server::init()
+{
+  pthread_condattr_t ca;
+  VERIFY(pthread_condattr_init(&ca) == 0);
+  VERIFY(pthread_condattr_setclock(&ca, CLOCK_MONOTONIC) == 0);
+  VERIFY(pthread_mutex_init(&lease_m, 0) == 0);
+  VERIFY(pthread_cond_init(&lease_c, &ca) == 0);
+  VERIFY(pthread_condattr_destroy(&ca) == 0);
+  lease_ms = ATTR_LEASE_MS;
+  epochs = 0;
+  callers = 0;
+  stopping = false;
+}
+
+extent_server::~extent_server()
+{
+  {
+    ScopedLock ml(&lease_m);
+    stopping = true;
+    while (callers > 0)
+      VERIFY(pthread_cond_wait(&lease_c, &lease_m) == 0);
+  }
+  std::map<unsigned int, client>::iterator it;
+  for (it = clients.begin(); it != clients.end(); ++it)
+    delete it->second.cl;
+}
+
+// Queue cb for its client, starting a thread to make it unless one is
+// making that client's calls already. Called with lease_m held.
+void extent_server::queue_call(const callback &cb)
+{
+  client &c = clients[cb.clt];
+  c.pending.push_back(cb);
+  if (c.calling)
+    return;
+  c.calling = true;
+  callers++;
+  method_thread(this, true, &extent_server::caller, cb.clt);
+}
+
+// Make the calls queued for client clt, one at a time, until there are
+// none, or the server goes. Not profiled, as it waits on lease_m for
+// nothing but the queue.
+void extent_server::caller(unsigned int clt)
+{
+  ScopedLock ml(&lease_m);
+  client &c = clients[clt];
+  while (!c.pending.empty() && !stopping) {
+    callback cb = c.pending.front();
+    c.pending.pop_front();
+    VERIFY(pthread_mutex_unlock(&lease_m) == 0);
+    call_back(cb);
+    VERIFY(pthread_mutex_lock(&lease_m) == 0);
+  }
+  c.calling = false;
+  callers--;
+  VERIFY(pthread_cond_broadcast(&lease_c) == 0);
+}
+
+// Whether something listens at addr, so a client that does not answer
+// is slow rather than gone.
+static bool reachable(const std::string &addr)
+{
+  sockaddr_in dst;
+  make_sockaddr(addr.c_str(), &dst);
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0)
+    return false;
+  bool ok = connect(s, (sockaddr *)&dst, sizeof(dst)) == 0;
+  close(s);
+  return ok;
 }
 
-int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
+// Make one call queued for a client, and tell whoever waits for it
+// that it is over. A recall the client does not answer is made again,
+// with twice as long to answer each time, while it can be reached, up
+// to RECALL_TRIES times; a drop of an attribute lease is not, as the
+// lease runs out anyway. A client that
+// does not answer in the end is forgotten until it gives its address
+// again, and the epoch it cached the extent under is marked lost.
+void extent_server::call_back(const callback &cb)
 {
-  // alloc a new inode and return inum
+  std::string addr;
+  rpcc *cl;
+  {
+    ProfLock ml(&lease_m, LK_LEASE);
+    addr = clients[cb.clt].addr;
+    cl = clients[cb.clt].cl;
+  }
+
+  int ret = rextent_protocol::RPCERR;
+  extent_protocol::writeback wb;
+  wb.dirty = 0;
+  for (int tries = 1; !addr.empty(); tries++) {
+    rpcc::TO to = rpcc::to(RECALL_MS << (tries - 1));
+    if (cl == NULL) {
+      sockaddr_in dstsock;
+      make_sockaddr(addr.c_str(), &dstsock);
+      cl = new rpcc(dstsock);
+      if (cl->bind(to) != 0) {
+        printf("extent_server: bind to client %u at %s failed\n", cb.clt, addr.c_str());
+        delete cl;
+        cl = NULL;
+      }
+    }
+    if (cl != NULL) {
+      int r;
+      if (cb.what == RECALL)
+        ret = cl->call(rextent_protocol::recall, cb.id, cb.epoch, wb, to);
+      else
+        ret = cl->call(rextent_protocol::drop_attr, cb.id, r, to);
+      if (ret == rextent_protocol::OK)
+        break;
+    }
+    if (cb.what != RECALL || tries == RECALL_TRIES || !reachable(addr))
+      break;
+    printf("extent_server: client %u slow to give back %lld, calling again\n",
+           cb.clt, cb.id);
+  }
+  if (ret != rextent_protocol::OK) {
+    if (cb.what == RECALL)
+      printf("extent_server: recall %lld from %u failed, its changes are lost\n",
+             cb.id, cb.clt);
+    delete cl;
+    cl = NULL;
+  } else if (wb.dirty)
+    im->write_file(cb.id, wb.data.data(), wb.data.size());
+
+  ProfLock ml(&lease_m, LK_LEASE);
+  clients[cb.clt].cl = cl;
+  if (ret != rextent_protocol::OK) {
+    clients[cb.clt].addr.clear();
+    if (cb.what == RECALL)
+      lost.insert(cb.epoch);
+  }
+  std::map<extent_protocol::extentid_t, lease>::iterator it = leases.find(cb.id);
+  if (it == leases.end())
+    return;
+  if (cb.what == RECALL)
+    it->second.recalling = false;
+  else if (ret == rextent_protocol::OK) {
+    // unless it was granted again since
+    std::map<unsigned int, double>::iterator h = it->second.holders.find(cb.clt);
+    if (h != it->second.holders.end() && h->second == cb.expires)
+      it->second.holders.erase(h);
+  }
+  VERIFY(pthread_cond_broadcast(&lease_c) == 0);
+}
+
+// Wait until no other request works on id, and then take it from the
+// client caching it, writing back anything that client changed, unless
+// that is clt itself, fetching or giving up id; other requests pass 0.
+// Returns whether clt was caching id.
+bool extent_server::claim(extent_protocol::extentid_t id, unsigned int clt)
+{
+  ProfLock ml(&lease_m, LK_LEASE);
+  bool waited = false;
+  for (; leases[id].busy; waited = true)
+    ml.wait(&lease_c, LK_CLAIM);
+  lock_account(LK_CLAIM, waited, 0);
+  lease &l = leases[id];
+  l.busy = true;
+  l.claimed_at = lock_clock();
+  unsigned int owner = l.owner;
+  l.owner = 0;
+  if (owner != 0 && owner != clt) {
+    callback cb = { RECALL, id, owner, l.epoch, 0 };
+    l.recalling = true;
+    queue_call(cb);
+    while (l.recalling)
+      ml.wait(&lease_c, LK_CLAIM);
+  }
+  return owner != 0 && owner == clt;
+}
+
+// Let other requests work on id, which client owner now caches, if
+// not 0. Returns the new epoch owner caches it under.
+unsigned int extent_server::unclaim(extent_protocol::extentid_t id, unsigned int owner)
+{
+  ProfLock ml(&lease_m, LK_LEASE);
+  lease &l = leases[id];
+  lock_held(LK_CLAIM, l.claimed_at);
+  l.busy = false;
+  l.owner = owner;
+  l.epoch = owner != 0 ? ++epochs : 0;
+  unsigned int epoch = l.epoch;
+  if (owner == 0 && l.holders.empty())
+    leases.erase(id);
+  VERIFY(pthread_cond_broadcast(&lease_c) == 0);
+  return epoch;
+}
+
+// Take back the attribute leases on id before client clt changes it,
+// calling back those of other clients and waiting until each is given
+// up or runs out. Called with id claimed, so no new leases are granted
+// meanwhile.
+void extent_server::begin_change(extent_protocol::extentid_t id, unsigned int clt)
+{
+  ProfLock ml(&lease_m, LK_LEASE);
+  lease &l = leases[id];
+  l.holders.erase(clt);
+  std::map<unsigned int, double>::iterator it;
+  for (it = l.holders.begin(); it != l.holders.end(); ++it) {
+    std::map<unsigned int, client>::iterator c = clients.find(it->first);
+    if (it->second > now() && c != clients.end() && !c->second.addr.empty()) {
+      callback cb = { DROP_ATTR, id, it->first, 0, it->second };
+      queue_call(cb);
+    }
+  }
+  for (;;) {
+    double until = 0, t = now();
+    for (it = l.holders.begin(); it != l.holders.end(); ++it)
+      until = std::max(until, it->second);
+    if (until <= t)
+      break;
+    struct timespec ts;
+    ts.tv_sec = (time_t)until;
+    ts.tv_nsec = (long)((until - ts.tv_sec) * 1e9);
+    ml.wait(&lease_c, LK_CLAIM, &ts);
+  }
+  l.holders.clear();
+}
+
+int extent_server::create(uint32_t type, extent_protocol::extentid_t parent,
+                          extent_protocol::extentid_t &id)
+{
+  // alloc a new inode near its parent directory and return inum
   printf("extent_server: create inode\n");
-  id = im->alloc_inode(type);
+  id = im->alloc_inode(type, parent & 0x7fffffff);
 
   return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+int extent_server::put(extent_protocol::extentid_t id, std::string buf,
+                       unsigned int clt, int &)
 {
   id &= 0x7fffffff;
   
   const char * cbuf = buf.c_str();
   int size = buf.size();
+  claim(id, 0);
+  begin_change(id, clt);
   im->write_file(id, cbuf, size);
+  unclaim(id);
   
   return extent_protocol::OK;
 }
@@ -39,6 +286,8 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
   printf("extent_server: get %lld\n", id);
 
   id &= 0x7fffffff;
+  claim(id, 0);
+  unclaim(id);
 
   int size = 0;
   char *cbuf = NULL;
@@ -59,6 +308,8 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
   printf("extent_server: getattr %lld\n", id);
 
   id &= 0x7fffffff;
+  claim(id, 0);
+  unclaim(id);
   
   extent_protocol::attr attr;
   memset(&attr, 0, sizeof(attr));
@@ -68,13 +319,187 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
   return extent_protocol::OK;
 }
 
-int extent_server::remove(extent_protocol::extentid_t id, int &)
+// getattr, granting clt a lease on the attributes, which is called
+// back at cbaddr. Leases of other clients that ran out are dropped.
+int extent_server::getattr_lease(extent_protocol::extentid_t id, unsigned int clt,
+                                 std::string cbaddr, extent_protocol::lease_attr &l)
 {
-  printf("extent_server: write %lld\n", id);
+  printf("extent_server: getattr_lease %lld\n", id);
 
   id &= 0x7fffffff;
+  claim(id, 0);
+  memset(&l.a, 0, sizeof(l.a));
+  im->getattr(id, l.a);
+  l.lease_ms = 0;
+  {
+    ProfLock ml(&lease_m, LK_LEASE);
+    lease &ls = leases[id];
+    double t = now();
+    for (std::map<unsigned int, double>::iterator it = ls.holders.begin();
+         it != ls.holders.end(); ) {
+      if (it->second <= t)
+        ls.holders.erase(it++);
+      else
+        ++it;
+    }
+    if (l.a.type != 0 && lease_ms > 0) {
+      ls.holders[clt] = t + lease_ms / 1000.0;
+      clients[clt].addr = cbaddr;
+      l.lease_ms = lease_ms;
+    }
+  }
+  unclaim(id);
+  if(l.a.type == 0)
+    return extent_protocol::NOENT;
+  return extent_protocol::OK;
+}
+
+int extent_server::remove(extent_protocol::extentid_t id, unsigned int clt, int &)
+{
+  printf("extent_server: remove %lld\n", id);
+
+  id &= 0x7fffffff;
+  claim(id, clt);
+  begin_change(id, clt);
   im->remove_file(id);
+  unclaim(id);
  
   return extent_protocol::OK;
 }
 
+int extent_server::read(extent_protocol::extentid_t id, unsigned int off,
+                        unsigned int len, std::string &buf)
+{
+  printf("extent_server: read %lld off %u len %u\n", id, off, len);
+
+  id &= 0x7fffffff;
+  claim(id, 0);
+  unclaim(id);
+  im->read_range(id, off, len, buf);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::write(extent_protocol::extentid_t id, unsigned int off,
+                         std::string buf, unsigned int clt, int &)
+{
+  printf("extent_server: write %lld off %u len %zu\n", id, off, buf.size());
+
+  id &= 0x7fffffff;
+  claim(id, 0);
+  begin_change(id, clt);
+  im->write_range(id, off, buf.data(), buf.size());
+  unclaim(id);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::truncate(extent_protocol::extentid_t id, unsigned int size,
+                            unsigned int clt, int &)
+{
+  printf("extent_server: truncate %lld size %u\n", id, size);
+
+  id &= 0x7fffffff;
+  claim(id, 0);
+  begin_change(id, clt);
+  im->truncate(id, size);
+  unclaim(id);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::statfs(uint32_t, extent_protocol::fsstat &st)
+{
+  im->statfs(st);
+
+  return extent_protocol::OK;
+}
+
+// Make dst a copy of src that shares its blocks until either is written.
+int extent_server::clone(extent_protocol::extentid_t src, extent_protocol::extentid_t dst,
+                         unsigned int clt, int &)
+{
+  printf("extent_server: clone %lld to %lld\n", src, dst);
+
+  src &= 0x7fffffff;
+  dst &= 0x7fffffff;
+  if(src == dst)
+    return extent_protocol::OK;
+  // claimed in order, as two clones may work on the same two extents
+  claim(std::min(src, dst), 0);
+  claim(std::max(src, dst), 0);
+  begin_change(dst, clt);
+  bool ok = im->clone(src, dst);
+  unclaim(src);
+  unclaim(dst);
+  if(!ok)
+    return extent_protocol::IOERR;
+
+  return extent_protocol::OK;
+}
+
+// Hand client clt the attributes and content of id to cache, taking
+// them back from any other client first. cbaddr is where clt takes
+// recall calls.
+int extent_server::fetch(extent_protocol::extentid_t id, unsigned int clt,
+                         std::string cbaddr, extent_protocol::extent &e)
+{
+  printf("extent_server: fetch %lld for %u\n", id, clt);
+
+  {
+    ProfLock ml(&lease_m, LK_LEASE);
+    clients[clt].addr = cbaddr;
+  }
+
+  id &= 0x7fffffff;
+  claim(id, clt);
+  memset(&e.a, 0, sizeof(e.a));
+  e.epoch = 0;
+  im->getattr(id, e.a);
+  if (e.a.type == 0) {
+    unclaim(id);
+    return extent_protocol::NOENT;
+  }
+  begin_change(id, clt);
+  int size = 0;
+  char *cbuf = NULL;
+  im->read_file(id, &cbuf, &size);
+  if (size == 0)
+    e.data = "";
+  else {
+    e.data.assign(cbuf, size);
+    free(cbuf);
+  }
+  e.epoch = unclaim(id, clt);
+
+  return extent_protocol::OK;
+}
+
+// Client clt gives up id, which it cached under epoch, with its content
+// if it changed it. Ignored if id was called back from clt meanwhile;
+// IOERR if that failed, so the changes were lost.
+int extent_server::release(extent_protocol::extentid_t id, unsigned int clt,
+                           unsigned int epoch, extent_protocol::writeback wb, int &)
+{
+  printf("extent_server: release %lld from %u\n", id, clt);
+
+  id &= 0x7fffffff;
+  bool mine = claim(id, clt), stale;
+  {
+    ProfLock ml(&lease_m, LK_LEASE);
+    mine = mine && leases[id].epoch == epoch;
+    stale = lost.erase(epoch) > 0;
+  }
+  if (mine && wb.dirty)
+    im->write_file(id, wb.data.data(), wb.data.size());
+  unclaim(id);
+
+  if (stale && wb.dirty)
+    return extent_protocol::IOERR;
+  return extent_protocol::OK;
+}
+
+void extent_server::sync()
+{
+  im->sync();
+}
@@ -5,9 +5,45 @@
 
 #include <string>
 #include <map>
+#include <list>
+#include <set>
+#include <pthread.h>
 #include "extent_protocol.h"
 #include "inode_manager.h"
 
+// How long a client may cache the attributes getattr_lease returns.
+// A change to an extent first calls back the leases that other clients
+// hold on it, waiting for each until it is given up or runs out, so no
+// client sees attributes older than the last change it could have
+// seen. A client changing an extent drops its own copy, so it does not
+// wait for itself. Clients are told apart by their RPC nonce.
+//
+// A client may also cache an extent whole, with fetch, and change it
+// without telling the server, until it gives it up with release or
+// the server calls it back with recall, as another request wants the
+// extent. One request at a time works on an extent, which first gets
+// back any content its client cached and changed.
+//
+// Each fetch hands the extent out under a new epoch, which recall and
+// release name, so a client answering late is not taken for one that
+// fetched the extent again since.
+//
+// Handlers never call clients themselves: each client has a queue of
+// calls to it, made in turn by a thread of its own while there are any,
+// and a handler queues its call and waits for it. So a slow or dead
+// client holds up only the requests that wait for it. A recall not
+// answered within RECALL_MS is made again, with twice as long each
+// time, while the client can still be connected to, up to RECALL_TRIES
+// times in all, which ends within the 10 s a request waits for its
+// reply by default. After that the client is taken to be gone: what it
+// cached is taken back as it was on the server, and if it turns up
+// later to release that epoch with changes, it is told IOERR, so it
+// drops its copy and reports the changes lost instead of serving them
+// on.
+#define ATTR_LEASE_MS 100
+#define RECALL_MS 1000
+#define RECALL_TRIES 3
+
 class extent_server {
  protected:
 #if 0
@@ -19,14 +55,82 @@ class extent_server {
 #endif
   inode_manager *im;
 
+  // Attribute leases of each extent, when each client's runs out; the
+  // client caching it, if any, and the epoch it has it under; whether a
+  // request is working on it; and whether that request waits for the
+  // extent to be called back from owner. Under lease_m.
+  struct lease {
+    std::map<unsigned int, double> holders;
+    unsigned int owner;
+    unsigned int epoch;
+    bool busy;
+    bool recalling;
+    uint64_t claimed_at;  // for lock profiling
+  };
+  std::map<extent_protocol::extentid_t, lease> leases;
+  pthread_mutex_t lease_m;
+  pthread_cond_t lease_c;
+  unsigned int lease_ms;
+  unsigned int epochs;  // handed out so far
+  std::set<unsigned int> lost;  // epochs taken back without their changes
+
+  // Each client by nonce: where it takes calls back, as it said in its
+  // last fetch or getattr_lease; the calls queued for it, a recall of an
+  // extent or a drop of the lease that runs out at expires; and whether
+  // a thread is making them. callers counts those threads. Under lease_m,
+  // but for the connection, which only the client's thread uses.
+  enum { RECALL, DROP_ATTR };
+  struct callback {
+    int what;
+    extent_protocol::extentid_t id;
+    unsigned int clt;
+    unsigned int epoch;
+    double expires;
+  };
+  struct client {
+    std::string addr;
+    std::list<callback> pending;
+    bool calling;
+    rpcc *cl;
+  };
+  std::map<unsigned int, client> clients;
+  int callers;
+  bool stopping;
+
+  void init();
+  void queue_call(const callback &cb);
+  void caller(unsigned int clt);
+  void call_back(const callback &cb);
+  bool claim(extent_protocol::extentid_t id, unsigned int clt);
+  unsigned int unclaim(extent_protocol::extentid_t id, unsigned int owner = 0);
+  void begin_change(extent_protocol::extentid_t id, unsigned int clt);
+
  public:
   extent_server();
+  extent_server(const fs_options &opts);
+  ~extent_server();
 
-  int create(uint32_t type, extent_protocol::extentid_t &id);
-  int put(extent_protocol::extentid_t id, std::string, int &);
+  void set_lease(unsigned int ms) { lease_ms = ms; }
+  int create(uint32_t type, extent_protocol::extentid_t parent,
+             extent_protocol::extentid_t &id);
+  int put(extent_protocol::extentid_t id, std::string, unsigned int clt, int &);
   int get(extent_protocol::extentid_t id, std::string &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
-  int remove(extent_protocol::extentid_t id, int &);
+  int getattr_lease(extent_protocol::extentid_t id, unsigned int clt,
+                    std::string cbaddr, extent_protocol::lease_attr &);
+  int remove(extent_protocol::extentid_t id, unsigned int clt, int &);
+  int read(extent_protocol::extentid_t id, unsigned int off, unsigned int len, std::string &);
+  int write(extent_protocol::extentid_t id, unsigned int off, std::string,
+            unsigned int clt, int &);
+  int truncate(extent_protocol::extentid_t id, unsigned int size, unsigned int clt, int &);
+  int statfs(uint32_t, extent_protocol::fsstat &);
+  int fetch(extent_protocol::extentid_t id, unsigned int clt, std::string cbaddr,
+            extent_protocol::extent &);
+  int release(extent_protocol::extentid_t id, unsigned int clt, unsigned int epoch,
+              extent_protocol::writeback, int &);
+  int clone(extent_protocol::extentid_t src, extent_protocol::extentid_t dst,
+            unsigned int clt, int &);
+  void sync();
 };
 
 #endif 
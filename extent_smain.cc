@@ -24,15 +24,98 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
+  // CHFS_IMAGE keeps the file system in a disk image that survives
+  // restarts; CHFS_DISK_SIZE sets its size in bytes and
+  // CHFS_CACHE_BLOCKS the size of the block cache. CHFS_BLOCK_SIZE and
+  // CHFS_INODES take effect when a new disk is formatted, as do
+  // CHFS_CHECKSUMS=1, which checksums every block, and
+  // CHFS_LOG_STRUCTURED=1, which writes blocks to a log. CHFS_GROUPS
+  // caps the number of allocation groups. CHFS_DELALLOC_BLOCKS and
+  // CHFS_PREALLOC_BLOCKS set how much appended data is held before it
+  // gets blocks and how many blocks a growing file reserves, 0 for
+  // none. CHFS_DEDUP=1 shares identical blocks on a log-structured
+  // disk, and CHFS_COMPRESS=1 compresses the files created from then
+  // on. CHFS_ATTR_LEASE_MS sets how long clients may cache attributes,
+  // 0 for not at all. RPC_THREADS sets how many requests are served at
+  // once.
+  fs_options opts;
+  char *image_env = getenv("CHFS_IMAGE");
+  if(image_env != NULL){
+    opts.image = image_env;
+    opts.size = 0;
+  }
+  char *size_env = getenv("CHFS_DISK_SIZE");
+  if(size_env != NULL){
+    opts.size = strtoull(size_env, NULL, 0);
+  }
+  char *cache_env = getenv("CHFS_CACHE_BLOCKS");
+  if(cache_env != NULL){
+    opts.cache_blocks = atoi(cache_env);
+  }
+  char *bsize_env = getenv("CHFS_BLOCK_SIZE");
+  if(bsize_env != NULL){
+    opts.block_size = atoi(bsize_env);
+  }
+  char *inodes_env = getenv("CHFS_INODES");
+  if(inodes_env != NULL){
+    opts.inodes = atoi(inodes_env);
+  }
+  char *csum_env = getenv("CHFS_CHECKSUMS");
+  if(csum_env != NULL){
+    opts.checksums = atoi(csum_env) != 0;
+  }
+  char *lfs_env = getenv("CHFS_LOG_STRUCTURED");
+  if(lfs_env != NULL){
+    opts.log_structured = atoi(lfs_env) != 0;
+  }
+  char *dedup_env = getenv("CHFS_DEDUP");
+  if(dedup_env != NULL){
+    opts.dedup = atoi(dedup_env) != 0;
+  }
+  char *compress_env = getenv("CHFS_COMPRESS");
+  if(compress_env != NULL){
+    opts.compress = atoi(compress_env) != 0;
+  }
+  char *groups_env = getenv("CHFS_GROUPS");
+  if(groups_env != NULL){
+    opts.groups = atoi(groups_env);
+  }
+  char *delalloc_env = getenv("CHFS_DELALLOC_BLOCKS");
+  if(delalloc_env != NULL){
+    opts.delalloc_blocks = atoi(delalloc_env);
+  }
+  char *prealloc_env = getenv("CHFS_PREALLOC_BLOCKS");
+  if(prealloc_env != NULL){
+    opts.prealloc_blocks = atoi(prealloc_env);
+  }
+
   rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  extent_server ls(opts);
+  char *lease_env = getenv("CHFS_ATTR_LEASE_MS");
+  if(lease_env != NULL){
+    ls.set_lease(atoi(lease_env));
+  }
 
   server.reg(extent_protocol::get, &ls, &extent_server::get);
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
+  server.reg(extent_protocol::getattr_lease, &ls, &extent_server::getattr_lease);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
   server.reg(extent_protocol::create, &ls, &extent_server::create);
+  server.reg(extent_protocol::read, &ls, &extent_server::read);
+  server.reg(extent_protocol::write, &ls, &extent_server::write);
+  server.reg(extent_protocol::truncate, &ls, &extent_server::truncate);
+  server.reg(extent_protocol::statfs, &ls, &extent_server::statfs);
+  server.reg(extent_protocol::clone, &ls, &extent_server::clone);
+  server.reg(extent_protocol::fetch, &ls, &extent_server::fetch);
+  server.reg(extent_protocol::release, &ls, &extent_server::release);
 
-  while(1)
-    sleep(1000);
+  // commit the journal, write cached blocks back to the image and give
+  // delayed appends their blocks every few seconds; on an in-memory
+  // disk this still hands back blocks reserved for files that stopped
+  // growing
+  while(1){
+    sleep(5);
+    ls.sync();
+  }
 }
@@ -0,0 +1,1520 @@
+// Benchmarks for the disk and inode layers.
+//
+// usage: fs_bench [-m] <bench> [args...]
+// Run without arguments to list the benchmarks. With -m every result
+// is a tab-separated line under a header naming the columns, and other
+// output is commented out with '#', for scripts that track results
+// across changes.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <set>
+#include "lang/verify.h"
+#include "inode_manager.h"
+#include "crc32c.h"
+#include "extent_client.h"
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool machine;  // -m
+
+static void report(const char *name, const char *what, long ops, double secs)
+{
+  if (machine)
+    printf("%s\t%s\t%ld\t%.6f\t%.0f\t-\t-\t-\t-\n", name, what, ops, secs, ops / secs);
+  else
+    printf("%-10s %-22s %10ld ops %9.3f s %12.0f ops/s\n",
+           name, what, ops, secs, ops / secs);
+}
+
+// Report ops timed one by one, lat holding each one's seconds, with
+// the median, 90th and 99th percentile and worst latency.
+static void report_latency(const char *name, const char *what, std::vector<double> &lat)
+{
+  double secs = 0;
+  std::sort(lat.begin(), lat.end());
+  for (size_t i = 0; i < lat.size(); i++)
+    secs += lat[i];
+  double p50 = lat[lat.size() / 2] * 1e6;
+  double p90 = lat[lat.size() * 9 / 10] * 1e6;
+  double p99 = lat[lat.size() * 99 / 100] * 1e6;
+  double worst = lat.back() * 1e6;
+
+  if (machine)
+    printf("%s\t%s\t%zu\t%.6f\t%.0f\t%.2f\t%.2f\t%.2f\t%.2f\n",
+           name, what, lat.size(), secs, lat.size() / secs, p50, p90, p99, worst);
+  else
+    printf("%-10s %-22s %10zu ops %12.0f ops/s  p50 %8.2f p90 %8.2f p99 %8.2f max %9.2f us\n",
+           name, what, lat.size(), lat.size() / secs, p50, p90, p99, worst);
+}
+
+// Print a line of other figures about a result.
+static void note(const char *name, const char *what, const char *fmt, ...)
+{
+  va_list ap;
+
+  printf(machine ? "#\t%s\t%s\t" : "%-10s %-22s ", name, what);
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+}
+
+// disk: sequential writes, random reads and the cost of flushing and
+// reopening, for the in-memory array and an mmap'ed image of the same size.
+static void bench_disk_one(const char *name, fs_options &opts)
+{
+  char buf[BLOCK_SIZE];
+  double t;
+  disk *d;
+
+  t = now();
+  d = new disk(opts);
+  report(name, "open", 1, now() - t);
+
+  uint32_t n = d->size();
+  memset(buf, 'x', sizeof(buf));
+  t = now();
+  for (uint32_t i = 0; i < n; i++) {
+    buf[0] = i;
+    d->write_block(i, buf);
+  }
+  report(name, "seq write", n, now() - t);
+
+  srandom(1);
+  t = now();
+  for (uint32_t i = 0; i < n; i++)
+    d->read_block(random() % n, buf);
+  report(name, "random read", n, now() - t);
+
+  t = now();
+  d->sync();
+  report(name, "sync", 1, now() - t);
+  delete d;
+
+  if (opts.image.empty())
+    return;
+  t = now();
+  d = new disk(opts);
+  d->read_block(n - 1, buf);
+  report(name, "reopen", 1, now() - t);
+  VERIFY(buf[0] == (char)(n - 1));
+  delete d;
+}
+
+static void bench_disk(int argc, char *argv[])
+{
+  fs_options opts;
+  opts.size = (argc > 0 ? atol(argv[0]) : 64) * 1024 * 1024;
+  std::string image = argc > 1 ? argv[1] : "fs_bench.img";
+
+  bench_disk_one("memory", opts);
+  opts.image = image;
+  unlink(image.c_str());
+  bench_disk_one("image", opts);
+  unlink(image.c_str());
+}
+
+// balloc: allocation rate as the disk fills up, then alloc/free churn
+// on a nearly full disk. The journal is off: with it, frees would wait
+// for a commit that bare block calls never make.
+static void bench_balloc(int argc, char *argv[])
+{
+  fs_options opts;
+  opts.size = (argc > 0 ? atol(argv[0]) : 64) * 1024 * 1024;
+  opts.journal = false;
+  block_manager *bm = new block_manager(opts);
+  std::vector<blockid_t> ids;
+  char what[32];
+  blockid_t id;
+  double t;
+
+  uint32_t step = bm->sb.nblocks / 10;
+  for (int pct = 10; ; pct += 10) {
+    t = now();
+    for (uint32_t i = 0; i < step; i++) {
+      id = bm->alloc_block();
+      VERIFY(id != 0);
+      ids.push_back(id);
+    }
+    snprintf(what, sizeof(what), "alloc to %d%%", pct);
+    report("balloc", what, step, now() - t);
+    if (pct == 90)
+      break;
+  }
+
+  srandom(1);
+  t = now();
+  for (uint32_t i = 0; i < step; i++) {
+    uint32_t k = random() % ids.size();
+    bm->free_block(ids[k]);
+    ids[k] = bm->alloc_block();
+    VERIFY(ids[k] != 0);
+  }
+  report("balloc", "churn at 90%", step, now() - t);
+}
+
+// ialloc: create rate with the inode table 10%, 50% and 95% full.
+// Each create is paired with freeing a random inode so the occupancy
+// stays put.
+static void bench_ialloc(int argc, char *argv[])
+{
+  long ops = argc > 0 ? atol(argv[0]) : 100000;
+  int occupancy[] = { 10, 50, 95 };
+  char what[32];
+  double t;
+
+  for (size_t i = 0; i < sizeof(occupancy) / sizeof(occupancy[0]); i++) {
+    inode_manager *im = new inode_manager();
+    std::vector<uint32_t> inums;
+    while ((int)inums.size() < INODE_NUM * occupancy[i] / 100)
+      inums.push_back(im->alloc_inode(extent_protocol::T_FILE));
+
+    srandom(1);
+    t = now();
+    for (long n = 0; n < ops; n++) {
+      uint32_t k = random() % inums.size();
+      im->free_inode(inums[k]);
+      inums[k] = im->alloc_inode(extent_protocol::T_FILE);
+    }
+    snprintf(what, sizeof(what), "create at %d%%", occupancy[i]);
+    report("ialloc", what, ops, now() - t);
+  }
+}
+
+// getattr: one getattr on each of n inodes, like ls -l on a big
+// directory, counting the block reads and the distinct inode blocks
+// the sweep touches.
+static void bench_getattr(int argc, char *argv[])
+{
+  int n = argc > 0 ? atoi(argv[0]) : INODE_NUM - 2;
+  inode_manager *im = new inode_manager();
+  std::vector<uint32_t> inums;
+  extent_protocol::attr a;
+  double t;
+
+  for (int i = 0; i < n; i++)
+    inums.push_back(im->alloc_inode(extent_protocol::T_FILE));
+
+  uint64_t reads = im->stats().reads;
+  t = now();
+  for (int i = 0; i < n; i++)
+    im->getattr(inums[i], a);
+  report("getattr", "sweep", n, now() - t);
+
+  std::set<blockid_t> touched;
+  for (int i = 0; i < n; i++)
+    touched.insert(IBLOCK(inums[i], im->super()));
+  note("getattr", "sweep", "%10llu reads %9zu blocks\n",
+       (unsigned long long)(im->stats().reads - reads), touched.size());
+}
+
+// cache: small rewrites and getattr sweeps over a set of files on an
+// image, for a range of block cache sizes.
+static void bench_cache(int argc, char *argv[])
+{
+  int rounds = argc > 0 ? atoi(argv[0]) : 200;
+  std::string image = argc > 1 ? argv[1] : "fs_bench.img";
+  uint32_t sizes[] = { 0, 64, 256, 1024, 4096 };
+  std::string data(1000, 'c');
+  extent_protocol::attr a;
+  char what[32];
+  double t;
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    fs_options opts;
+    opts.image = image;
+    opts.cache_blocks = sizes[i];
+    unlink(image.c_str());
+    inode_manager *im = new inode_manager(opts);
+    std::vector<uint32_t> inums;
+    for (int f = 0; f < 256; f++) {
+      inums.push_back(im->alloc_inode(extent_protocol::T_FILE));
+      im->write_file(inums.back(), data.data(), data.size());
+    }
+
+    srandom(1);
+    t = now();
+    for (int r = 0; r < rounds; r++) {
+      for (int w = 0; w < 64; w++)
+        im->write_file(inums[random() % inums.size()], data.data(), data.size());
+      for (size_t f = 0; f < inums.size(); f++)
+        im->getattr(inums[f], a);
+    }
+    im->sync();
+    snprintf(what, sizeof(what), "cache %u blocks", sizes[i]);
+    report("cache", what, rounds * (64 + inums.size()), now() - t);
+
+    const io_stats &st = im->stats();
+    note("cache", what, "%9.1f%% hits %8llu disk reads %8llu disk writes\n",
+         st.hits ? 100.0 * st.hits / (st.hits + st.misses) : 0.0,
+         (unsigned long long)st.disk_reads, (unsigned long long)st.disk_writes);
+  }
+  unlink(image.c_str());
+}
+
+// icache: repeated getattr sweeps with and without the inode cache,
+// counting inode cache hits, entries allocated and block reads.
+static void bench_icache(int argc, char *argv[])
+{
+  int rounds = argc > 0 ? atoi(argv[0]) : 100;
+  uint32_t sizes[] = { 0, INODE_NUM };
+  extent_protocol::attr a;
+  char what[32];
+  double t;
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    fs_options opts;
+    opts.inode_cache = sizes[i];
+    inode_manager *im = new inode_manager(opts);
+    std::vector<uint32_t> inums;
+    for (int f = 0; f < INODE_NUM - 2; f++)
+      inums.push_back(im->alloc_inode(extent_protocol::T_FILE));
+
+    inode_stats before = im->inode_cache_stats();
+    uint64_t reads = im->stats().reads;
+    t = now();
+    for (int r = 0; r < rounds; r++) {
+      for (size_t f = 0; f < inums.size(); f++)
+        im->getattr(inums[f], a);
+    }
+    long ops = rounds * inums.size();
+    snprintf(what, sizeof(what), "icache %u inodes", sizes[i]);
+    report("icache", what, ops, now() - t);
+
+    const inode_stats &st = im->inode_cache_stats();
+    uint64_t hits = st.hits - before.hits, misses = st.misses - before.misses;
+    note("icache", what, "%9.1f%% hits %8.3f allocs/op %6.3f reads/op\n",
+         100.0 * hits / (hits + misses),
+         (double)(st.allocs - before.allocs) / ops,
+         (double)(im->stats().reads - reads) / ops);
+  }
+}
+
+// journal: creates of small files on an image without a journal, with
+// a commit after every create, and with creates sharing group commits.
+static void bench_journal(int argc, char *argv[])
+{
+  int files = argc > 0 ? atoi(argv[0]) : 500;
+  std::string image = argc > 1 ? argv[1] : "fs_bench.img";
+  if (files > INODE_NUM - 2)
+    files = INODE_NUM - 2;
+  const char *modes[] = { "no journal", "commit per create", "group commit" };
+  std::string data(1000, 'j');
+  double t;
+
+  for (int mode = 0; mode < 3; mode++) {
+    fs_options opts;
+    opts.image = image;
+    opts.journal = mode > 0;
+    unlink(image.c_str());
+    inode_manager *im = new inode_manager(opts);
+
+    t = now();
+    for (int f = 0; f < files; f++) {
+      uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+      im->write_file(inum, data.data(), data.size());
+      if (mode == 1)
+        im->sync();
+    }
+    im->sync();
+    report("journal", modes[mode], files, now() - t);
+
+    const io_stats &st = im->stats();
+    note("journal", modes[mode], "%10llu commits %8.1f blocks/commit\n",
+         (unsigned long long)st.commits,
+         st.commits ? (double)st.logged / st.commits : 0.0);
+  }
+  unlink(image.c_str());
+}
+
+// blocksize: sequential write and read of one large file in 64 KB
+// ranges, on disks formatted with each block size. The work is mb
+// megabytes each way per block size; the default 32 MB run takes about
+// a second in all, and the time grows linearly with mb.
+static void bench_blocksize(int argc, char *argv[])
+{
+  uint32_t mb = argc > 0 ? atoi(argv[0]) : 32;
+  uint32_t sizes[] = { 512, 1024, 4096, 16384, 65536 };
+  uint32_t chunk = 64 * 1024;
+  std::string data(chunk, 'b'), out;
+  char what[32];
+  double t;
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    fs_options opts;
+    opts.size = (uint64_t)(mb + mb / 2 + 4) * 1024 * 1024;
+    opts.block_size = sizes[i];
+    inode_manager *im = new inode_manager(opts);
+    uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+    uint32_t len = mb * 1024 * 1024;
+
+    t = now();
+    for (uint32_t off = 0; off < len; off += chunk)
+      im->write_range(inum, off, data.data(), chunk);
+    im->sync();
+    double secs = now() - t;
+    snprintf(what, sizeof(what), "write %u B blocks", sizes[i]);
+    report("blocksize", what, len / chunk, secs);
+    note("blocksize", what, "%10u MB %9.3f s %10.1f MB/s\n", mb, secs, mb / secs);
+
+    t = now();
+    for (uint32_t off = 0; off < len; off += chunk) {
+      im->read_range(inum, off, chunk, out);
+      VERIFY(out.size() == chunk);
+    }
+    secs = now() - t;
+    snprintf(what, sizeof(what), "read %u B blocks", sizes[i]);
+    report("blocksize", what, len / chunk, secs);
+    note("blocksize", what, "%10u MB %9.3f s %10.1f MB/s\n", mb, secs, mb / secs);
+  }
+}
+
+// vector: moving a large contiguous extent through block_manager one
+// block per call and as runs of up to 128 blocks, on an image.
+static void bench_vector(int argc, char *argv[])
+{
+  uint32_t mb = argc > 0 ? atoi(argv[0]) : 32;
+  std::string image = argc > 1 ? argv[1] : "fs_bench.img";
+  fs_options opts;
+  opts.image = image;
+  opts.size = (uint64_t)(mb + 8) * 1024 * 1024;
+  opts.cache_blocks = 0;
+  opts.groups = 1;  // runs stay within a group
+  unlink(image.c_str());
+  block_manager *bm = new block_manager(opts);
+  uint32_t bs = bm->sb.block_size, n = mb * (1024 * 1024 / bs), len;
+  std::vector<char> buf((size_t)n * bs, 'v');
+  double t;
+
+  blockid_t start = bm->alloc_run(0, AG_ANY, n, len);
+  VERIFY(len == n);
+
+  t = now();
+  for (uint32_t i = 0; i < n; i++)
+    bm->write_block(start + i, &buf[(size_t)i * bs]);
+  bm->sync(bm->sb.free_inodes);
+  report("vector", "write per block", n, now() - t);
+
+  t = now();
+  for (uint32_t i = 0; i < n; i += 128)
+    bm->write_blocks(start + i, std::min(128U, n - i), &buf[(size_t)i * bs]);
+  bm->sync(bm->sb.free_inodes);
+  report("vector", "write in runs", n, now() - t);
+
+  t = now();
+  for (uint32_t i = 0; i < n; i++)
+    bm->read_block(start + i, &buf[(size_t)i * bs]);
+  report("vector", "read per block", n, now() - t);
+
+  t = now();
+  for (uint32_t i = 0; i < n; i += 128)
+    bm->read_blocks(start + i, std::min(128U, n - i), &buf[(size_t)i * bs]);
+  report("vector", "read in runs", n, now() - t);
+  unlink(image.c_str());
+}
+
+// sparse: presizing a file and filling in scattered 4 KB pieces, with
+// the size set by writing zeros and by truncating up to a hole.
+static void bench_sparse(int argc, char *argv[])
+{
+  uint32_t mb = argc > 0 ? atoi(argv[0]) : 8;
+  const char *modes[] = { "zero fill", "hole" };
+  std::string piece(4096, 's');
+  char what[32];
+  double t;
+
+  for (int mode = 0; mode < 2; mode++) {
+    fs_options opts;
+    opts.size = (uint64_t)(mb + 8) * 1024 * 1024;
+    inode_manager *im = new inode_manager(opts);
+    uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+    uint32_t size = mb * 1024 * 1024;
+    extent_protocol::fsstat before, after;
+    im->statfs(before);
+
+    t = now();
+    if (mode == 0) {
+      std::string zeros(size, '\0');
+      im->write_file(inum, zeros.data(), zeros.size());
+    } else {
+      im->truncate(inum, size);
+    }
+    snprintf(what, sizeof(what), "%s presize", modes[mode]);
+    report("sparse", what, 1, now() - t);
+
+    srandom(1);
+    t = now();
+    for (int i = 0; i < 256; i++)
+      im->write_range(inum, random() % (size / 4096) * 4096, piece.data(), piece.size());
+    snprintf(what, sizeof(what), "%s fill", modes[mode]);
+    report("sparse", what, 256, now() - t);
+
+    im->sync();
+    im->statfs(after);
+    note("sparse", what, "%10.1f MB allocated\n",
+         (double)(before.free_blocks - after.free_blocks) * after.block_size / (1024 * 1024));
+  }
+}
+
+// smallfile: reads of symlink-sized files kept in a data block and
+// inline in their inode, with the block and inode caches off so every
+// read goes to the disk.
+static void bench_smallfile(int argc, char *argv[])
+{
+  int files = argc > 0 ? atoi(argv[0]) : 1000;
+  std::string data("../../some/where/else/link-target");
+  char what[32];
+  double t;
+
+  for (int inl = 0; inl < 2; inl++) {
+    fs_options opts;
+    opts.inodes = std::max(files + 2, INODE_NUM);
+    opts.cache_blocks = 0;
+    opts.inode_cache = 0;
+    opts.inline_data = inl;
+    inode_manager *im = new inode_manager(opts);
+    std::vector<uint32_t> inums;
+    for (int f = 0; f < files; f++) {
+      inums.push_back(im->alloc_inode(extent_protocol::T_SYMLINK));
+      im->write_file(inums.back(), data.data(), data.size());
+    }
+
+    uint64_t reads = im->stats().reads;
+    t = now();
+    for (int r = 0; r < 10; r++) {
+      for (size_t f = 0; f < inums.size(); f++) {
+        char *buf = NULL;
+        int size = 0;
+        im->read_file(inums[f], &buf, &size);
+        free(buf);
+      }
+    }
+    long ops = 10 * inums.size();
+    snprintf(what, sizeof(what), "%s", inl ? "inline" : "data block");
+    report("smallfile", what, ops, now() - t);
+    note("smallfile", what, "%9.3f reads/op\n", (double)(im->stats().reads - reads) / ops);
+  }
+}
+
+// inode: latency of each inode_manager call, with files from empty up
+// to half of the free space or MAXFILE. For each size a batch of files
+// is created, written whole, read back, stat'ed and removed. A size
+// that does not fit the free space is skipped.
+static void bench_inode(int argc, char *argv[])
+{
+  int files = argc > 0 ? atoi(argv[0]) : 1000;
+  uint32_t mb = argc > 1 ? atoi(argv[1]) : 64;
+  fs_options opts;
+  opts.size = (uint64_t)mb * 1024 * 1024;
+  opts.inodes = std::max(files + 2, INODE_NUM);
+  inode_manager *im = new inode_manager(opts);
+  extent_protocol::fsstat st;
+  im->statfs(st);
+  uint64_t room = (uint64_t)st.free_blocks * st.block_size;
+  uint64_t maxfile = (uint64_t)MAXFILE(im->super()) * im->super().block_size;
+  uint64_t sizes[] = { 0, 40, 1024, 16384, 262144, 4194304,
+                       std::min<uint64_t>(maxfile, room / 2) };
+  uint64_t done = 0;  // largest size run so far
+  extent_protocol::attr a;
+  char what[32];
+  double t;
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    uint64_t size = sizes[i];
+    if (i > 0 && size <= done)
+      continue;
+    // a batch takes at most half the free space, leaving the rest for
+    // the files' maps and the journal
+    int n = std::min<uint64_t>(files, room / 2 / std::max<uint64_t>(size, 1));
+    if (n == 0) {
+      snprintf(what, sizeof(what), "%llu B", (unsigned long long)size);
+      note("inode", what, "skipped, twice the size is more than the %llu KB free\n",
+           (unsigned long long)(room / 1024));
+      continue;
+    }
+    done = size;
+    std::string data(size, 'i');
+    std::vector<uint32_t> inums(n);
+    std::vector<double> lat(n);
+
+    for (int f = 0; f < n; f++) {
+      t = now();
+      inums[f] = im->alloc_inode(extent_protocol::T_FILE);
+      lat[f] = now() - t;
+    }
+    snprintf(what, sizeof(what), "alloc_inode %llu B", (unsigned long long)size);
+    report_latency("inode", what, lat);
+
+    for (int f = 0; f < n; f++) {
+      t = now();
+      im->write_file(inums[f], data.data(), size);
+      lat[f] = now() - t;
+    }
+    snprintf(what, sizeof(what), "write_file %llu B", (unsigned long long)size);
+    report_latency("inode", what, lat);
+
+    for (int f = 0; f < n; f++) {
+      char *buf = NULL;
+      int got = 0;
+      t = now();
+      im->read_file(inums[f], &buf, &got);
+      lat[f] = now() - t;
+      VERIFY((uint64_t)got == size);
+      free(buf);
+    }
+    snprintf(what, sizeof(what), "read_file %llu B", (unsigned long long)size);
+    report_latency("inode", what, lat);
+
+    for (int f = 0; f < n; f++) {
+      t = now();
+      im->getattr(inums[f], a);
+      lat[f] = now() - t;
+    }
+    snprintf(what, sizeof(what), "getattr %llu B", (unsigned long long)size);
+    report_latency("inode", what, lat);
+
+    for (int f = 0; f < n; f++) {
+      t = now();
+      im->remove_file(inums[f]);
+      lat[f] = now() - t;
+    }
+    snprintf(what, sizeof(what), "remove_file %llu B", (unsigned long long)size);
+    report_latency("inode", what, lat);
+    im->sync();
+  }
+  delete im;
+}
+
+// append: logs growing by small appends in turn, as a server's logs
+// do, with neither delayed allocation nor preallocation, with each on
+// its own and with both. Reports the allocator calls per MB written
+// and, once synced, the extents each file ended up in.
+static void bench_append(int argc, char *argv[])
+{
+  int files = argc > 0 ? atoi(argv[0]) : 16;
+  uint32_t kb = argc > 1 ? atoi(argv[1]) : 1024;
+  uint32_t step = 300;  // bytes per append
+  struct { const char *name; uint32_t delalloc, prealloc; } modes[] = {
+    { "none", 0, 0 }, { "delalloc", 64, 0 }, { "prealloc", 0, 256 },
+    { "both", 64, 256 },
+  };
+  std::string data(step, 'a');
+  char what[32];
+  double t;
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    fs_options opts;
+    opts.size = (uint64_t)files * kb * 1024 * 2 + 16 * 1024 * 1024;
+    opts.delalloc_blocks = modes[i].delalloc;
+    opts.prealloc_blocks = modes[i].prealloc;
+    inode_manager *im = new inode_manager(opts);
+    std::vector<uint32_t> inums(files);
+    uint64_t extents = 0, allocs;
+    long ops = 0;
+
+    for (int f = 0; f < files; f++)
+      inums[f] = im->alloc_inode(extent_protocol::T_FILE);
+    allocs = im->stats().allocs;
+    t = now();
+    for (uint32_t off = 0; off + step <= kb * 1024; off += step) {
+      for (int f = 0; f < files; f++) {
+        im->write_range(inums[f], off, data.data(), step);
+        ops++;
+      }
+    }
+    // the second sync gives back what is reserved past the ends
+    im->sync();
+    im->sync();
+    double secs = now() - t;
+    allocs = im->stats().allocs - allocs;
+    for (int f = 0; f < files; f++)
+      extents += im->fragments(inums[f]);
+
+    snprintf(what, sizeof(what), "%d files %s", files, modes[i].name);
+    report("append", what, ops, secs);
+    note("append", what, "%.1f allocs/MB, %.2f extents per file\n",
+         allocs / ((double)ops * step / (1024 * 1024)), (double)extents / files);
+  }
+}
+
+struct groups_writer {
+  inode_manager *im;
+  int files;
+  uint32_t dir;
+  uint32_t off;  // where the next append to the last file goes
+  std::vector<uint32_t> inums;
+};
+
+// Append 4 KB to a groups writer's file, starting the next file in its
+// directory once the last one holds 256 KB. Returns false when done.
+static bool groups_writer_step(groups_writer *gw)
+{
+  static const std::string data(4096, 'g');
+
+  if (gw->inums.empty() || gw->off == 64 * 4096) {
+    if ((int)gw->inums.size() == gw->files)
+      return false;
+    gw->inums.push_back(gw->im->alloc_inode(extent_protocol::T_FILE, gw->dir));
+    gw->off = 0;
+  }
+  gw->im->write_range(gw->inums.back(), gw->off, data.data(), data.size());
+  gw->off += data.size();
+  return true;
+}
+
+static void *groups_writer_run(void *arg)
+{
+  while (groups_writer_step((groups_writer *)arg))
+    ;
+  return NULL;
+}
+
+// groups: writers filling 256 KB files by 4 KB appends, each in a
+// directory of its own, with a single allocation group and with as
+// many as fit. The writers run as threads, and then take turns in one
+// thread, which interleaves their appends the way busy writers would
+// on many CPUs. With one group the files' blocks interleave; with
+// more, each directory gets a group and its files stay in few extents.
+static void bench_groups(int argc, char *argv[])
+{
+  int writers = argc > 0 ? atoi(argv[0]) : 8;
+  int files = argc > 1 ? atoi(argv[1]) : 16;
+  uint32_t ngroups[] = { 1, 0 };
+  char what[40];
+  double t;
+
+  for (size_t i = 0; i < sizeof(ngroups) / sizeof(ngroups[0]); i++) {
+    for (int turns = 0; turns < 2; turns++) {
+      fs_options opts;
+      opts.size = (uint64_t)writers * files * 64 * 4096 * 2 + 16 * 1024 * 1024;
+      opts.inodes = std::max(writers * (files + 1) + 2, INODE_NUM);
+      opts.groups = ngroups[i];
+      // placement alone, without appends being batched
+      opts.delalloc_blocks = 0;
+      opts.prealloc_blocks = 0;
+      inode_manager *im = new inode_manager(opts);
+      std::vector<pthread_t> th(writers);
+      std::vector<groups_writer> gw(writers);
+      uint64_t extents = 0;
+
+      for (int w = 0; w < writers; w++) {
+        gw[w].im = im;
+        gw[w].files = files;
+        gw[w].dir = im->alloc_inode(extent_protocol::T_DIR, 1);
+        gw[w].off = 0;
+      }
+      t = now();
+      if (turns) {
+        for (bool more = true; more; ) {
+          more = false;
+          for (int w = 0; w < writers; w++)
+            more |= groups_writer_step(&gw[w]);
+        }
+      } else {
+        for (int w = 0; w < writers; w++)
+          VERIFY(pthread_create(&th[w], NULL, groups_writer_run, &gw[w]) == 0);
+        for (int w = 0; w < writers; w++)
+          VERIFY(pthread_join(th[w], NULL) == 0);
+      }
+      double secs = now() - t;
+
+      for (int w = 0; w < writers; w++) {
+        for (int f = 0; f < files; f++)
+          extents += im->fragments(gw[w].inums[f]);
+      }
+      snprintf(what, sizeof(what), "%d %s %u groups", writers,
+               turns ? "in turn" : "threads", im->alloc_groups());
+      report("groups", what, (long)writers * files * 64, secs);
+      note("groups", what, "%.2f extents per file\n",
+           (double)extents / (writers * files));
+    }
+  }
+}
+
+// csum: the CRC32C kernels on 4 KB blocks, then files written and read
+// back on an image with 4 KB blocks, without and with block checksums.
+// The block cache is small, so reads come from the disk and are
+// checked. Then a few blocks of the image are damaged behind the file
+// system's back and the file read again. Last, the file is read on a
+// mount whose cache holds it, where blocks are checked only as they
+// are loaded.
+static void bench_csum(int argc, char *argv[])
+{
+  uint32_t mb = argc > 0 ? atoi(argv[0]) : 32;
+  std::string image = argc > 1 ? argv[1] : "fs_bench.img";
+  uint32_t chunk = 64 * 1024, len = mb * 1024 * 1024;
+  std::string data(chunk, 'k'), out;
+  std::vector<char> block(4096);
+  double t, secs[2][3];
+  volatile uint32_t sink = 0;
+  const int kernel_ops = 200000;
+  char what[32];
+
+  for (size_t i = 0; i < block.size(); i++)
+    block[i] = random();
+  for (int hw = 1; hw >= 0; hw--) {
+    if (hw && !crc32c_hw())
+      continue;
+    t = now();
+    for (int i = 0; i < kernel_ops; i++)
+      sink = hw ? crc32c(sink, &block[0], block.size())
+                : crc32c_sw(sink, &block[0], block.size());
+    double s = now() - t;
+    snprintf(what, sizeof(what), "crc32c %s 4k", hw ? "sse4.2" : "table");
+    report("csum", what, kernel_ops, s);
+    note("csum", what, "%10.2f GB/s\n", kernel_ops * 4096.0 / s / 1e9);
+  }
+
+  for (int cs = 0; cs < 2; cs++) {
+    fs_options opts;
+    opts.image = image;
+    opts.size = (uint64_t)(mb + mb / 4 + 8) * 1024 * 1024;
+    opts.block_size = 4096;
+    opts.cache_blocks = 64;
+    opts.checksums = cs;
+    unlink(image.c_str());
+    inode_manager *im = new inode_manager(opts);
+    uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+
+    t = now();
+    for (uint32_t off = 0; off < len; off += chunk)
+      im->write_range(inum, off, data.data(), chunk);
+    im->sync();
+    secs[cs][0] = now() - t;
+    snprintf(what, sizeof(what), "write %s", cs ? "checksums" : "plain");
+    report("csum", what, len / chunk, secs[cs][0]);
+
+    t = now();
+    for (int pass = 0; pass < 4; pass++) {
+      for (uint32_t off = 0; off < len; off += chunk) {
+        im->read_range(inum, off, chunk, out);
+        VERIFY(out.size() == chunk);
+      }
+    }
+    secs[cs][1] = now() - t;
+    snprintf(what, sizeof(what), "read %s", cs ? "checksums" : "plain");
+    report("csum", what, 4 * (len / chunk), secs[cs][1]);
+    if (cs) {
+      note("csum", "overhead", "%9.1f%% write %9.1f%% read %8.3f us per block read\n",
+           100 * (secs[1][0] / secs[0][0] - 1), 100 * (secs[1][1] / secs[0][1] - 1),
+           (secs[1][1] - secs[0][1]) * 1e6 / (4.0 * len / 4096));
+
+      // one byte in each of 4 of the file's blocks, spread over its
+      // first half, which the small cache no longer holds
+      int fd = open(image.c_str(), O_RDWR);
+      VERIFY(fd >= 0);
+      for (int i = 0; i < 4; i++) {
+        blockid_t id = im->block_of(inum, (i + 1) * (len / 4096) / 10);
+        VERIFY(id != 0);
+        off_t off = (off_t)id * 4096 + 100;
+        char c;
+        VERIFY(pread(fd, &c, 1, off) == 1);
+        c ^= 0x20;
+        VERIFY(pwrite(fd, &c, 1, off) == 1);
+      }
+      close(fd);
+      uint64_t errors = im->stats().csum_errors;
+      for (uint32_t off = 0; off < len; off += chunk)
+        im->read_range(inum, off, chunk, out);
+      note("csum", "damaged", "%10llu of 4 damaged blocks caught\n",
+           (unsigned long long)(im->stats().csum_errors - errors));
+    }
+
+    // again on a mount whose cache holds the file: the first pass loads
+    // and checks it, the rest are cache hits that check nothing
+    delete im;
+    opts.cache_blocks = len / 4096 + 1024;
+    im = new inode_manager(opts);
+    for (uint32_t off = 0; off < len; off += chunk)
+      im->read_range(inum, off, chunk, out);
+    t = now();
+    for (int pass = 0; pass < 4; pass++) {
+      for (uint32_t off = 0; off < len; off += chunk) {
+        im->read_range(inum, off, chunk, out);
+        VERIFY(out.size() == chunk);
+      }
+    }
+    secs[cs][2] = now() - t;
+    snprintf(what, sizeof(what), "reread %s", cs ? "checksums" : "plain");
+    report("csum", what, 4 * (len / chunk), secs[cs][2]);
+    if (cs)
+      note("csum", "overhead", "%9.1f%% reread\n", 100 * (secs[1][2] / secs[0][2] - 1));
+    delete im;
+  }
+  unlink(image.c_str());
+}
+
+// randwrite: 4 KB overwrites at random offsets of a file, synced every
+// 1024 writes, on an image laid out in place and log-structured, then
+// the file read back in order. Reports how many disk writes did not
+// follow on from the one before, and for the log what the cleaner
+// moved.
+static void bench_randwrite(int argc, char *argv[])
+{
+  uint32_t mb = argc > 0 ? atoi(argv[0]) : 16;
+  std::string image = argc > 1 ? argv[1] : "fs_bench.img";
+  uint32_t nblocks = mb * 256, ops = 2 * nblocks;
+  std::string data(4096, 'r'), out;
+  char what[32];
+  double t;
+
+  for (int lfs = 0; lfs < 2; lfs++) {
+    fs_options opts;
+    opts.image = image;
+    opts.size = (uint64_t)(2 * mb + 8) * 1024 * 1024;
+    opts.block_size = 4096;
+    opts.cache_blocks = 256;
+    opts.log_structured = lfs;
+    unlink(image.c_str());
+    inode_manager *im = new inode_manager(opts);
+    uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+    for (uint32_t b = 0; b < nblocks; b++)
+      im->write_range(inum, b * 4096, data.data(), data.size());
+    im->sync();
+
+    const io_stats &st = im->stats();
+    uint64_t seeks = st.seeks, writes = st.disk_writes;
+    srandom(1);
+    t = now();
+    for (uint32_t i = 0; i < ops; i++) {
+      data[0] = i;
+      im->write_range(inum, random() % nblocks * 4096, data.data(), data.size());
+      if (i % 1024 == 1023)
+        im->sync();
+    }
+    im->sync();
+    snprintf(what, sizeof(what), "write %s", lfs ? "log" : "in place");
+    report("randwrite", what, ops, now() - t);
+    note("randwrite", what, "%8.1f%% of %llu disk writes seek, cleaner moved %llu blocks\n",
+         100.0 * (st.seeks - seeks) / (st.disk_writes - writes),
+         (unsigned long long)(st.disk_writes - writes), (unsigned long long)st.moved);
+
+    t = now();
+    for (uint32_t b = 0; b < nblocks; b += 16)
+      im->read_range(inum, b * 4096, 16 * 4096, out);
+    snprintf(what, sizeof(what), "read %s", lfs ? "log" : "in place");
+    report("randwrite", what, nblocks / 16, now() - t);
+    delete im;
+  }
+  unlink(image.c_str());
+}
+
+// dedup: a mixed corpus of 256 KB files, four in ten of random bytes,
+// three in ten copies of earlier ones, two in ten copies with one
+// block in eight changed and the rest all zeros, written in place, to
+// a log and to a log with dedup, synced, then read back and checked.
+// Reports how many blocks the block map points at per slot they take.
+static void bench_dedup(int argc, char *argv[])
+{
+  uint32_t mb = argc > 0 ? atoi(argv[0]) : 32;
+  std::string image = argc > 1 ? argv[1] : "fs_bench.img";
+  uint32_t flen = 256 * 1024, nfiles = mb * 4;
+  std::vector<std::string> corpus(nfiles);
+  std::vector<uint32_t> inums(nfiles);
+  std::string out;
+  char what[32];
+  double t;
+
+  srandom(1);
+  for (uint32_t i = 0; i < nfiles; i++) {
+    uint32_t kind = random() % 10;
+    if (i == 0 || kind < 4) {
+      corpus[i].resize(flen);
+      for (uint32_t k = 0; k < flen; k++)
+        corpus[i][k] = random();
+    } else if (kind < 9) {
+      corpus[i] = corpus[random() % i];
+      for (uint32_t b = 0; kind >= 7 && b < flen / 4096; b += 8)
+        corpus[i][b * 4096 + random() % 4096] ^= 1;
+    } else {
+      corpus[i].assign(flen, 0);
+    }
+  }
+
+  for (int mode = 0; mode < 3; mode++) {
+    fs_options opts;
+    opts.image = image;
+    opts.size = (uint64_t)(3 * mb + 8) * 1024 * 1024;
+    opts.block_size = 4096;
+    opts.cache_blocks = 256;
+    opts.log_structured = mode > 0;
+    opts.dedup = mode == 2;
+    unlink(image.c_str());
+    inode_manager *im = new inode_manager(opts);
+
+    t = now();
+    for (uint32_t i = 0; i < nfiles; i++) {
+      inums[i] = im->alloc_inode(extent_protocol::T_FILE);
+      im->write_range(inums[i], 0, corpus[i].data(), flen);
+    }
+    im->sync();
+    double secs = now() - t;
+    const char *name = mode == 0 ? "in place" : mode == 1 ? "log" : "log dedup";
+    snprintf(what, sizeof(what), "write %s", name);
+    report("dedup", what, nfiles, secs);
+    uint32_t blocks, slots;
+    im->map_usage(blocks, slots);
+    if (mode == 0)
+      note("dedup", what, "%8.1f MB/s\n", (double)nfiles * flen / secs / 1e6);
+    else
+      note("dedup", what, "%8.1f MB/s, %u blocks in %u slots, ratio %.2f\n",
+           (double)nfiles * flen / secs / 1e6, blocks, slots,
+           slots ? (double)blocks / slots : 1.0);
+
+    t = now();
+    for (uint32_t i = 0; i < nfiles; i++) {
+      im->read_range(inums[i], 0, flen, out);
+      VERIFY(out == corpus[i]);
+    }
+    snprintf(what, sizeof(what), "read %s", name);
+    report("dedup", what, nfiles, now() - t);
+    delete im;
+  }
+  unlink(image.c_str());
+}
+
+// compress: files made of the text in the novels directory, written in
+// 64 KB pieces to plain and to compressed files on an image with 4 KB
+// blocks, synced and read back with a small block cache. Reports the
+// blocks the files take and the blocks moved to and from the disk.
+static void bench_compress(int argc, char *argv[])
+{
+  uint32_t mb = argc > 0 ? atoi(argv[0]) : 32;
+  std::string dir = argc > 1 ? argv[1] : "novels";
+  std::string image = "fs_bench.img";
+  const char *novels[] = { "being_ernest.txt", "dorian_gray.txt", "frankenstein.txt",
+                           "metamorphosis.txt", "sherlock_holmes.txt", "tom_sawyer.txt" };
+  uint32_t chunk = 64 * 1024, flen = 256 * 1024, nfiles = mb * 4;
+  std::string text, out;
+  char what[32];
+  double t;
+
+  for (size_t i = 0; i < sizeof(novels) / sizeof(novels[0]); i++) {
+    std::string path = dir + "/" + novels[i];
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == NULL) {
+      printf("compress: cannot read %s\n", path.c_str());
+      return;
+    }
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+      text.append(buf, n);
+    fclose(f);
+  }
+  // each file is the text from a different place on
+  std::vector<std::string> corpus(nfiles);
+  srandom(1);
+  for (uint32_t i = 0; i < nfiles; i++) {
+    size_t from = random() % text.size();
+    while (corpus[i].size() < flen)
+      corpus[i] += text.substr(from) + text.substr(0, from);
+    corpus[i].resize(flen);
+  }
+
+  for (int zc = 0; zc < 2; zc++) {
+    fs_options opts;
+    opts.image = image;
+    opts.size = (uint64_t)(2 * mb + 8) * 1024 * 1024;
+    opts.block_size = 4096;
+    opts.cache_blocks = 64;
+    opts.compress = zc;
+    unlink(image.c_str());
+    inode_manager *im = new inode_manager(opts);
+    const io_stats &st = im->stats();
+    extent_protocol::fsstat before, after;
+    std::vector<uint32_t> inums(nfiles);
+    im->statfs(before);
+
+    uint64_t writes = st.disk_writes;
+    t = now();
+    for (uint32_t i = 0; i < nfiles; i++) {
+      inums[i] = im->alloc_inode(extent_protocol::T_FILE);
+      for (uint32_t off = 0; off < flen; off += chunk)
+        im->write_range(inums[i], off, corpus[i].data() + off, chunk);
+    }
+    im->sync();
+    double secs = now() - t;
+    im->sync();  // gives back the blocks reserved past the files' ends
+    im->statfs(after);
+    snprintf(what, sizeof(what), "write %s", zc ? "compressed" : "plain");
+    report("compress", what, nfiles * (flen / chunk), secs);
+    note("compress", what, "%8.1f MB/s, %u blocks used, %llu written\n",
+         (double)nfiles * flen / secs / 1e6, before.free_blocks - after.free_blocks,
+         (unsigned long long)(st.disk_writes - writes));
+
+    uint64_t reads = st.disk_reads;
+    t = now();
+    for (uint32_t i = 0; i < nfiles; i++) {
+      for (uint32_t off = 0; off < flen; off += chunk) {
+        im->read_range(inums[i], off, chunk, out);
+        VERIFY(out.compare(0, chunk, corpus[i], off, chunk) == 0);
+      }
+    }
+    secs = now() - t;
+    snprintf(what, sizeof(what), "read %s", zc ? "compressed" : "plain");
+    report("compress", what, nfiles * (flen / chunk), secs);
+    note("compress", what, "%8.1f MB/s, %llu blocks read\n",
+         (double)nfiles * flen / secs / 1e6, (unsigned long long)(st.disk_reads - reads));
+  }
+  unlink(image.c_str());
+}
+
+// clone: a file written and synced, then copied by reading it whole
+// and writing it to a new file, as a client does with get and put, and
+// cloned to another; then writes of 4 KB at random offsets to the
+// clone, which copy the blocks they touch. Reports the blocks each
+// step takes and checks that the original is left as it was.
+static void bench_clone(int argc, char *argv[])
+{
+  uint32_t mb = argc > 0 ? atoi(argv[0]) : 64;
+  std::string image = argc > 1 ? argv[1] : "fs_bench.img";
+  uint32_t flen = mb * 1024 * 1024, writes = 1024;
+  std::string data(flen, 0), out;
+  extent_protocol::fsstat before, after;
+  char *buf = NULL;
+  int size;
+  double t;
+
+  srandom(1);
+  for (uint32_t i = 0; i < flen; i++)
+    data[i] = random();
+  fs_options opts;
+  opts.image = image;
+  opts.size = (uint64_t)(3 * mb + 8) * 1024 * 1024;
+  opts.block_size = 4096;
+  opts.cache_blocks = 256;
+  unlink(image.c_str());
+  inode_manager *im = new inode_manager(opts);
+  uint32_t src = im->alloc_inode(extent_protocol::T_FILE);
+  im->write_file(src, data.data(), flen);
+  im->sync();
+
+  im->statfs(before);
+  t = now();
+  uint32_t copy = im->alloc_inode(extent_protocol::T_FILE);
+  im->read_file(src, &buf, &size);
+  im->write_file(copy, buf, size);
+  free(buf);
+  im->sync();
+  im->statfs(after);
+  report("clone", "copy", 1, now() - t);
+  note("clone", "copy", "%u blocks used\n", before.free_blocks - after.free_blocks);
+
+  im->statfs(before);
+  t = now();
+  uint32_t dst = im->alloc_inode(extent_protocol::T_FILE);
+  VERIFY(im->clone(src, dst));
+  im->sync();
+  im->statfs(after);
+  report("clone", "clone", 1, now() - t);
+  note("clone", "clone", "%u blocks used\n", before.free_blocks - after.free_blocks);
+
+  std::string piece(4096, 'w');
+  im->statfs(before);
+  t = now();
+  for (uint32_t i = 0; i < writes; i++)
+    im->write_range(dst, random() % (flen - 4096), piece.data(), piece.size());
+  im->sync();
+  im->statfs(after);
+  report("clone", "write clone", writes, now() - t);
+  note("clone", "write clone", "%u blocks used\n", before.free_blocks - after.free_blocks);
+
+  im->read_range(src, 0, flen, out);
+  VERIFY(out == data);
+  unlink(image.c_str());
+}
+
+// Start an extent server on an in-memory disk in a child process with
+// a pool of threads handlers, granting attribute leases of lease_ms,
+// and return its port. The server's log goes to /dev/null. Given
+// stats_fd, the server times its locks, and each SIGUSR1 has it write
+// the totals so far to the pipe it returns there.
+static int start_server(int threads, pid_t &pid, unsigned int lease_ms = ATTR_LEASE_MS,
+                        int *stats_fd = NULL)
+{
+  int fds[2], sfds[2];
+  char buf[16];
+  int port = 0;
+
+  VERIFY(pipe(fds) == 0);
+  if (stats_fd != NULL)
+    VERIFY(pipe(sfds) == 0);
+  pid = fork();
+  VERIFY(pid >= 0);
+  if (pid == 0) {
+    // blocked before the RPC threads start, so only sigwait takes it
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    VERIFY(pthread_sigmask(SIG_BLOCK, &usr1, NULL) == 0);
+    VERIFY(freopen("/dev/null", "w", stdout) != NULL);
+    snprintf(buf, sizeof(buf), "%d", threads);
+    setenv("RPC_THREADS", buf, 1);
+    lock_profiling(stats_fd != NULL);
+    rpcs server(0);
+    extent_server es((fs_options()));
+    es.set_lease(lease_ms);
+    server.reg(extent_protocol::create, &es, &extent_server::create);
+    server.reg(extent_protocol::getattr, &es, &extent_server::getattr);
+    server.reg(extent_protocol::getattr_lease, &es, &extent_server::getattr_lease);
+    server.reg(extent_protocol::read, &es, &extent_server::read);
+    server.reg(extent_protocol::write, &es, &extent_server::write);
+    server.reg(extent_protocol::remove, &es, &extent_server::remove);
+    server.reg(extent_protocol::fetch, &es, &extent_server::fetch);
+    server.reg(extent_protocol::release, &es, &extent_server::release);
+    port = ntohs(server.port());  // port() is in network order
+    VERIFY(write(fds[1], &port, sizeof(port)) == sizeof(port));
+    for (;;) {
+      int sig;
+      VERIFY(sigwait(&usr1, &sig) == 0);
+      if (stats_fd == NULL)
+        continue;
+      lock_stats ls;
+      get_lock_stats(ls);
+      VERIFY(write(sfds[1], &ls, sizeof(ls)) == sizeof(ls));
+    }
+  }
+  close(fds[1]);
+  VERIFY(read(fds[0], &port, sizeof(port)) == sizeof(port));
+  close(fds[0]);
+  if (stats_fd != NULL) {
+    close(sfds[1]);
+    *stats_fd = sfds[0];
+  }
+  return port;
+}
+
+// The lock totals so far of a server started with a stats pipe.
+static void server_lock_stats(pid_t pid, int fd, lock_stats &ls)
+{
+  VERIFY(kill(pid, SIGUSR1) == 0);
+  VERIFY(read(fd, &ls, sizeof(ls)) == sizeof(ls));
+}
+
+struct server_client {
+  int port;
+  int ops;
+  unsigned int seed;
+};
+
+// One client of the server bench: its own connection and file, with
+// 4 KB writes and reads at random offsets and a getattr in between.
+static void *server_client_run(void *arg)
+{
+  server_client *sc = (server_client *)arg;
+  char dst[16];
+  std::string data(4096, 'x'), buf;
+  extent_protocol::extentid_t eid;
+  extent_protocol::attr a;
+
+  snprintf(dst, sizeof(dst), "%d", sc->port);
+  extent_client ec(dst);
+  VERIFY(ec.create(extent_protocol::T_FILE, 1, eid) == extent_protocol::OK);
+  for (int i = 0; i < sc->ops; i += 3) {
+    unsigned int off = rand_r(&sc->seed) % 64 * 4096;
+    ec.write(eid, off, data);
+    ec.read(eid, off, data.size(), buf);
+    ec.getattr(eid, a);
+  }
+  return NULL;
+}
+
+// server: extent_server throughput with a number of clients working on
+// files of their own, for RPC thread pools of growing size. The servers
+// are all started up front, since the RPC library's threads would not
+// survive a later fork. Each run is followed by where the handlers
+// spent time on locks, as shares of the run: how long they waited for
+// each kind of lock, and how long one was held. A lock serializing the
+// handlers would be held for most of the run and waited on as long;
+// with clients on files of their own the waits should stay small, and
+// the throughput is what the CPUs give.
+static void bench_server(int argc, char *argv[])
+{
+  int clients = argc > 0 ? atoi(argv[0]) : 8;
+  int ops = argc > 1 ? atoi(argv[1]) : 3000;
+  int pools[] = { 1, 2, 4, 8, 16 };
+  const int npools = sizeof(pools) / sizeof(pools[0]);
+  pid_t pids[npools];
+  int ports[npools], stats_fds[npools];
+  lock_stats before, after;
+  char what[32];
+  double t;
+
+  for (int i = 0; i < npools; i++)
+    ports[i] = start_server(pools[i], pids[i], ATTR_LEASE_MS, &stats_fds[i]);
+
+  for (int i = 0; i < npools; i++) {
+    std::vector<pthread_t> th(clients);
+    std::vector<server_client> sc(clients);
+    server_lock_stats(pids[i], stats_fds[i], before);
+    t = now();
+    for (int c = 0; c < clients; c++) {
+      sc[c].port = ports[i];
+      sc[c].ops = ops;
+      sc[c].seed = c + 1;
+      VERIFY(pthread_create(&th[c], NULL, server_client_run, &sc[c]) == 0);
+    }
+    for (int c = 0; c < clients; c++)
+      VERIFY(pthread_join(th[c], NULL) == 0);
+    double secs = now() - t;
+    server_lock_stats(pids[i], stats_fds[i], after);
+    snprintf(what, sizeof(what), "%d clients %d threads", clients, pools[i]);
+    report("server", what, (long)clients * ((ops + 2) / 3 * 3), secs);
+    for (int k = 0; k < NLOCKS; k++) {
+      uint64_t acquires = after.acquires[k] - before.acquires[k];
+      if (acquires == 0)
+        continue;
+      note("server", what, "%-6s %9llu locks %5.1f%% contended %6.2f%% wait %6.2f%% held\n",
+           lock_names[k], (unsigned long long)acquires,
+           100.0 * (after.contended[k] - before.contended[k]) / acquires,
+           (after.wait_ns[k] - before.wait_ns[k]) / 1e7 / secs,
+           (after.hold_ns[k] - before.hold_ns[k]) / 1e7 / secs);
+    }
+  }
+
+  for (int i = 0; i < npools; i++) {
+    kill(pids[i], SIGKILL);
+    waitpid(pids[i], NULL, 0);
+    close(stats_fds[i]);
+  }
+}
+
+// attrcache: a stat-heavy client, a getattr of one of a few files for
+// each op and a write every 16, with attribute leases off and on, and
+// how many RPCs the leases saved. Then checks that a second client's
+// write is seen by the first, which held a lease on the file and has
+// it called back. Both
+// servers are started up front, as in the server bench.
+static void bench_attrcache(int argc, char *argv[])
+{
+  int ops = argc > 0 ? atoi(argv[0]) : 20000;
+  unsigned int leases[] = { 0, ATTR_LEASE_MS };
+  const int nfiles = 8;
+  std::string data(4096, 'x');
+  extent_protocol::extentid_t eids[nfiles];
+  extent_protocol::attr a;
+  pid_t pids[2];
+  int ports[2];
+  char dst[16], what[32];
+  double t;
+
+  for (int i = 0; i < 2; i++)
+    ports[i] = start_server(4, pids[i], leases[i]);
+
+  for (int i = 0; i < 2; i++) {
+    snprintf(dst, sizeof(dst), "%d", ports[i]);
+    extent_client ec(dst);
+    for (int f = 0; f < nfiles; f++)
+      VERIFY(ec.create(extent_protocol::T_FILE, 1, eids[f]) == extent_protocol::OK);
+    uint64_t rpcs = ec.stats().rpcs, hits = ec.stats().attr_hits;
+    t = now();
+    for (int n = 0; n < ops; n++) {
+      extent_protocol::extentid_t eid = eids[n % nfiles];
+      if (n % 16 == 15)
+        VERIFY(ec.write(eid, n / 16 % 64 * 4096, data) == extent_protocol::OK);
+      else
+        VERIFY(ec.getattr(eid, a) == extent_protocol::OK);
+    }
+    snprintf(what, sizeof(what), "lease %u ms", leases[i]);
+    report("attrcache", what, ops, now() - t);
+    note("attrcache", what, "%llu rpcs, %llu getattrs from cache\n",
+         (unsigned long long)(ec.stats().rpcs - rpcs),
+         (unsigned long long)(ec.stats().attr_hits - hits));
+
+    if (leases[i] > 0) {
+      // b's write calls back a's lease, and a then asks again
+      extent_client eb(dst);
+      VERIFY(ec.getattr(eids[0], a) == extent_protocol::OK);
+      VERIFY(ec.getattr(eids[0], a) == extent_protocol::OK);
+      t = now();
+      VERIFY(eb.write(eids[0], 1 << 20, data) == extent_protocol::OK);
+      note("attrcache", "coherence", "write waited %.1f ms for a lease\n",
+           (now() - t) * 1000);
+      VERIFY(ec.getattr(eids[0], a) == extent_protocol::OK);
+      VERIFY(a.size == (1 << 20) + data.size());
+    }
+  }
+
+  for (int i = 0; i < 2; i++) {
+    kill(pids[i], SIGKILL);
+    waitpid(pids[i], NULL, 0);
+  }
+}
+
+struct extcache_client {
+  int port;
+  int ops;
+  int nclients;
+  int me;
+  extent_protocol::extentid_t *eids;
+  size_t cache_bytes;
+  uint64_t rpcs, recalls, evictions;
+};
+
+// One client of the extcache bench: appends to a directory-like extent
+// of its own with get and put, and every 8 ops reads another's.
+static void *extcache_client_run(void *arg)
+{
+  extcache_client *xc = (extcache_client *)arg;
+  unsigned int seed = xc->me + 1;
+  char dst[16], rec[32];
+  std::string buf;
+
+  snprintf(dst, sizeof(dst), "%d", xc->port);
+  {
+    extent_client ec(dst);
+    ec.set_cache_bytes(xc->cache_bytes);
+    for (int n = 0; n < xc->ops; n++) {
+      VERIFY(ec.get(xc->eids[xc->me], buf) == extent_protocol::OK);
+      snprintf(rec, sizeof(rec), "%05d:%010d", xc->me, n);
+      buf += rec;
+      VERIFY(ec.put(xc->eids[xc->me], buf) == extent_protocol::OK);
+      if (xc->nclients > 1 && n % 8 == 7)
+        VERIFY(ec.get(xc->eids[rand_r(&seed) % xc->nclients], buf) == extent_protocol::OK);
+    }
+    ec.flush();
+    xc->rpcs = ec.stats().rpcs;
+    xc->recalls = ec.stats().recalls;
+    xc->evictions = ec.stats().evictions;
+  }
+  return NULL;
+}
+
+// extcache: get-append-put of directory-like extents through the
+// client's write-back cache, first with one client, where it should
+// take an RPC or so in all, then with clients each appending to its
+// own extent and reading the others', which calls them back, and then
+// again with caches too small for the extents, which gives them back
+// as they grow. Checks that every append made it to the server.
+static void bench_extcache(int argc, char *argv[])
+{
+  int clients = argc > 0 ? atoi(argv[0]) : 4;
+  int ops = argc > 1 ? atoi(argv[1]) : 2000;
+  int counts[] = { 1, clients, clients };
+  size_t limits[] = { EXTENT_CACHE_BYTES, EXTENT_CACHE_BYTES, 4096 };
+  pid_t pid;
+  int port = start_server(4, pid);
+  char dst[16], what[64], rec[32];
+  double t;
+
+  snprintf(dst, sizeof(dst), "%d", port);
+  for (int i = 0; i < 3; i++) {
+    int nc = counts[i];
+    std::vector<extent_protocol::extentid_t> eids(nc);
+    std::vector<pthread_t> th(nc);
+    std::vector<extcache_client> xc(nc);
+    {
+      extent_client ec(dst);
+      for (int c = 0; c < nc; c++)
+        VERIFY(ec.create(extent_protocol::T_DIR, 1, eids[c]) == extent_protocol::OK);
+    }
+    t = now();
+    for (int c = 0; c < nc; c++) {
+      xc[c].port = port;
+      xc[c].ops = ops;
+      xc[c].nclients = nc;
+      xc[c].me = c;
+      xc[c].eids = &eids[0];
+      xc[c].cache_bytes = limits[i];
+      VERIFY(pthread_create(&th[c], NULL, extcache_client_run, &xc[c]) == 0);
+    }
+    uint64_t rpcs = 0, recalls = 0, evictions = 0;
+    for (int c = 0; c < nc; c++) {
+      VERIFY(pthread_join(th[c], NULL) == 0);
+      rpcs += xc[c].rpcs;
+      recalls += xc[c].recalls;
+      evictions += xc[c].evictions;
+    }
+    if (limits[i] < EXTENT_CACHE_BYTES)
+      snprintf(what, sizeof(what), "%d clients, %zu KB cache", nc, limits[i] >> 10);
+    else
+      snprintf(what, sizeof(what), "%d clients", nc);
+    report("extcache", what, (long)nc * ops, now() - t);
+    note("extcache", what, "%llu rpcs, %llu recalls, %llu evictions\n",
+         (unsigned long long)rpcs, (unsigned long long)recalls,
+         (unsigned long long)evictions);
+
+    extent_client ec(dst);
+    std::string buf;
+    for (int c = 0; c < nc; c++) {
+      VERIFY(ec.get(eids[c], buf) == extent_protocol::OK);
+      VERIFY(buf.size() == (size_t)ops * 16);
+      for (int n = 0; n < ops; n++) {
+        snprintf(rec, sizeof(rec), "%05d:%010d", c, n);
+        VERIFY(buf.compare(n * 16, 16, rec) == 0);
+      }
+    }
+  }
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+}
+
+static struct {
+  const char *name;
+  const char *args;
+  void (*run)(int argc, char *argv[]);
+} benches[] = {
+  { "disk", "[size_mb] [image]", bench_disk },
+  { "balloc", "[size_mb]", bench_balloc },
+  { "ialloc", "[ops]", bench_ialloc },
+  { "getattr", "[files]", bench_getattr },
+  { "cache", "[rounds] [image]", bench_cache },
+  { "icache", "[rounds]", bench_icache },
+  { "journal", "[files] [image]", bench_journal },
+  { "blocksize", "[size_mb]", bench_blocksize },
+  { "vector", "[size_mb] [image]", bench_vector },
+  { "sparse", "[size_mb]", bench_sparse },
+  { "smallfile", "[files]", bench_smallfile },
+  { "server", "[clients] [ops]", bench_server },
+  { "inode", "[files] [size_mb]", bench_inode },
+  { "groups", "[writers] [files]", bench_groups },
+  { "append", "[files] [kb]", bench_append },
+  { "csum", "[size_mb] [image]", bench_csum },
+  { "randwrite", "[size_mb] [image]", bench_randwrite },
+  { "dedup", "[size_mb] [image]", bench_dedup },
+  { "compress", "[size_mb] [novels_dir]", bench_compress },
+  { "clone", "[size_mb] [image]", bench_clone },
+  { "attrcache", "[ops]", bench_attrcache },
+  { "extcache", "[clients] [ops]", bench_extcache },
+};
+
+int main(int argc, char *argv[])
+{
+  const char *prog = argv[0];
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+  if (argc > 1 && strcmp(argv[1], "-m") == 0) {
+    machine = true;
+    argc--;
+    argv++;
+  }
+  for (size_t i = 0; argc > 1 && i < sizeof(benches) / sizeof(benches[0]); i++) {
+    if (strcmp(argv[1], benches[i].name) == 0) {
+      if (machine)
+        printf("bench\tcase\tops\tsecs\tops_per_s\tp50_us\tp90_us\tp99_us\tmax_us\n");
+      benches[i].run(argc - 2, argv + 2);
+      return 0;
+    }
+  }
+
+  fprintf(stderr, "Usage: %s [-m] <bench> [args...]\n", prog);
+  for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    fprintf(stderr, "  %s %s\n", benches[i].name, benches[i].args);
+  return 1;
+}
@@ -1,5 +1,15 @@
 #include "inode_manager.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "slock.h"
+#include "lang/verify.h"
+#include <algorithm>
 #include <ctime>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define DEBUG 0
 #define debug_log(...) do{ \
@@ -9,352 +19,3900 @@
       fflush(stdout); \
     } }while(0);
 
-// disk layer -----------------------------------------
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+#define MAX(a,b) (((int)(a))<((int)(b)) ? ((int)(b)) : ((int)(a)))
 
-disk::disk()
+// lock profiling -------------------------------------
+
+static std::atomic<bool> profiling(false);
+static std::atomic<uint64_t> lk_acquires[NLOCKS], lk_contended[NLOCKS];
+static std::atomic<uint64_t> lk_wait[NLOCKS], lk_hold[NLOCKS];
+
+const char *lock_names[NLOCKS] = {
+  "inode", "icache", "log", "cache", "bitmap", "lease", "claim"
+};
+
+// Start or stop timing locks; the totals run on across stops.
+void lock_profiling(bool on)
 {
-  bzero(blocks, sizeof(blocks));
+  profiling = on;
 }
 
-void disk::read_block(blockid_t id, char *buf)
+void get_lock_stats(lock_stats &s)
 {
-  memcpy(buf, blocks[id], BLOCK_SIZE);
+  for (int k = 0; k < NLOCKS; k++) {
+    s.acquires[k] = lk_acquires[k];
+    s.contended[k] = lk_contended[k];
+    s.wait_ns[k] = lk_wait[k];
+    s.hold_ns[k] = lk_hold[k];
+  }
 }
 
-void disk::write_block(blockid_t id, const char *buf)
+// Nanoseconds on a monotonic clock, or 0 while profiling is off, which
+// the other calls take to mean not timed.
+uint64_t lock_clock()
 {
-  memcpy(blocks[id], buf, BLOCK_SIZE);
+  if (!profiling)
+    return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-// block layer -----------------------------------------
+// Count an acquire of a lock of kind, which took wait_ns.
+void lock_account(int kind, bool contended, uint64_t wait_ns)
+{
+  lk_acquires[kind]++;
+  if (contended)
+    lk_contended[kind]++;
+  lk_wait[kind] += wait_ns;
+}
 
-// Allocate a free disk block.
-blockid_t block_manager::alloc_block()
+// Count a lock of kind as held from since until now.
+void lock_held(int kind, uint64_t since)
 {
-  /*
-   * your code goes here.
-   * note: you should mark the corresponding bit in block bitmap when alloc.
-   * you need to think about which block you can start to be allocated.
-   */
-  blockid_t start = IBLOCK(INODE_NUM, sb.nblocks) + 1;
-  for(blockid_t i = start; i < BLOCK_NUM; i++){
-    if(using_blocks.count(i) == 0){
-      using_blocks[i] = 1;
-      return i;
-    }
+  uint64_t t = since == 0 ? 0 : lock_clock();
+  if (t > since)
+    lk_hold[kind] += t - since;
+}
+
+// Lock m, and return when it was got if profiling.
+uint64_t lock_acquire(pthread_mutex_t *m, int kind)
+{
+  uint64_t t = lock_clock();
+  if (t == 0) {
+    VERIFY(pthread_mutex_lock(m) == 0);
+    return 0;
   }
+  int r = pthread_mutex_trylock(m);
+  if (r == 0) {
+    lock_account(kind, false, 0);
+    return t;
+  }
+  VERIFY(r == EBUSY);
+  VERIFY(pthread_mutex_lock(m) == 0);
+  uint64_t got = lock_clock();
+  lock_account(kind, true, got > t ? got - t : 0);
+  return got;
 }
 
-void block_manager::free_block(uint32_t id)
+void lock_release(pthread_mutex_t *m, int kind, uint64_t since)
 {
-  /* 
-   * your code goes here.
-   * note: you should unmark the corresponding bit in the block bitmap when free.
-   */
-  using_blocks.erase(id);
-  return;
+  lock_held(kind, since);
+  VERIFY(pthread_mutex_unlock(m) == 0);
 }
 
-// The layout of disk should be like this:
-// |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
-block_manager::block_manager()
+// Wait on c with m, of kind, held since since. The hold pauses while
+// the wait counts for wait_kind; returns when the hold resumed.
+uint64_t lock_wait(pthread_cond_t *c, pthread_mutex_t *m, int kind, int wait_kind,
+                   uint64_t since, const struct timespec *until)
 {
-  d = new disk();
+  lock_held(kind, since);
+  uint64_t t = since == 0 ? 0 : lock_clock();
+  if (until == NULL)
+    VERIFY(pthread_cond_wait(c, m) == 0);
+  else {
+    int r = pthread_cond_timedwait(c, m, until);
+    VERIFY(r == 0 || r == ETIMEDOUT);
+  }
+  if (t == 0)
+    return 0;
+  uint64_t got = lock_clock();
+  if (got > t)
+    lk_wait[wait_kind] += got - t;
+  return got;
+}
 
-  // format the disk
-  sb.size = BLOCK_SIZE * BLOCK_NUM;
-  sb.nblocks = BLOCK_NUM;
-  sb.ninodes = INODE_NUM;
+// disk layer -----------------------------------------
 
+disk::disk()
+  : disk(fs_options())
+{
 }
 
-void block_manager::read_block(uint32_t id, char *buf)
+disk::disk(const fs_options &opts)
+{
+  fd = -1;
+  page_size = 0;
+  VERIFY(pthread_mutex_init(&dirty_m, 0) == 0);
+  if (opts.image.empty()) {
+    bytes = opts.size - opts.size % MIN_BLOCK_SIZE;
+    blocks = (unsigned char *)calloc(bytes, 1);
+  } else {
+    map_image(opts.image.c_str(), opts.size);
+  }
+  set_block_size(opts.block_size);
+}
+
+// Map the image file, creating it or growing it to size bytes when
+// needed. The mapping is shared, so every write_block goes straight to
+// the page cache and survives a crash of the process; sync() makes it
+// durable.
+void disk::map_image(const char *image, uint64_t size)
 {
-  d->read_block(id, buf);
+  struct stat st;
+
+  fd = open(image, O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    printf("\tdisk: cannot open image %s: %s\n", image, strerror(errno));
+    exit(1);
+  }
+  if (size == 0)
+    size = st.st_size > 0 ? st.st_size : DISK_SIZE;
+  size -= size % MIN_BLOCK_SIZE;
+  if ((uint64_t)st.st_size < size && ftruncate(fd, size) < 0) {
+    printf("\tdisk: cannot grow image %s: %s\n", image, strerror(errno));
+    exit(1);
+  }
+
+  blocks = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, fd, 0);
+  if (blocks == MAP_FAILED) {
+    printf("\tdisk: cannot map image %s: %s\n", image, strerror(errno));
+    exit(1);
+  }
+  bytes = size;
+  page_size = sysconf(_SC_PAGESIZE);
+  dirty.assign((size + page_size - 1) / page_size, false);
 }
 
-void block_manager::write_block(uint32_t id, const char *buf)
+disk::~disk()
 {
-  d->write_block(id, buf);
+  if (fd < 0) {
+    free(blocks);
+    return;
+  }
+  sync();
+  munmap(blocks, bytes);
+  close(fd);
 }
 
-// inode layer -----------------------------------------
+// Address the disk in blocks of bsize bytes; a partial block at the
+// end is not used.
+void disk::set_block_size(uint32_t bsize)
+{
+  this->bsize = bsize;
+  nblocks = bytes / bsize;
+}
 
-inode_manager::inode_manager()
+void disk::read_at(uint64_t off, char *buf, size_t len)
 {
-  bm = new block_manager();
-  uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
-  if (root_dir != 1) {
-    printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
-    exit(0);
+  memcpy(buf, blocks + off, len);
+}
+
+void disk::write_at(uint64_t off, const char *buf, size_t len)
+{
+  memcpy(blocks + off, buf, len);
+  if (fd >= 0) {
+    ScopedLock ml(&dirty_m);
+    for (size_t p = off / page_size; p <= (off + len - 1) / page_size; p++)
+      dirty[p] = true;
   }
 }
 
-/* Create a new file.
- * Return its inum. */
-uint32_t inode_manager::alloc_inode(uint32_t type)
+// Flush the dirty pages of an image, one msync per contiguous run.
+// Writes may go on meanwhile; a page they dirty again waits for the
+// next sync.
+void disk::sync()
 {
-  /* 
-   * your code goes here.
-   * note: the normal inode block should begin from the 2nd inode block.
-   * the 1st is used for root_dir, see inode_manager::inode_manager().
-   */
-  
-  /* 
-   * WindowsXp
-   * since we don't have bitmap for inode table, 
-   * we have to iterate through the inode table to find freed inodes 
-   */
-  char buf[BLOCK_SIZE];
-  inode_t *ino;
-  for(uint32_t inum = 1; inum < INODE_NUM; inum++){
-    bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-    ino = (inode_t*)buf + inum%IPB;
-    if(ino->type == 0){
-      ino->type = type;
-      ino->size = 0;
-      bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
-      return inum;
+  std::vector<std::pair<size_t, size_t> > runs;
+  size_t p = 0, start;
+
+  {
+    ScopedLock ml(&dirty_m);
+    while (p < dirty.size()) {
+      if (!dirty[p]) {
+        p++;
+        continue;
+      }
+      for (start = p; p < dirty.size() && dirty[p]; p++)
+        dirty[p] = false;
+      runs.push_back(std::make_pair(start, p));
     }
   }
+  for (size_t i = 0; i < runs.size(); i++)
+    msync(blocks + runs[i].first * page_size,
+          MIN(runs[i].second * page_size, bytes) - runs[i].first * page_size, MS_SYNC);
 }
 
-void inode_manager::free_inode(uint32_t inum)
+// block layer -----------------------------------------
+
+void bitmap::load(block_manager *bm, blockid_t start, uint32_t nbits, uint32_t ngroups)
 {
-  /* 
-   * your code goes here.
-   * note: you need to check if the inode is already a freed one;
-   * if not, clear it, and remember to write back to disk.
-   */
-  char buf[BLOCK_SIZE];
-  inode_t *ino_disk, *ino;
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  ino_disk = (inode_t*)buf + inum%IPB;
-  if(ino_disk->type != 0){
-    ino_disk->type = 0;
-    bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+  uint32_t nblocks = (nbits + BPB(bm->sb) - 1) / BPB(bm->sb);
+
+  this->bm = bm;
+  this->start = start;
+  this->nbits = nbits;
+  wpb = WPB(bm->sb);
+  words.assign(nblocks * wpb, 0);
+  for (uint32_t i = 0; i < nblocks; i++)
+    bm->read_block(start + i, (char *)&words[i * wpb]);
+  // bits past the end read as used, so scans never hand them out
+  for (uint32_t bit = nbits; bit < nblocks * wpb * 64; bit++)
+    words[bit / 64] |= 1ULL << (bit % 64);
+  nfree = 0;
+  nwords = (nbits + 63) / 64;
+
+  block_m.resize(nblocks);
+  for (uint32_t i = 0; i < nblocks; i++)
+    VERIFY(pthread_mutex_init(&block_m[i], 0) == 0);
+
+  // group i has words [i * nwords / ngroups, (i + 1) * nwords / ngroups)
+  this->ngroups = ngroups = MAX(1, MIN(ngroups, nwords));
+  groups = new group[ngroups];
+  for (uint32_t i = 0; i < ngroups; i++) {
+    group &g = groups[i];
+    VERIFY(pthread_mutex_init(&g.m, 0) == 0);
+    g.first = (uint64_t)i * nwords / ngroups;
+    g.end = (uint64_t)(i + 1) * nwords / ngroups;
+    g.hint = g.first;
+    g.nfree = 0;
+    for (uint32_t w = g.first; w < g.end; w++)
+      g.nfree += __builtin_popcountll(~words[w]);
+    nfree += g.nfree;
   }
+  next = 0;
 }
 
-
-/* Return an inode structure by inum, NULL otherwise.
- * Caller should release the memory. */
-inode_t* inode_manager::get_inode(uint32_t inum)
+bool bitmap::test(uint32_t b)
 {
-  inode_t *ino, *ino_disk;
-  char buf[BLOCK_SIZE];
+  ProfLock ml(&groups[group_of(b)].m, LK_BITMAP);
+  return isset(b);
+}
 
-  printf("\tim: get_inode %d\n", inum);
+// Find and set a clear bit. Each group is scanned a word at a time
+// starting where its last allocation left off, so a full word costs
+// one comparison and the clear bit inside a word is found with
+// count-trailing-zeros. Full groups are passed over without locking.
+uint32_t bitmap::alloc(uint32_t group)
+{
+  uint32_t first = group < ngroups ? group : next++ % ngroups;
 
-  if (inum < 0 || inum >= INODE_NUM) {
-    printf("\tim: inum out of range\n");
-    return NULL;
+  for (uint32_t k = 0; k < ngroups; k++) {
+    struct group &g = groups[(first + k) % ngroups];
+    if (g.nfree == 0)
+      continue;
+    ProfLock ml(&g.m, LK_BITMAP);
+    uint32_t nwords = g.end - g.first;
+    for (uint32_t n = 0; n < nwords; n++) {
+      uint32_t w = g.first + (g.hint - g.first + n) % nwords;
+      if (words[w] == ~0ULL)
+        continue;
+      uint32_t b = w * 64 + __builtin_ctzll(~words[w]);
+      change(b, 1, true, true);
+      g.hint = w;
+      return b;
+    }
   }
+  return nbits;
+}
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  // printf("%s:%d\n", __FILE__, __LINE__);
+// Find the first run of n clear bits in group g, starting at its hint,
+// or else the longest run seen. Full words are skipped and empty words
+// taken whole. Returns the start with len, 0 if the group is full.
+// Called with the group locked.
+uint32_t bitmap::find_run(group &g, uint32_t n, uint32_t &len)
+{
+  uint32_t base = g.first * 64, total = (g.end - g.first) * 64;
+  uint32_t best = nbits, best_len = 0;
+  uint32_t run_start = 0, run = 0;
 
-  ino_disk = (inode_t*)buf + inum%IPB;
-  if (ino_disk->type == 0) {
-    printf("\tim: inode not exist\n");
-    return NULL;
+  for (uint32_t i = 0; i < total && best_len < n; ) {
+    uint32_t b = base + ((g.hint - g.first) * 64 + i) % total;
+    uint64_t w = words[b / 64];
+
+    if (b == base)
+      run = 0;  // runs do not wrap around the end
+    if (b % 64 == 0 && w == ~0ULL) {
+      run = 0;
+      i += 64;
+      continue;
+    }
+    if (b % 64 == 0 && w == 0 && run + 64 <= n) {
+      if (run == 0)
+        run_start = b;
+      run += 64;
+      i += 64;
+    } else {
+      if (w & (1ULL << (b % 64))) {
+        run = 0;
+      } else {
+        if (run == 0)
+          run_start = b;
+        run++;
+      }
+      i++;
+    }
+    if (run > best_len) {
+      best = run_start;
+      best_len = run;
+    }
   }
+  len = MIN(best_len, n);
+  return best;
+}
+
+// Find and set up to n clear bits in a row. A run starting at goal is
+// taken if goal is clear, so a file can keep growing in place.
+// Otherwise the first group with a run of n clear bits gives it,
+// starting with the preferred group, or the goal's when there is none,
+// or the group with the longest run gives that. Returns nbits with
+// len 0 when full.
+uint32_t bitmap::alloc_run(uint32_t goal, uint32_t group, uint32_t n, uint32_t &len)
+{
+  uint32_t first, best_group = ngroups, best_len = 0;
 
-  ino = (inode_t*)malloc(sizeof(inode_t));
-  *ino = *ino_disk;
+  if (goal < nbits) {
+    struct group &g = groups[group_of(goal)];
+    ProfLock ml(&g.m, LK_BITMAP);
+    if (!isset(goal)) {
+      for (len = 0; len < n && goal + len < nbits && !isset(goal + len); len++) {
+        if ((goal + len) / 64 >= g.end)
+          break;
+      }
+      change(goal, len, true, true);
+      return goal;
+    }
+  }
 
-  return ino;
+  if (group < ngroups)
+    first = group;
+  else if (goal < nbits)
+    first = group_of(goal);
+  else
+    first = next++ % ngroups;
+  for (uint32_t k = 0; k <= ngroups; k++) {
+    uint32_t i = k < ngroups ? (first + k) % ngroups : best_group;
+    if (i == ngroups)
+      break;
+    struct group &g = groups[i];
+    if (g.nfree == 0)
+      continue;
+    ProfLock ml(&g.m, LK_BITMAP);
+    uint32_t b = find_run(g, n, len);
+    if (len == n || (k == ngroups && len > 0)) {
+      change(b, len, true, true);
+      g.hint = (b + len - 1) / 64;
+      return b;
+    }
+    if (len > best_len) {
+      best_len = len;
+      best_group = i;
+    }
+  }
+  len = 0;
+  return nbits;
 }
 
-void inode_manager::put_inode(uint32_t inum, inode_t *ino)
+// Update len bits from bit on, writing each bitmap block they touch
+// through once, and count the bits that changed into the groups they
+// fall in. With lock, each block is locked while it changes, as the
+// group next door may be changing it too; the caller holds the locks
+// of the groups the bits fall in.
+void bitmap::change(uint32_t bit, uint32_t len, bool used, bool lock)
 {
-  char buf[BLOCK_SIZE];
-  inode_t *ino_disk;
+  uint32_t bpb = wpb * 64;
 
-  printf("\tim: put_inode %d\n", inum);
-  if (ino == NULL)
-    return;
+  while (len > 0) {
+    uint32_t blk = bit / bpb;
+    uint32_t n = MIN(len, (blk + 1) * bpb - bit);
+    uint32_t g = group_of(bit);
+    int changed = 0;
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf); //先要read，因为一个block中不止一个inode
-  ino_disk = (inode_t*)buf + inum%IPB;
-  *ino_disk = *ino; // 将inode放入这个块中
-  bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+    if (lock)
+      VERIFY(pthread_mutex_lock(&block_m[blk]) == 0);
+    for (uint32_t b = bit; b < bit + n; b++) {
+      uint64_t mask = 1ULL << (b % 64);
+      if (group_of(b) != g) {
+        groups[g].nfree += used ? -changed : changed;
+        nfree += used ? -changed : changed;
+        g = group_of(b);
+        changed = 0;
+      }
+      changed += !(words[b / 64] & mask) == used;
+      if (used)
+        words[b / 64] |= mask;
+      else
+        words[b / 64] &= ~mask;
+    }
+    groups[g].nfree += used ? -changed : changed;
+    nfree += used ? -changed : changed;
+    bm->log_write(start + blk, (char *)&words[blk * wpb]);
+    if (lock)
+      VERIFY(pthread_mutex_unlock(&block_m[blk]) == 0);
+    bit += n;
+    len -= n;
+  }
 }
 
-#define MIN(a,b) ((a)<(b) ? (a) : (b))
-#define MAX(a,b) (((int)(a))<((int)(b)) ? ((int)(b)) : ((int)(a)))
+// Update len bits without taking any lock, when nothing else can be
+// using the bitmap.
+void bitmap::mark(uint32_t bit, uint32_t len, bool used)
+{
+  change(bit, len, used, false);
+}
 
-/* Get all the data of a file by inum. 
- * Return alloced data, should be freed by caller. */
-void inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
+// Update len bits from bit on, a group at a time.
+void bitmap::set_run(uint32_t bit, uint32_t len, bool used)
 {
-  /*
-   * your code goes here.
-   * note: read blocks related to inode number inum,
-   * and copy them to buf_out
-   */
-  inode_t* ino = get_inode(inum);
-  unsigned int file_size = ino->size;
-  *size = file_size;
-  if(file_size == 0) {
-    printf("read an empty file\n");
-    return;
+  while (len > 0) {
+    group &g = groups[group_of(bit)];
+    uint32_t n = MIN(len, g.end * 64 - bit);
+    ProfLock ml(&g.m, LK_BITMAP);
+    change(bit, n, used, true);
+    bit += n;
+    len -= n;
   }
+}
 
-  unsigned int block_num = (file_size -1)/BLOCK_SIZE + 1;
-  char* buf_p = *buf_out = (char*)malloc(block_num * BLOCK_SIZE);
-  debug_log("read file inode: %d\tsize: %d\tblock size: %d\n", inum, file_size, block_num);
+// Update one bit and write its bitmap block through.
+void bitmap::set(uint32_t bit, bool used)
+{
+  ProfLock ml(&groups[group_of(bit)].m, LK_BITMAP);
+  change(bit, 1, used, true);
+}
+
+// The journal operation this thread is running: the block manager it
+// runs on, how many more blocks it may add to the log, how many of
+// those allocations leave for the map, the frees and the inode written
+// after them, and whether a step was refused for want of room, which
+// stays set after the operation ends for its caller to see.
+struct op_budget {
+  block_manager *bm;
+  uint32_t left;
+  uint32_t keep;
+  bool cut;
+};
+static thread_local op_budget cur_op;
 
-  for(unsigned int i = 0; i < block_num; i++, buf_p += BLOCK_SIZE){
-    read_nth_block(ino, i, buf_p);
+// How many blocks the running operation may still allocate in one run
+// without its bitmap blocks taking the room kept for what follows: a
+// run of (room - 1) * BPB blocks touches at most room of them. Marks
+// the operation short when it may take none.
+static uint32_t alloc_room(block_manager *bm, uint32_t n)
+{
+  if (cur_op.bm != bm)
+    return n;
+  uint32_t room = cur_op.left > cur_op.keep ? cur_op.left - cur_op.keep : 0;
+  if (room == 0) {
+    cur_op.cut = true;
+    return 0;
   }
-  free(ino);
+  return room == 1 ? 1 : MIN(n, (room - 1) * BPB(bm->sb));
 }
 
+// Allocate a free disk block, in group if it has one.
+blockid_t block_manager::alloc_block(uint32_t group)
+{
+  if (alloc_room(this, 1) == 0)
+    return 0;
+  blockid_t id = free_map.alloc(group);
 
-/* alloc/free blocks if needed */
-void inode_manager::write_file(uint32_t inum, const char *buf, int size)
+  stats.allocs++;
+  if (id == sb.nblocks) {
+    printf("\tbm: out of free blocks\n");
+    return 0;
+  }
+  return id;
+}
+
+// Allocate up to n contiguous blocks, preferring to start at goal and
+// then to lie in group. Returns the first block and sets len, or 0 when
+// the disk is full.
+blockid_t block_manager::alloc_run(blockid_t goal, uint32_t group, uint32_t n, uint32_t &len)
 {
-  /*
-   * your code goes here.
-   * note: write buf to blocks of inode inum.
-   * you need to consider the situation when the size of buf 
-   * is larger or smaller than the size of original inode
-   */
-  inode_t* ino = get_inode(inum);
-  std::time_t t = std::time(0);
-  ino->atime = t;
-  ino->ctime = t;
-  ino->mtime = t;
+  n = alloc_room(this, n);
+  if (n == 0) {
+    len = 0;
+    return 0;
+  }
+  blockid_t id = free_map.alloc_run(goal, group, n, len);
 
-  std::string content;
+  stats.allocs++;
+  if (len == 0) {
+    printf("\tbm: out of free blocks\n");
+    return 0;
+  }
+  return id;
+}
 
-  unsigned int original_size = ino->size;
-  ino->size = size;
-  debug_log("write file inode: %d\t size: %d\toriginal size: %d\n", inum, size, original_size);
-  blockid_t* block_array = ino->blocks;
-  unsigned int block_num = size == 0 ? 0 : ((size - 1)/BLOCK_SIZE + 1);
-  unsigned int original_block_num = original_size == 0 ? 0 : ((original_size - 1)/BLOCK_SIZE + 1);
+// Free len blocks from id on. With a journal they stay allocated until
+// the running transaction commits: the committed metadata may still
+// point at them, so they must not be reused and overwritten before.
+// A log-structured disk drops their copies then too. Blocks a clone
+// shares just lose an owner, likewise at commit, so that until then
+// writes to them still go elsewhere. Blocks that are fresh, allocated
+// by the running operation and not yet stored in any map, are free
+// again at once, as nothing committed can point at them.
+void block_manager::free_run(blockid_t id, uint32_t len, bool fresh)
+{
+  // the superblock, bitmaps and inode table are never handed out
+  if (id < IBLOCK(sb.ninodes, sb) + 1) {
+    printf("\tbm: free of reserved block %u\n", id);
+    return;
+  }
+  for (uint32_t i = 0; i < len; i++) {
+    if (id + i >= sb.nblocks || !free_map.test(id + i)) {
+      printf("\tbm: free of unallocated block %u\n", id + i);
+      return;
+    }
+  }
+  if (journaling() && !fresh) {
+    ProfLock ll(&log_m, LK_LOG);
+    pending_free.push_back(std::make_pair(id, len));
+    pending_blocks += len;
+    for (blockid_t b = BBLOCK(id, sb); b <= BBLOCK(id + len - 1, sb); b++) {
+      if (log_index.count(b) == 0 && free_bmap.insert(b).second)
+        charge_op();
+    }
+    return;
+  }
+  std::vector<std::pair<blockid_t, uint32_t> > runs(1, std::make_pair(id, len));
+  drop_owners(runs);
+  for (size_t i = 0; i < runs.size(); i++) {
+    if (log_structured()) {
+      ProfLock ml(&cache_m, LK_CACHE);
+      trim(runs[i].first, runs[i].second);
+    }
+    free_map.set_run(runs[i].first, runs[i].second, false);
+  }
+}
+
+// Drop an owner of each shared block in runs, leaving in runs only the
+// blocks that had no other, which are to be freed.
+void block_manager::drop_owners(std::vector<std::pair<blockid_t, uint32_t> > &runs)
+{
+  if (!sharing())
+    return;
 
-  if(size < original_size){
-    for(unsigned int i = block_num; i < original_block_num; i++){
-      free_nth_block(ino, i);
+  ScopedLock sl(&share_m);
+  std::vector<std::pair<blockid_t, uint32_t> > left;
+  for (size_t i = 0; i < runs.size(); i++) {
+    blockid_t from = runs[i].first, end = runs[i].first + runs[i].second;
+    for (blockid_t b = from; b < end; b++) {
+      std::unordered_map<blockid_t, uint32_t>::iterator it = shares.find(b);
+      if (it == shares.end())
+        continue;
+      if (--it->second == 0) {
+        shares.erase(it);
+        nshared--;
+      }
+      if (b > from)
+        left.push_back(std::make_pair(from, b - from));
+      from = b + 1;
     }
-    if(original_block_num > NDIRECT && block_num <= NDIRECT){
-      bm->free_block(ino->blocks[NDIRECT]);
+    if (end > from)
+      left.push_back(std::make_pair(from, end - from));
+  }
+  runs.swap(left);
+}
+
+// Give each of len blocks from id on one more owner, for a clone.
+// The first clone marks the superblock on disk, ahead of the metadata
+// that shares them.
+void block_manager::share(blockid_t id, uint32_t len)
+{
+  {
+    ScopedLock sl(&share_m);
+    for (uint32_t i = 0; i < len; i++) {
+      if (shares[id + i]++ == 0)
+        nshared++;
     }
+  }
+  ProfLock ml(&cache_m, LK_CACHE);
+  if (!sb.shared) {
+    sb.shared = 1;
+    d->write_at(SB_OFFSET, (char *)&sb, sizeof(sb));
+  }
+}
+
+// How many of the len blocks from id on are shared, or not, like the
+// first; shared tells which.
+uint32_t block_manager::shared_run(blockid_t id, uint32_t len, bool &shared)
+{
+  shared = false;
+  if (!sharing())
+    return len;
+
+  ScopedLock sl(&share_m);
+  uint32_t n = 0;
+  shared = shares.count(id) != 0;
+  while (n < len && (shares.count(id + n) != 0) == shared)
+    n++;
+  return n;
+}
+
+void block_manager::free_block(uint32_t id, bool fresh)
+{
+  free_run(id, 1, fresh);
+}
+
+// The layout of disk should be like this:
+// |<-sb->|<-free block bitmap->|<-free inode bitmap->|<-inode table->|<-data->|<-log->|
+block_manager::block_manager()
+  : block_manager(fs_options())
+{
+}
+
+// Mount the file system on the disk, formatting it if it holds none.
+block_manager::block_manager(const fs_options &opts)
+{
+  d = new disk(opts);
+  cache_size = opts.cache_blocks;
+  VERIFY(pthread_mutex_init(&cache_m, 0) == 0);
+  // recursive, as commit logs the bitmap blocks of pending frees
+  pthread_mutexattr_t attr;
+  VERIFY(pthread_mutexattr_init(&attr) == 0);
+  VERIFY(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) == 0);
+  VERIFY(pthread_mutex_init(&log_m, &attr) == 0);
+  VERIFY(pthread_cond_init(&log_c, 0) == 0);
+  outstanding = 0;
+  reserved = 0;
+  pending_blocks = 0;
+  VERIFY(pthread_mutex_init(&share_m, 0) == 0);
+  nshared = 0;
+  nsegs = head = head_off = 0;
+  cleaning = false;
+  VERIFY(pthread_cond_init(&clean_c, 0) == 0);
+  cleaner_running = cleaner_stop = false;
+  last_write = 0;
+  dedup = opts.dedup;
+  d->read_at(SB_OFFSET, (char *)&sb, sizeof(sb));
+  if (sb.magic != FS_MAGIC) {
+    format(opts);
   } else {
-    for(unsigned int i = original_block_num; i < block_num; i++){
-      alloc_nth_block(ino, i, content, false);
+    if (sb.block_size == 0)
+      sb.block_size = 512;
+    d->set_block_size(sb.block_size);
+    if (sb.nblocks > d->size()) {
+      printf("\tbm: file system has %u blocks, disk only %u\n",
+             sb.nblocks, d->size());
+      exit(1);
     }
+    load_map();
+  }
+  if (journaling())
+    log_data.resize((size_t)LOGSIZE(sb) * sb.block_size);
+  recover();
+  load_csums();
+  uint32_t ngroups = MAX(1, MIN(AG_MAX, sb.nblocks / AG_MIN_BLOCKS));
+  if (opts.groups != 0)
+    ngroups = MIN(ngroups, opts.groups);
+  free_map.load(this, BBLOCK(0, sb), sb.nblocks, ngroups);
+  sb.free_blocks = free_map.free_count();
+  if (log_structured()) {
+    VERIFY(pthread_create(&cleaner, NULL, cleaner_main, this) == 0);
+    cleaner_running = true;
   }
+}
 
-  if(size != 0){
-    //write until last block
-    for (unsigned i = 0; i + 1 < block_num; i++, buf += BLOCK_SIZE) {
-      content.assign(buf, BLOCK_SIZE);
-      write_nth_block(ino, i, content);
+// Unmount. The disk is only synced, so what was not written back or
+// committed is lost, as in a crash; inode_manager syncs first. The
+// cleaner finishes the turn it is in.
+block_manager::~block_manager()
+{
+  if (cleaner_running) {
+    {
+      ProfLock ml(&cache_m, LK_CACHE);
+      cleaner_stop = true;
+      VERIFY(pthread_cond_signal(&clean_c) == 0);
     }
+    VERIFY(pthread_join(cleaner, NULL) == 0);
+  }
+  delete d;
+}
+
+// Write a fresh superblock and clear the bitmaps and inode table, which
+// may hold garbage if the image was used for something else. Everything
+// up to the first data block, the checksum table and the journal are
+// marked in use, and in the log-structured layout all blocks from
+// map_limit on. The journal gets a sixteenth of the disk, as much as
+// its header can name. A log-structured disk only needs its bitmaps
+// written, as blocks never written read as zeros.
+void block_manager::format(const fs_options &opts)
+{
+  uint32_t bs = opts.block_size;
+  blockid_t data_start;
 
-    //write last block, resize to BLOCK_SIZE to avoid undefined behavior when memcpy
-    uint32_t remain_bytes = size - (block_num - 1) * BLOCK_SIZE;
-    content.assign(buf, remain_bytes);
-    content.resize(BLOCK_SIZE);
-    write_nth_block(ino, block_num - 1, content);
+  if (bs < MIN_BLOCK_SIZE || bs > MAX_BLOCK_SIZE || (bs & (bs - 1)) != 0) {
+    printf("\tbm: bad block size %u\n", bs);
+    exit(1);
   }
+  d->set_block_size(bs);
+  std::vector<char> buf(bs);
 
-  put_inode(inum, ino);
-  free(ino);
+  sb.magic = FS_MAGIC;
+  sb.block_size = bs;
+  sb.nblocks = d->size();
+  sb.size = (uint64_t)bs * sb.nblocks;
+  sb.ninodes = opts.inodes;
+  sb.log_size = 0;
+  if (opts.journal)
+    sb.log_size = 1 + MIN(bs / sizeof(uint32_t) - 1, MAX(MAXOPBLOCKS, sb.nblocks / 16));
+  sb.log_start = sb.nblocks - sb.log_size;
+  sb.csum_blocks = 0;
+  if (opts.checksums)
+    sb.csum_blocks = (sb.nblocks + CSUM_PER_BLOCK(sb) - 1) / CSUM_PER_BLOCK(sb);
+  sb.csum_start = sb.log_start - sb.csum_blocks;
+  sb.csum_dirty = 0;
+  sb.seg_blocks = sb.map_blocks = sb.map_limit = 0;
+  sb.map_start = sb.csum_start;
+  if (opts.log_structured) {
+    sb.map_blocks = (sb.csum_start + MAP_PER_BLOCK(sb) - 1) / MAP_PER_BLOCK(sb);
+    sb.map_start = sb.csum_start - sb.map_blocks;
+    sb.seg_blocks = MAX(LFS_MIN_SEG, LFS_SEG_BYTES / bs);
+    uint32_t segs = (sb.map_start - BBLOCK(0, sb)) / sb.seg_blocks;
+    if (segs > LFS_RESERVE)
+      sb.map_limit = BBLOCK(0, sb) +
+        (uint64_t)(segs - LFS_RESERVE) * sb.seg_blocks * LFS_FILL / 100;
+  }
+  blockid_t unused = opts.log_structured ? sb.map_limit : sb.csum_start;
+  sb.free_blocks = sb.free_inodes = 0;
+  sb.shared = 0;
+  data_start = IBLOCK(sb.ninodes, sb) + 1;
+  if (sb.ninodes < 2 || data_start >= unused) {
+    printf("\tbm: %u blocks of %u bytes cannot hold %u inodes\n",
+           sb.nblocks, bs, sb.ninodes);
+    exit(1);
+  }
+
+  for (blockid_t i = 0; i < (opts.log_structured ? BBLOCK(0, sb) : data_start); i++)
+    d->write_block(i, &buf[0]);
+  d->write_at(SB_OFFSET, (char *)&sb, sizeof(sb));
+  for (blockid_t b = sb.map_start; b < sb.log_start; b++)
+    d->write_block(b, &buf[0]);
+  if (sb.log_size != 0)
+    d->write_block(sb.log_start, &buf[0]);
+
+  uint32_t nbitmap = (sb.nblocks + BPB(sb) - 1) / BPB(sb);
+  std::vector<char> bits((size_t)nbitmap * bs);
+  for (blockid_t b = 0; b < sb.nblocks; b = b + 1 == data_start ? unused : b + 1)
+    bits[b / 8] |= 1 << (b % 8);
+  if (!opts.log_structured) {
+    d->write_blocks(BBLOCK(0, sb), nbitmap, &bits[0]);
+    return;
+  }
+  load_map();
+  phys_write(BBLOCK(0, sb), nbitmap, &bits[0]);
+  checkpoint();
 }
 
-void inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
+// Install a transaction that committed before a crash. Installing is
+// idempotent, so a crash in here just replays it again.
+void block_manager::recover()
 {
-  /*
-   * your code goes here.
-   * note: get the attributes of inode inum.
-   * you can refer to "struct attr" in extent_protocol.h
-   */
-  inode_t* ino = get_inode(inum);
-  if(ino == NULL){
-    printf("[ERROR]invalid inode\n");
+  if (!journaling())
+    return;
+
+  std::vector<char> buf(sb.block_size), hbuf(sb.block_size);
+  log_header_t *hdr = (log_header_t *)&hbuf[0];
+
+  d->read_block(sb.log_start, &hbuf[0]);
+  if (hdr->n > LOGSIZE(sb)) {
+    printf("\tbm: bad journal header, %u blocks\n", hdr->n);
     return;
   }
-  a.type = ino->type;
-  a.atime = ino->atime;
-  a.mtime = ino->mtime;
-  a.ctime = ino->ctime;
-  a.size = ino->size;
-  free(ino);
+  if (hdr->n == 0)
+    return;
+  if (checksumming()) {
+    // installing bypasses the checksums, so have them computed again
+    sb.csum_dirty = 1;
+    d->write_at(SB_OFFSET, (char *)&sb, sizeof(sb));
+  }
+  for (uint32_t i = 0; i < hdr->n; i++) {
+    d->read_block(sb.log_start + 1 + i, &buf[0]);
+    phys_write(hdr->block[i], 1, &buf[0]);
+  }
+  checkpoint();
+  d->sync();
+  hdr->n = 0;
+  d->write_block(sb.log_start, &hbuf[0]);
+  d->sync();
 }
 
-void inode_manager::remove_file(uint32_t inum)
+// Load the checksum table. If blocks changed after the last sync the
+// table on disk may be behind them, so it is computed again from the
+// blocks as they are; corruption from before the crash goes unnoticed.
+void block_manager::load_csums()
 {
-  /*
-   * your code goes here
-   * note: you need to consider about both the data block and inode of the file
-   */
-  inode_t* ino = get_inode(inum);
-  if(ino == NULL){
-    printf("invalid inode number\n");
+  uint32_t per = CSUM_PER_BLOCK(sb);
+
+  csum_clean = true;
+  if (!checksumming())
+    return;
+  csums.resize((size_t)sb.csum_blocks * per);
+  csum_changed.assign(sb.csum_blocks, false);
+  d->read_blocks(sb.csum_start, sb.csum_blocks, (char *)&csums[0]);
+  if (!sb.csum_dirty)
     return;
+
+  std::vector<char> buf(sb.block_size);
+  printf("\tbm: block checksums not synced, computing them again\n");
+  for (blockid_t b = BBLOCK(0, sb); b < sb.csum_start; b++) {
+    phys_read(b, 1, &buf[0]);
+    csums[b] = crc32c(0, &buf[0], sb.block_size);
   }
-  unsigned int size = ino->size;
-  unsigned int block_num = size == 0 ? 0 : ((size - 1)/BLOCK_SIZE + 1);
-  debug_log("remove file inode: %d\tsize: %d\tblock size: %d\n", inum, size, block_num);
+  csum_changed.assign(sb.csum_blocks, true);
+  csum_clean = false;  // until the next sync writes the table
+}
+
+// Read n contiguous blocks from the disk, checking each one that has a
+// checksum. A mismatch is reported and counted, and the block returned
+// as read. Called with cache_m held.
+void block_manager::disk_read(blockid_t id, uint32_t n, char *buf)
+{
+  uint32_t bs = sb.block_size;
 
-  for(unsigned int i = 0; i < block_num; i++){
-    free_nth_block(ino, i);
+  phys_read(id, n, buf);
+  if (!checksumming())
+    return;
+  for (uint32_t i = 0; i < n; i++) {
+    blockid_t b = id + i;
+    if (b < BBLOCK(0, sb) || b >= sb.csum_start || csums[b] == 0)
+      continue;
+    if (crc32c(0, buf + (size_t)i * bs, bs) != csums[b]) {
+      stats.csum_errors++;
+      printf("\tbm: checksum mismatch in block %u\n", b);
+    }
   }
-  if(block_num >= NDIRECT) bm->free_block(ino->blocks[NDIRECT]);
-  //free inode
-  free_inode(inum);
-  free(ino);
 }
 
-blockid_t inode_manager::get_nth_blockid(struct inode *ino, uint32_t nth){
-  if(nth < NDIRECT)
-    return ino->blocks[nth];
+// Write n contiguous blocks to the disk and record their checksums.
+// The first write after a sync marks the table on disk stale, before
+// any block changes. Called with cache_m held.
+void block_manager::disk_write(blockid_t id, uint32_t n, const char *buf)
+{
+  uint32_t bs = sb.block_size;
+
+  if (checksumming()) {
+    csums_stale();
+    for (uint32_t i = 0; i < n; i++) {
+      blockid_t b = id + i;
+      if (b < BBLOCK(0, sb) || b >= sb.csum_start)
+        continue;
+      csums[b] = crc32c(0, buf + (size_t)i * bs, bs);
+      csum_changed[b / CSUM_PER_BLOCK(sb)] = true;
+    }
+  }
+  phys_write(id, n, buf);
+}
 
-  blockid_t indirect_blockid = ino->blocks[NDIRECT];
-  blockid_t indirect_block[NINDIRECT];
-  bm->read_block(indirect_blockid, (char*)indirect_block);
+// Mark the checksum table on disk stale, if it is not yet. Called with
+// cache_m held.
+void block_manager::csums_stale()
+{
+  if (csum_clean) {
+    csum_clean = false;
+    sb.csum_dirty = 1;
+    d->write_at(SB_OFFSET, (char *)&sb, sizeof(sb));
+  }
+}
 
-  return indirect_block[nth - NDIRECT];
+// Whether block id goes through the block map.
+bool block_manager::mapped(blockid_t id) const
+{
+  return id >= BBLOCK(0, sb) && id < sb.map_limit;
 }
 
-void inode_manager::free_nth_block(struct inode *ino, uint32_t nth){
-  blockid_t id = get_nth_blockid(ino, nth);
-  bm->free_block(id);
+blockid_t block_manager::seg_first(uint32_t seg) const
+{
+  return BBLOCK(0, sb) + seg * sb.seg_blocks;
 }
 
-void inode_manager::write_nth_block(struct inode *ino, uint32_t nth, std::string &buf){
-  blockid_t blockid = get_nth_blockid(ino, nth);
-  assert(buf.size() == BLOCK_SIZE);
-  bm->write_block(blockid, buf.data());
+uint32_t block_manager::seg_of(blockid_t slot) const
+{
+  return (slot - BBLOCK(0, sb)) / sb.seg_blocks;
 }
 
-void inode_manager::alloc_nth_block(struct inode *ino, uint32_t nth, std::string &buf, bool to_write){
-  blockid_t blockid = bm->alloc_block();
-  if (to_write)
-    bm->write_block(blockid, buf.data());
-  if (nth < NDIRECT)
-    ino->blocks[nth] = blockid;
-  else {
-    blockid_t indirect_blockid;
-    blockid_t indirect_block[NINDIRECT] = {0};
-    if(nth == NDIRECT){
-      indirect_blockid = bm->alloc_block();
-      ino->blocks[NDIRECT] = indirect_blockid;
-    } else {
-      indirect_blockid = ino->blocks[NDIRECT];
-      bm->read_block(indirect_blockid, (char*)indirect_block);
+// Load the block map of a log-structured disk and work out from it
+// which slots and segments are in use. The head starts out in a free
+// segment at the first write, so nothing the map on disk points at is
+// overwritten.
+void block_manager::load_map()
+{
+  uint32_t per = MAP_PER_BLOCK(sb);
+
+  if (!log_structured())
+    return;
+  nsegs = (sb.map_start - BBLOCK(0, sb)) / sb.seg_blocks;
+  lmap.resize((size_t)sb.map_blocks * per);
+  d->read_blocks(sb.map_start, sb.map_blocks, (char *)&lmap[0]);
+  rmap.assign(seg_first(nsegs), 0);
+  refs.assign(seg_first(nsegs), 0);
+  sharers.clear();
+  seg_live.assign(nsegs, 0);
+  map_changed.assign(sb.map_blocks, false);
+  for (blockid_t b = BBLOCK(0, sb); b < sb.map_limit; b++) {
+    blockid_t p = lmap[b];
+    if (p == 0)
+      continue;
+    lmap[b] = 0;
+    if (p < BBLOCK(0, sb) || p >= seg_first(nsegs)) {
+      printf("\tbm: bad block map entry %u for block %u\n", p, b);
+      continue;
+    }
+    ref(b, p);
+  }
+  map_changed.assign(sb.map_blocks, false);
+  slot_hash.clear();
+  dedup_index.clear();
+  if (dedup) {
+    dedup_buf.resize(sb.block_size);
+    slot_hash.assign(seg_first(nsegs), 0);
+    for (blockid_t p = BBLOCK(0, sb); p < seg_first(nsegs); p++) {
+      if (refs[p] == 0)
+        continue;
+      d->read_block(p, &dedup_buf[0]);
+      slot_hash[p] = crc32c(0, &dedup_buf[0], sb.block_size);
+      dedup_index[slot_hash[p]] = p;
+    }
+  }
+  seg_free.assign(nsegs, false);
+  free_segs.clear();
+  for (uint32_t s = nsegs; s-- > 0; ) {  // lowest taken first
+    if (seg_live[s] == 0) {
+      seg_free[s] = true;
+      free_segs.push_back(s);
     }
-    indirect_block[nth - NDIRECT] = blockid;
-    bm->write_block(indirect_blockid, (char*)indirect_block);
   }
+  head = nsegs;
+  head_off = sb.seg_blocks;
 }
 
-void inode_manager::read_nth_block(struct inode *ino, uint32_t nth, char* buf){
-  blockid_t blockid = get_nth_blockid(ino, nth);
-  bm->read_block(blockid, buf);
-}
\ No newline at end of file
+// Read n contiguous blocks from where they live: in place, or where the
+// block map says, each run of copies lying together on the disk in one
+// transfer. Called with cache_m held.
+void block_manager::phys_read(blockid_t id, uint32_t n, char *buf)
+{
+  uint32_t bs = sb.block_size;
+
+  if (!log_structured()) {
+    d->read_blocks(id, n, buf);
+    return;
+  }
+  for (uint32_t i = 0; i < n; ) {
+    blockid_t p = mapped(id + i) ? lmap[id + i] : id + i;
+    uint32_t j = i + 1;
+    if (p == 0) {
+      memset(buf + (size_t)i * bs, 0, bs);
+      i = j;
+      continue;
+    }
+    while (j < n && mapped(id + j) && lmap[id + j] == p + (j - i))
+      j++;
+    d->read_blocks(p, j - i, buf + (size_t)i * bs);
+    i = j;
+  }
+}
+
+// Write n contiguous blocks: in place, or to the next free slots of the
+// log, after which the block map points at the new copies and the
+// slots of the old ones are dead unless shared. With dedup a block
+// whose contents a live slot already holds is mapped there and not
+// written. Called with cache_m held.
+void block_manager::phys_write(blockid_t id, uint32_t n, const char *buf)
+{
+  uint32_t bs = sb.block_size;
+  blockid_t run = 0;     // slots taken and not yet written
+  uint32_t run_len = 0;
+  const char *run_buf = NULL;
+
+  if (!log_structured()) {
+    write_slots(id, n, buf);
+    return;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    blockid_t b = id + i;
+    const char *data = buf + (size_t)i * bs;
+    uint32_t hash = 0;
+    if (!mapped(b)) {
+      d->write_block(b, data);
+      continue;
+    }
+    if (dedup) {
+      hash = crc32c(0, data, bs);
+      blockid_t p = find_copy(hash, data, run, run_len, run_buf);
+      if (p != 0) {
+        stats.deduped++;
+        if (lmap[b] != p) {
+          unref(b);
+          ref(b, p);
+        }
+        continue;
+      }
+    }
+    // the run is written before advance_head, which may clean
+    if (run_len > 0 && (head_off == sb.seg_blocks ||
+                        data != run_buf + (size_t)run_len * bs)) {
+      write_slots(run, run_len, run_buf);
+      run_len = 0;
+    }
+    if (head_off == sb.seg_blocks)
+      advance_head();
+    blockid_t p = seg_first(head) + head_off++;
+    if (run_len++ == 0) {
+      run = p;
+      run_buf = data;
+    }
+    unref(b);
+    ref(b, p);
+    if (dedup) {
+      slot_hash[p] = hash;
+      dedup_index[hash] = p;
+    }
+  }
+  if (run_len > 0)
+    write_slots(run, run_len, run_buf);
+}
+
+// Write n blocks to the disk from slot on, counting a seek if they do
+// not follow the last write. Called with cache_m held.
+void block_manager::write_slots(blockid_t slot, uint32_t n, const char *buf)
+{
+  if (slot != last_write)
+    stats.seeks++;
+  last_write = slot + n;
+  d->write_blocks(slot, n, buf);
+}
+
+// The live slot holding the same bytes as data, which hash to hash, or
+// 0. Slots from run on taken by the write in progress are still only
+// in run_buf. Called with cache_m held.
+blockid_t block_manager::find_copy(uint32_t hash, const char *data, blockid_t run,
+                                   uint32_t run_len, const char *run_buf)
+{
+  std::unordered_map<uint32_t, blockid_t>::iterator it = dedup_index.find(hash);
+  const char *copy;
+
+  if (it == dedup_index.end())
+    return 0;
+  blockid_t p = it->second;
+  if (run_len > 0 && p >= run && p < run + run_len) {
+    copy = run_buf + (size_t)(p - run) * sb.block_size;
+  } else {
+    d->read_block(p, &dedup_buf[0]);
+    copy = &dedup_buf[0];
+  }
+  return memcmp(copy, data, sb.block_size) == 0 ? p : 0;
+}
+
+// Map block id, which is mapped nowhere, to slot. Called with cache_m
+// held.
+void block_manager::ref(blockid_t id, blockid_t slot)
+{
+  lmap[id] = slot;
+  map_changed[id / MAP_PER_BLOCK(sb)] = true;
+  if (rmap[slot] == 0)
+    rmap[slot] = id;
+  else
+    sharers[slot].insert(id);
+  if (refs[slot]++ == 0)
+    seg_live[seg_of(slot)]++;
+}
+
+// Map block id nowhere. Its slot dies, and leaves the dedup index, when
+// no other block is mapped there. Called with cache_m held.
+void block_manager::unref(blockid_t id)
+{
+  blockid_t slot = lmap[id];
+
+  if (slot == 0)
+    return;
+  lmap[id] = 0;
+  map_changed[id / MAP_PER_BLOCK(sb)] = true;
+  std::unordered_map<blockid_t, std::unordered_set<blockid_t> >::iterator it;
+  it = sharers.find(slot);
+  if (rmap[slot] == id) {
+    rmap[slot] = 0;
+    if (it != sharers.end()) {
+      rmap[slot] = *it->second.begin();
+      it->second.erase(it->second.begin());
+    }
+  } else if (it != sharers.end()) {
+    it->second.erase(id);
+  }
+  if (it != sharers.end() && it->second.empty())
+    sharers.erase(it);
+  if (--refs[slot] > 0)
+    return;
+  seg_live[seg_of(slot)]--;
+  if (dedup) {
+    std::unordered_map<uint32_t, blockid_t>::iterator d_it;
+    d_it = dedup_index.find(slot_hash[slot]);
+    if (d_it != dedup_index.end() && d_it->second == slot)
+      dedup_index.erase(d_it);
+  }
+}
+
+// Copy a live slot to the head for the cleaner, and map every block
+// sharing it to the copy. buf is scratch. Called with cache_m held.
+void block_manager::move_slot(blockid_t slot, char *buf)
+{
+  d->read_block(slot, buf);
+  if (head_off == sb.seg_blocks)
+    advance_head();
+  blockid_t p = seg_first(head) + head_off++;
+  write_slots(p, 1, buf);
+  while (rmap[slot] != 0) {
+    blockid_t b = rmap[slot];
+    unref(b);
+    ref(b, p);
+  }
+  if (dedup) {
+    slot_hash[p] = slot_hash[slot];
+    dedup_index[slot_hash[p]] = p;
+  }
+}
+
+// Start filling a free segment, and wake the cleaner thread if that
+// leaves less than a sixteenth free; sync wakes it below an eighth,
+// which it cleans back up to. When only the cleaner's reserve is
+// left the cleaner runs first, in the foreground; it writes to the head
+// itself, and may leave room there. Called with cache_m held.
+void block_manager::advance_head()
+{
+  if (!cleaning && free_segs.size() <= LFS_RESERVE) {
+    clean(LFS_RESERVE + MAX(2, nsegs / 32));
+    if (head_off < sb.seg_blocks)
+      return;
+  }
+  if (free_segs.empty())
+    checkpoint();
+  if (free_segs.empty()) {
+    printf("\tbm: no free log segment\n");
+    exit(1);
+  }
+  head = free_segs.back();
+  free_segs.pop_back();
+  seg_free[head] = false;
+  head_off = 0;
+  if (free_segs.size() < nsegs / 16)
+    VERIFY(pthread_cond_signal(&clean_c) == 0);
+}
+
+// Forget the copies of len freed blocks from id on, so that their slots
+// die now rather than when the blocks are next written, and drop any
+// cached copy, which would only be written back to a new slot. Called
+// with cache_m held, before the blocks can be handed out again.
+void block_manager::trim(blockid_t id, uint32_t len)
+{
+  for (blockid_t b = id; b < id + len; b++) {
+    if (!mapped(b))
+      continue;
+    std::unordered_map<blockid_t, std::list<cached_block>::iterator>::iterator it;
+    it = cached.find(b);
+    if (it != cached.end()) {
+      lru.erase(it->second);
+      cached.erase(it);
+    }
+    if (checksumming() && csums[b] != 0) {
+      csums_stale();
+      csums[b] = 0;
+      csum_changed[b / CSUM_PER_BLOCK(sb)] = true;
+    }
+    unref(b);
+  }
+}
+
+// How many blocks the block map points somewhere, and how many slots
+// they take; with dedup there can be fewer slots than blocks.
+void block_manager::map_usage(uint32_t &blocks, uint32_t &slots)
+{
+  ProfLock ml(&cache_m, LK_CACHE);
+
+  blocks = slots = 0;
+  if (!log_structured())
+    return;
+  for (blockid_t b = BBLOCK(0, sb); b < sb.map_limit; b++)
+    blocks += lmap[b] != 0;
+  for (uint32_t s = 0; s < nsegs; s++)
+    slots += seg_live[s];
+}
+
+// Write back the changed part of the block map, once the copies it
+// points at are on the disk, and then hand out again the segments that
+// nothing is mapped into any more. Called with cache_m held.
+void block_manager::checkpoint()
+{
+  uint32_t per = MAP_PER_BLOCK(sb);
+  bool changed = false;
+
+  if (!log_structured())
+    return;
+  for (uint32_t i = 0; i < map_changed.size(); i++)
+    changed = changed || map_changed[i];
+  if (changed) {
+    d->sync();
+    for (uint32_t i = 0; i < map_changed.size(); i++) {
+      if (map_changed[i]) {
+        stats.disk_writes++;
+        d->write_block(sb.map_start + i, (char *)&lmap[(size_t)i * per]);
+        map_changed[i] = false;
+      }
+    }
+    d->sync();
+  }
+  for (uint32_t s = 0; s < nsegs; s++) {
+    if (s != head && !seg_free[s] && seg_live[s] == 0) {
+      seg_free[s] = true;
+      free_segs.push_back(s);
+    }
+  }
+}
+
+// Empty the segments with the fewest live copies by writing those to
+// the head, until want segments are free or emptied, then checkpoint so
+// the emptied ones can be reused. Greedy: random overwrites leave dead
+// slots spread evenly, so no segment is worth keeping for later.
+// Called with cache_m held.
+void block_manager::clean(uint32_t want)
+{
+  std::vector<char> buf(sb.block_size);
+
+  cleaning = true;
+  checkpoint();
+  for (;;) {
+    uint32_t victim = nsegs, emptied = 0;
+    for (uint32_t s = 0; s < nsegs; s++) {
+      if (s == head || seg_free[s])
+        continue;
+      if (seg_live[s] == 0)
+        emptied++;
+      else if (victim == nsegs || seg_live[s] < seg_live[victim])
+        victim = s;
+    }
+    if (free_segs.size() + emptied >= want || victim == nsegs ||
+        seg_live[victim] == sb.seg_blocks)
+      break;
+    for (blockid_t p = seg_first(victim); p < seg_first(victim + 1); p++) {
+      if (rmap[p] == 0)
+        continue;
+      move_slot(p, &buf[0]);
+      stats.moved++;
+    }
+    stats.cleaned++;
+  }
+  checkpoint();
+  cleaning = false;
+}
+
+// Whether the cleaner thread has work: less than an eighth of the
+// segments are free. Called with cache_m held.
+bool block_manager::clean_wanted() const
+{
+  return free_segs.size() < nsegs / 8;
+}
+
+void *block_manager::cleaner_main(void *arg)
+{
+  ((block_manager *)arg)->run_cleaner();
+  return NULL;
+}
+
+// The cleaner thread. Each turn holds cache_m only while it frees
+// LFS_BATCH segments, so writers get in between; turns are not
+// smaller, as each ends with a checkpoint, which syncs the disk. After
+// a turn that frees nothing, as when every segment is full of live
+// copies, it waits to be woken again rather than scanning in a loop.
+// The sleep is not counted as a wait for cache_m.
+void block_manager::run_cleaner()
+{
+  bool stuck = false;
+
+  for (;;) {
+    VERIFY(pthread_mutex_lock(&cache_m) == 0);
+    while (!cleaner_stop && (stuck || !clean_wanted())) {
+      VERIFY(pthread_cond_wait(&clean_c, &cache_m) == 0);
+      stuck = false;
+    }
+    VERIFY(pthread_mutex_unlock(&cache_m) == 0);
+
+    ProfLock ml(&cache_m, LK_CACHE);
+    if (cleaner_stop)
+      return;
+    uint32_t before = free_segs.size();
+    if (clean_wanted())
+      clean(MIN(nsegs / 8, before + LFS_BATCH));
+    stuck = free_segs.size() <= before;
+  }
+}
+
+// Find block id in the cache and make it the most recently used,
+// loading it from the disk if fill is set. A full cache evicts its
+// least recently used block, writing it back if dirty.
+// Called with cache_m held.
+cached_block *block_manager::cache_get(blockid_t id, bool fill)
+{
+  std::unordered_map<blockid_t, std::list<cached_block>::iterator>::iterator it;
+
+  it = cached.find(id);
+  if (it != cached.end()) {
+    stats.hits++;
+    lru.splice(lru.begin(), lru, it->second);
+    return &lru.front();
+  }
+
+  stats.misses++;
+  if (lru.size() < cache_size) {
+    lru.push_front(cached_block());
+    lru.front().data.resize(sb.block_size);
+  } else {
+    cached_block &victim = lru.back();
+    if (victim.dirty) {
+      stats.disk_writes++;
+      disk_write(victim.id, 1, &victim.data[0]);
+    }
+    cached.erase(victim.id);
+    lru.splice(lru.begin(), lru, --lru.end());
+  }
+  cached_block *b = &lru.front();
+  b->id = id;
+  b->dirty = false;
+  if (fill) {
+    stats.disk_reads++;
+    disk_read(id, 1, &b->data[0]);
+  }
+  cached[id] = lru.begin();
+  return b;
+}
+
+// Keep a clean copy of block id, just read from the disk, if the cache
+// has a free slot. A full cache is left alone, so a long scan never
+// displaces blocks in use, while a file read again soon finds its
+// blocks already checked. Called with cache_m held.
+void block_manager::cache_add(blockid_t id, const char *buf)
+{
+  if (lru.size() >= cache_size || cached.count(id) != 0)
+    return;
+  lru.push_back(cached_block());
+  cached_block *b = &lru.back();
+  b->data.assign(buf, buf + sb.block_size);
+  b->id = id;
+  b->dirty = false;
+  cached[id] = --lru.end();
+}
+
+void block_manager::read_block(uint32_t id, char *buf)
+{
+  if (journaling()) {
+    ProfLock ll(&log_m, LK_LOG);
+    std::unordered_map<blockid_t, uint32_t>::iterator it = log_index.find(id);
+    if (it != log_index.end()) {
+      memcpy(buf, &log_data[(size_t)it->second * sb.block_size], sb.block_size);
+      ProfLock ml(&cache_m, LK_CACHE);
+      stats.reads++;
+      return;
+    }
+  }
+
+  ProfLock ml(&cache_m, LK_CACHE);
+
+  stats.reads++;
+  if (cache_size == 0) {
+    stats.disk_reads++;
+    disk_read(id, 1, buf);
+    return;
+  }
+  memcpy(buf, &cache_get(id, true)->data[0], sb.block_size);
+}
+
+void block_manager::write_block(uint32_t id, const char *buf)
+{
+  // a logged block freed and reused for data must not be overwritten
+  // by its logged copy at commit, so it stays in the log
+  if (journaling()) {
+    ProfLock ll(&log_m, LK_LOG);
+    std::unordered_map<blockid_t, uint32_t>::iterator it = log_index.find(id);
+    if (it != log_index.end()) {
+      memcpy(&log_data[(size_t)it->second * sb.block_size], buf, sb.block_size);
+      ProfLock ml(&cache_m, LK_CACHE);
+      stats.writes++;
+      return;
+    }
+  }
+  write_cached(id, buf);
+}
+
+void block_manager::write_cached(uint32_t id, const char *buf)
+{
+  ProfLock ml(&cache_m, LK_CACHE);
+
+  stats.writes++;
+  if (cache_size == 0) {
+    stats.disk_writes++;
+    disk_write(id, 1, buf);
+    return;
+  }
+  cached_block *b = cache_get(id, false);
+  memcpy(&b->data[0], buf, sb.block_size);
+  b->dirty = true;
+}
+
+// The newest copy of block id held in memory, from the running
+// transaction or the cache, or NULL if the disk has it. A cached copy
+// becomes the most recently used. Called with log_m and cache_m held.
+char *block_manager::in_memory(blockid_t id, bool &logged)
+{
+  std::unordered_map<blockid_t, uint32_t>::iterator lit = log_index.find(id);
+  logged = lit != log_index.end();
+  if (logged)
+    return &log_data[(size_t)lit->second * sb.block_size];
+
+  std::unordered_map<blockid_t, std::list<cached_block>::iterator>::iterator it;
+  it = cached.find(id);
+  if (it == cached.end())
+    return NULL;
+  lru.splice(lru.begin(), lru, it->second);
+  return &it->second->data[0];
+}
+
+// Read n contiguous blocks. Blocks held in memory are copied from
+// there; each run of the others comes from the disk in one transfer
+// and is kept in the cache while it has room, so their checksums are
+// checked once per load rather than on every read.
+void block_manager::read_blocks(blockid_t id, uint32_t n, char *buf)
+{
+  uint32_t bs = sb.block_size;
+  bool logged;
+
+  ProfLock ll(&log_m, LK_LOG);
+  ProfLock ml(&cache_m, LK_CACHE);
+  stats.reads++;
+  for (uint32_t i = 0; i < n; ) {
+    char *src = in_memory(id + i, logged);
+    if (src != NULL) {
+      stats.hits++;
+      memcpy(buf + (size_t)i * bs, src, bs);
+      i++;
+      continue;
+    }
+    uint32_t j = i + 1;
+    while (j < n && in_memory(id + j, logged) == NULL)
+      j++;
+    stats.misses += j - i;
+    stats.disk_reads += j - i;
+    disk_read(id + i, j - i, buf + (size_t)i * bs);
+    for (uint32_t k = i; k < j && lru.size() < cache_size; k++)
+      cache_add(id + k, buf + (size_t)k * bs);
+    i = j;
+  }
+}
+
+// Write n contiguous blocks, each run in one transfer straight to the
+// disk; cached copies are refreshed and left clean. Blocks in the
+// running transaction are only updated there, so their home copies
+// still wait for the commit.
+void block_manager::write_blocks(blockid_t id, uint32_t n, const char *buf)
+{
+  uint32_t bs = sb.block_size;
+  bool logged;
+
+  ProfLock ll(&log_m, LK_LOG);
+  ProfLock ml(&cache_m, LK_CACHE);
+  stats.writes++;
+  for (uint32_t i = 0; i < n; ) {
+    char *dst = in_memory(id + i, logged);
+    if (logged) {
+      memcpy(dst, buf + (size_t)i * bs, bs);
+      i++;
+      continue;
+    }
+    uint32_t j = i;
+    for (; j < n; j++) {
+      dst = in_memory(id + j, logged);
+      if (logged)
+        break;
+      if (dst != NULL) {
+        memcpy(dst, buf + (size_t)j * bs, bs);
+        cached[id + j]->dirty = false;
+      }
+    }
+    stats.disk_writes += j - i;
+    disk_write(id + i, j - i, buf + (size_t)i * bs);
+    i = j;
+  }
+}
+
+// Write every dirty cached block back to the disk.
+void block_manager::flush()
+{
+  ProfLock ml(&cache_m, LK_CACHE);
+
+  for (std::list<cached_block>::iterator it = lru.begin(); it != lru.end(); ++it) {
+    if (it->dirty) {
+      stats.disk_writes++;
+      disk_write(it->id, 1, &it->data[0]);
+      it->dirty = false;
+    }
+  }
+}
+
+// Commit, write back the cache, the changed part of the checksum table
+// and the superblock's free counts, and make it all durable. The counts
+// are only a snapshot, for tools that read the image; mounting counts
+// the bitmaps again. The superblock is written under log_m, as syncs
+// may run at once, and cache_m, which covers the checksums.
+void block_manager::sync(uint32_t free_inodes)
+{
+  if (journaling()) {
+    ProfLock ll(&log_m, LK_LOG);
+    while (outstanding > 0)
+      ll.wait(&log_c, LK_LOG);
+    commit();
+  }
+  flush();
+  {
+    ProfLock ll(&log_m, LK_LOG);
+    ProfLock ml(&cache_m, LK_CACHE);
+    for (uint32_t i = 0; i < csum_changed.size(); i++) {
+      if (csum_changed[i]) {
+        stats.disk_writes++;
+        d->write_block(sb.csum_start + i, (char *)&csums[(size_t)i * CSUM_PER_BLOCK(sb)]);
+        csum_changed[i] = false;
+      }
+    }
+    checkpoint();
+    if (log_structured() && clean_wanted())
+      VERIFY(pthread_cond_signal(&clean_c) == 0);
+    sb.free_blocks = free_map.free_count();
+    sb.free_inodes = free_inodes;
+    // owners dropped since the commit may not be durable yet
+    if (outstanding == 0 && log_ids.empty() && pending_free.empty())
+      sb.shared = sharing();
+    sb.csum_dirty = 0;
+    csum_clean = true;
+    d->write_at(SB_OFFSET, (char *)&sb, sizeof(sb));
+  }
+  d->sync();
+}
+
+// Whether the log lacks room for an operation reserving nblocks, once
+// the blocks logged, the bitmap blocks pending frees will add and the
+// reservations of those inside are counted. Called with log_m held.
+bool block_manager::log_full(uint32_t nblocks)
+{
+  return log_ids.size() + free_bmap.size() + reserved + nblocks > LOGSIZE(sb);
+}
+
+// Join the running transaction, reserving nblocks of the log, up to
+// all of it. An operation is admitted only while the log has that much
+// free; when there is no room and nobody is inside, commit first.
+// Allocations may take half the reservation, the rest being kept for
+// the map, the frees and the inode.
+void block_manager::begin_op(uint32_t nblocks)
+{
+  if (!journaling())
+    return;
+
+  nblocks = MIN(nblocks, LOGSIZE(sb));
+  ProfLock ll(&log_m, LK_LOG);
+  VERIFY(cur_op.bm == NULL);
+  while (log_full(nblocks)) {
+    if (outstanding == 0)
+      commit();
+    else
+      ll.wait(&log_c, LK_LOG);
+  }
+  outstanding++;
+  reserved += nblocks;
+  cur_op.bm = this;
+  cur_op.left = nblocks;
+  cur_op.keep = nblocks / 2;
+  cur_op.cut = false;
+}
+
+// Leave the running transaction, giving back what the operation did not
+// use. The last operation out commits it if another operation would
+// not fit, or if it has freed a sixteenth of the disk, which is not
+// reusable until then; otherwise it stays open so that later
+// operations share its commit.
+void block_manager::end_op()
+{
+  if (!journaling())
+    return;
+
+  ProfLock ll(&log_m, LK_LOG);
+  VERIFY(cur_op.bm == this);
+  reserved -= cur_op.left;
+  cur_op.bm = NULL;
+  outstanding--;
+  if (outstanding == 0 && (log_full(MAXOPBLOCKS) || pending_blocks >= sb.nblocks / 16))
+    commit();
+  pthread_cond_broadcast(&log_c);
+}
+
+// Count one more block of the log against the running operation, which
+// may never add more than it reserved. Called with log_m held.
+void block_manager::charge_op()
+{
+  if (cur_op.bm != this)
+    return;
+  VERIFY(cur_op.left > 0);
+  cur_op.left--;
+  reserved--;
+}
+
+// How many more blocks the running operation may add to the log.
+uint32_t block_manager::op_room() const
+{
+  return cur_op.bm == this ? cur_op.left : 0xffffffffU;
+}
+
+// Whether the running operation may still add n blocks to the log; if
+// not it is marked short, to be retried smaller or with more room.
+bool block_manager::log_room(uint32_t n)
+{
+  if (cur_op.bm != this || n <= cur_op.left)
+    return true;
+  cur_op.cut = true;
+  return false;
+}
+
+// Whether the last operation this thread ran was cut short for want of
+// log room rather than failing.
+bool block_manager::op_short() const
+{
+  return journaling() && cur_op.cut;
+}
+
+// How many blocks freeing len blocks from id on would add to the log:
+// the bitmap blocks they fall in that are neither logged nor already to
+// be written for another free.
+uint32_t block_manager::free_cost(blockid_t id, uint32_t len)
+{
+  uint32_t n = 0;
+
+  if (!journaling() || len == 0)
+    return 0;
+  ProfLock ll(&log_m, LK_LOG);
+  for (blockid_t b = BBLOCK(id, sb); b <= BBLOCK(id + len - 1, sb); b++)
+    n += log_index.count(b) == 0 && free_bmap.count(b) == 0;
+  return n;
+}
+
+// Write a metadata block as part of the running transaction. A block
+// logged again just has its copy replaced; a bitmap block a free was
+// to add takes the place it was counted in.
+void block_manager::log_write(uint32_t id, const char *buf)
+{
+  if (!journaling()) {
+    write_block(id, buf);
+    return;
+  }
+
+  ProfLock ll(&log_m, LK_LOG);
+  std::unordered_map<blockid_t, uint32_t>::iterator it = log_index.find(id);
+  if (it == log_index.end()) {
+    if (free_bmap.erase(id) == 0)
+      charge_op();
+    VERIFY(log_ids.size() < LOGSIZE(sb));
+    it = log_index.insert(std::make_pair(id, (uint32_t)log_ids.size())).first;
+    log_ids.push_back(id);
+  }
+  memcpy(&log_data[(size_t)it->second * sb.block_size], buf, sb.block_size);
+  ProfLock ml(&cache_m, LK_CACHE);
+  stats.writes++;
+}
+
+// Commit the running transaction, after adding the frees it deferred
+// to it. Data blocks are flushed first so
+// committed metadata never points at blocks that were not written.
+// The logged blocks, the header and the installed home copies are each
+// made durable before the next step, and the header is cleared last.
+// Called with log_m held and no operation in progress.
+void block_manager::commit()
+{
+  drop_owners(pending_free);
+  if (log_structured()) {
+    ProfLock ml(&cache_m, LK_CACHE);
+    for (size_t i = 0; i < pending_free.size(); i++)
+      trim(pending_free[i].first, pending_free[i].second);
+  }
+  // the bitmap is only used by operations, so it needs no locking here;
+  // taking the shard locks would also invert their order with log_m
+  for (size_t i = 0; i < pending_free.size(); i++)
+    free_map.mark(pending_free[i].first, pending_free[i].second, false);
+  pending_free.clear();
+  free_bmap.clear();
+  pending_blocks = 0;
+  if (log_ids.empty())
+    return;
+
+  std::vector<char> hbuf(sb.block_size);
+  log_header_t *hdr = (log_header_t *)&hbuf[0];
+
+  flush();
+  for (uint32_t i = 0; i < log_ids.size(); i++)
+    d->write_block(sb.log_start + 1 + i, &log_data[(size_t)i * sb.block_size]);
+  d->sync();
+  hdr->n = log_ids.size();
+  memcpy(hdr->block, log_ids.data(), hdr->n * sizeof(blockid_t));
+  d->write_block(sb.log_start, &hbuf[0]);
+  d->sync();
+
+  {
+    ProfLock ml(&cache_m, LK_CACHE);
+    for (uint32_t i = 0; i < log_ids.size(); i++) {
+      const char *data = &log_data[(size_t)i * sb.block_size];
+      std::unordered_map<blockid_t, std::list<cached_block>::iterator>::iterator it;
+      it = cached.find(log_ids[i]);
+      if (it != cached.end()) {
+        memcpy(&it->second->data[0], data, sb.block_size);
+        it->second->dirty = false;
+      }
+      disk_write(log_ids[i], 1, data);
+    }
+    stats.disk_writes += 2 * log_ids.size() + 2;
+    checkpoint();
+  }
+  d->sync();
+  hdr->n = 0;
+  d->write_block(sb.log_start, &hbuf[0]);
+  d->sync();
+
+  stats.commits++;
+  stats.logged += log_ids.size();
+  log_ids.clear();
+  log_index.clear();
+}
+
+// inode layer -----------------------------------------
+
+static_assert(sizeof(inode_t) == 64, "inode must stay 64 bytes");
+static_assert(sizeof(extent_t) == 12, "extent must stay 12 bytes");
+
+// Runs one file system operation as part of the running journal
+// transaction for as long as it is in scope, with nblocks of the log
+// reserved for it.
+class ScopedOp {
+ private:
+  block_manager *bm;
+ public:
+  ScopedOp(block_manager *bm, uint32_t nblocks = MAXOPBLOCKS) : bm(bm) { bm->begin_op(nblocks); }
+  ~ScopedOp() { bm->end_op(); }
+};
+
+inode_manager::inode_manager()
+  : inode_manager(fs_options())
+{
+}
+
+inode_manager::inode_manager(const fs_options &opts)
+{
+  bm = new block_manager(opts);
+  bsize = bm->sb.block_size;
+  inline_data = opts.inline_data;
+  compress = opts.compress;
+  zblocks = MAX(ZCLUSTER_MIN, ZCLUSTER_BYTES / bsize);
+  delalloc_blocks = opts.delalloc_blocks;
+  prealloc_blocks = opts.prealloc_blocks;
+  icache_size = opts.inode_cache;
+  dir_group = 0;
+  VERIFY(pthread_mutex_init(&icache_m, 0) == 0);
+  mount();
+}
+
+// Unmount, after syncing, so the image can be mounted again.
+inode_manager::~inode_manager()
+{
+  sync();
+  delete bm;
+}
+
+// Load the inode bitmap and create the root directory on a fresh disk.
+// Inode 0 is never handed out.
+void inode_manager::mount()
+{
+  inode_map.load(bm, IMBLOCK(0, bm->sb), bm->sb.ninodes, bm->group_count());
+  bm->sb.free_inodes = inode_map.free_count();
+  if (inode_map.test(1)) {
+    if (bm->sb.shared)
+      count_shares();
+    return;
+  }
+
+  inode_map.set(0, true);
+  uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
+  if (root_dir != 1) {
+    printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
+    exit(0);
+  }
+}
+
+// Count the owners of the blocks that clones share again, from the
+// block maps of all inodes: every time a block turns up after the
+// first, it has one more.
+void inode_manager::count_shares()
+{
+  std::vector<bool> seen(bm->sb.nblocks);
+  std::vector<char> buf(bsize);
+  uint32_t ipb = IPB(bm->sb);
+
+  for (uint32_t i = 0; i < bm->sb.ninodes; i += ipb) {
+    bm->read_block(IBLOCK(i, bm->sb), &buf[0]);
+    for (uint32_t k = 0; k < ipb && i + k < bm->sb.ninodes; k++) {
+      inode_t ino = *((inode_t*)&buf[0] + k);
+      std::vector<extent_t> exts;
+      std::vector<blockid_t> nodes;
+      if (ino.type == 0 || !inode_map.test(i + k))
+        continue;
+      load_extents(&ino, exts, nodes);
+      for (size_t j = 0; j < exts.size(); j++) {
+        for (uint32_t b = 0; b < EXT_BLOCKS(exts[j], bsize); b++) {
+          blockid_t id = exts[j].pblk + b;
+          if (seen[id])
+            bm->share(id, 1);
+          seen[id] = true;
+        }
+      }
+    }
+  }
+}
+
+// Write back dirty inodes and cached blocks and flush the disk image.
+// Each dirty inode is locked while it is written, so an operation
+// still changing it finishes first. Delayed data is given blocks
+// before, and files that did not grow since the last sync give back
+// the blocks reserved past their end.
+void inode_manager::sync()
+{
+  std::vector<cached_inode *> held, dirty;
+
+  {
+    ProfLock ml(&icache_m, LK_ICACHE);
+    for (std::list<cached_inode>::iterator it = ilru.begin(); it != ilru.end(); ++it) {
+      if (it->held) {
+        it->ref++;
+        held.push_back(&*it);
+      }
+    }
+  }
+  for (size_t i = 0; i < held.size(); i++) {
+    // delayed data that needs more of the log than an operation has is
+    // flushed again in one with more
+    bool again = true;
+    for (uint32_t room = MAXOPBLOCKS; again; room *= 2) {
+      ScopedOp op(bm, room);
+      held[i]->locked_at = lock_acquire(&held[i]->m, LK_INODE);
+      again = false;
+      if (held[i]->ino.type != 0) {
+        again = !flush_delayed(held[i]) && bm->op_short() && room < LOGSIZE(bm->sb);
+        if (!again && held[i]->prealloc && !held[i]->grown)
+          trim_prealloc(held[i]);
+      }
+      if (again) {
+        ProfLock ml(&icache_m, LK_ICACHE);
+        held[i]->ref++;
+      } else {
+        held[i]->grown = false;
+      }
+      unlock_inode(held[i]);
+    }
+  }
+
+  {
+    ProfLock ml(&icache_m, LK_ICACHE);
+    for (std::list<cached_inode>::iterator it = ilru.begin(); it != ilru.end(); ++it) {
+      if (it->dirty) {
+        it->ref++;
+        dirty.push_back(&*it);
+      }
+    }
+  }
+  for (size_t i = 0; i < dirty.size(); i++) {
+    dirty[i]->locked_at = lock_acquire(&dirty[i]->m, LK_INODE);
+    {
+      ProfLock ml(&icache_m, LK_ICACHE);
+      if (dirty[i]->dirty)
+        write_inode(dirty[i]);
+    }
+    unlock_inode(dirty[i]);
+  }
+  bm->sync(inode_map.free_count());
+}
+
+// The block group that inum's blocks are allocated in. The inodes
+// are split into as many groups as the blocks, or fewer if there are
+// too few inodes; inode group i goes with the block group as far into
+// the disk as i is into the inodes.
+uint32_t inode_manager::group_of(uint32_t inum)
+{
+  return inode_map.group_of(inum) * bm->group_count() / inode_map.group_count();
+}
+
+/* Create a new file.
+ * Return its inum. */
+uint32_t inode_manager::alloc_inode(uint32_t type, uint32_t parent)
+{
+  /* 
+   * your code goes here.
+   * note: the normal inode block should begin from the 2nd inode block.
+   * the 1st is used for root_dir, see inode_manager::inode_manager().
+   */
+  
+  // A file goes in its directory's group. A new directory goes in the
+  // group with the most free inodes of those with at least the average
+  // share of free blocks, which spreads directories, and the writers
+  // working in them, over the disk; the search starts one group further
+  // on each time, so ties go round the groups. Without a parent, as
+  // for the root, the first group is used.
+  uint32_t group = 0;
+  if (parent != 0 && parent < bm->sb.ninodes) {
+    group = inode_map.group_of(parent);
+    if (type == extent_protocol::T_DIR) {
+      uint32_t ngroups = inode_map.group_count(), first = dir_group++;
+      uint32_t avg = bm->free_blocks() / bm->group_count(), most = 0;
+      for (uint32_t k = 0; k < ngroups; k++) {
+        uint32_t g = (first + k) % ngroups;
+        uint32_t nfree = inode_map.group_free(g);
+        if (bm->group_free(g * bm->group_count() / ngroups) >= avg && nfree > most) {
+          group = g;
+          most = nfree;
+        }
+      }
+    }
+  }
+
+  // compression is passed down from the directory
+  uint16_t flags = compress ? INODE_COMPRESS : 0;
+  if (parent != 0 && parent < bm->sb.ninodes) {
+    cached_inode *pc = lock_inode(parent, true);
+    if (pc->ino.type != 0)
+      flags |= pc->ino.flags & INODE_COMPRESS;
+    unlock_inode(pc);
+  }
+
+  ScopedOp op(bm);
+  uint32_t inum = inode_map.alloc(group);
+
+  if (inum == bm->sb.ninodes) {
+    printf("\tim: out of inodes\n");
+    return 0;
+  }
+
+  cached_inode *c = lock_inode(inum, false);
+  bzero(&c->ino, sizeof(c->ino));
+  c->ino.type = type;
+  c->ino.flags = flags;
+  c->ino.atime = c->ino.mtime = c->ino.ctime = std::time(0);
+  {
+    ProfLock ml(&icache_m, LK_ICACHE);
+    mark_dirty(c);
+  }
+  unlock_inode(c);
+  return inum;
+}
+
+void inode_manager::free_inode(uint32_t inum)
+{
+  /* 
+   * your code goes here.
+   * note: you need to check if the inode is already a freed one;
+   * if not, clear it, and remember to write back to disk.
+   */
+  if (inum >= bm->sb.ninodes)
+    return;
+  ScopedOp op(bm);
+  cached_inode *c = lock_inode(inum, true);
+  clear_inode(inum);
+  unlock_inode(c);
+}
+
+// Mark inum free; the caller runs the operation and holds the inode.
+void inode_manager::clear_inode(uint32_t inum)
+{
+  {
+    ProfLock ml(&icache_m, LK_ICACHE);
+    cached_inode *c = &*icache[inum];
+    if(c->ino.type == 0)
+      return;
+    c->ino.type = 0;
+    std::string().swap(c->delayed);
+    c->prealloc = false;
+    mark_dirty(c);
+  }
+  inode_map.set(inum, false);
+}
+
+
+/* Return an inode structure by inum, NULL otherwise.
+ * The inode is pinned in the inode cache and locked until the caller
+ * releases it with release_inode. */
+inode_t* inode_manager::get_inode(uint32_t inum)
+{
+  debug_log("get_inode %d\n", inum);
+
+  if (inum < 0 || inum >= bm->sb.ninodes) {
+    printf("\tim: inum out of range\n");
+    return NULL;
+  }
+
+  cached_inode *c = lock_inode(inum, true);
+  if (c->ino.type == 0) {
+    printf("\tim: inode not exist\n");
+    unlock_inode(c);
+    return NULL;
+  }
+  return &c->ino;
+}
+
+// Mark a pinned inode changed; it is written back when it leaves the
+// cache or on sync.
+void inode_manager::put_inode(uint32_t inum, inode_t *ino)
+{
+  debug_log("put_inode %d\n", inum);
+  if (ino == NULL)
+    return;
+
+  ProfLock ml(&icache_m, LK_ICACHE);
+  mark_dirty(&*icache[inum]);
+}
+
+void inode_manager::release_inode(uint32_t inum)
+{
+  unlock_inode(pinned(inum));
+}
+
+// The cache entry of an inode the caller has pinned.
+cached_inode *inode_manager::pinned(uint32_t inum)
+{
+  ProfLock ml(&icache_m, LK_ICACHE);
+  return &*icache[inum];
+}
+
+// The size of a file, counting the data held for delayed allocation.
+static uint32_t visible_size(const cached_inode *c, uint32_t bsize)
+{
+  if (c->delayed.empty())
+    return c->ino.size;
+  return c->delay_blk * bsize + c->delayed.size();
+}
+
+// Pin inum in the inode cache and lock it. Locks are taken in the
+// order inode, icache_m, so this waits for the inode without icache_m.
+cached_inode *inode_manager::lock_inode(uint32_t inum, bool fill)
+{
+  cached_inode *c;
+  {
+    ProfLock ml(&icache_m, LK_ICACHE);
+    c = icache_get(inum, fill);
+    c->ref++;
+  }
+  c->locked_at = lock_acquire(&c->m, LK_INODE);
+  return c;
+}
+
+void inode_manager::unlock_inode(cached_inode *c)
+{
+  ProfLock ml(&icache_m, LK_ICACHE);
+  c->held = !c->delayed.empty() || c->prealloc;
+  lock_release(&c->m, LK_INODE, c->locked_at);
+  c->ref--;
+  icache_trim();
+}
+
+// Find inum in the inode cache and make it the most recently used,
+// reading it from its inode block if fill is set; otherwise a new
+// entry reads as a free inode until its caller fills it in.
+// Called with icache_m held.
+cached_inode *inode_manager::icache_get(uint32_t inum, bool fill)
+{
+  std::unordered_map<uint32_t, std::list<cached_inode>::iterator>::iterator it;
+
+  it = icache.find(inum);
+  if (it != icache.end()) {
+    istats.hits++;
+    ilru.splice(ilru.begin(), ilru, it->second);
+    return &ilru.front();
+  }
+
+  istats.misses++;
+  istats.allocs++;
+  ilru.push_front(cached_inode());
+  cached_inode *c = &ilru.front();
+  c->inum = inum;
+  c->ref = 0;
+  c->dirty = false;
+  c->held = false;
+  c->delay_blk = 0;
+  c->prealloc = false;
+  c->grown = false;
+  VERIFY(pthread_mutex_init(&c->m, 0) == 0);
+  bzero(&c->ino, sizeof(c->ino));
+  if (fill) {
+    std::vector<char> buf(bsize);
+    bm->read_block(IBLOCK(inum, bm->sb), &buf[0]);
+    c->ino = *((inode_t*)&buf[0] + inum%IPB(bm->sb));
+  }
+  icache[inum] = ilru.begin();
+  return c;
+}
+
+// Write a cached inode into its inode block.
+void inode_manager::write_inode(cached_inode *c)
+{
+  std::vector<char> buf(bsize);
+
+  bm->read_block(IBLOCK(c->inum, bm->sb), &buf[0]); //先要read，因为一个block中不止一个inode
+  *((inode_t*)&buf[0] + c->inum%IPB(bm->sb)) = c->ino; // 将inode放入这个块中
+  bm->log_write(IBLOCK(c->inum, bm->sb), &buf[0]);
+  istats.writebacks++;
+  c->dirty = false;
+}
+
+// Note a change to a cached inode. With a journal it goes into the
+// running transaction right away, so it commits together with the
+// bitmap and extent blocks it refers to; otherwise it is written back
+// lazily. Called with icache_m held.
+void inode_manager::mark_dirty(cached_inode *c)
+{
+  if (bm->journaling())
+    write_inode(c);
+  else
+    c->dirty = true;
+}
+
+// Evict unpinned inodes, least recently used first, until the cache
+// is back within icache_size. Called with icache_m held.
+void inode_manager::icache_trim()
+{
+  std::list<cached_inode>::iterator it = ilru.end();
+
+  while (ilru.size() > icache_size && it != ilru.begin()) {
+    --it;
+    if (it->ref > 0 || it->held)
+      continue;
+    if (it->dirty)
+      write_inode(&*it);
+    VERIFY(pthread_mutex_destroy(&it->m) == 0);
+    icache.erase(it->inum);
+    it = ilru.erase(it);
+  }
+}
+
+/* Get all the data of a file by inum. 
+ * Return alloced data, should be freed by caller. */
+void inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
+{
+  /*
+   * your code goes here.
+   * note: read blocks related to inode number inum,
+   * and copy them to buf_out
+   */
+  inode_t* ino = get_inode(inum);
+  *size = 0;
+  if(ino == NULL)
+    return;
+  cached_inode *c = pinned(inum);
+  unsigned int file_size = visible_size(c, bsize);
+  *size = file_size;
+  if(file_size == 0) {
+    debug_log("read an empty file\n");
+    release_inode(inum);
+    return;
+  }
+
+  if(ino->flags & INODE_INLINE){
+    *buf_out = (char*)malloc(file_size);
+    memcpy(*buf_out, INLINE_DATA(ino), file_size);
+    release_inode(inum);
+    return;
+  }
+
+  unsigned int block_num = (file_size -1)/bsize + 1;
+  // holes stay zero
+  char* buf_p = *buf_out = (char*)calloc(block_num, bsize);
+  debug_log("read file inode: %d\tsize: %d\tblock size: %d\n", inum, file_size, block_num);
+
+  std::vector<extent_t> exts;
+  std::vector<blockid_t> nodes;
+  load_extents(ino, exts, nodes);
+  if(compressed(ino)){
+    uint32_t cbytes = zblocks * bsize;
+    std::vector<char> cluster(cbytes);
+    for(uint32_t pos = 0; pos < file_size; pos += cbytes){
+      read_cluster(exts, pos / cbytes, &cluster[0]);
+      memcpy(buf_p + pos, &cluster[0], MIN(cbytes, file_size - pos));
+    }
+  } else {
+    for(size_t i = 0; i < exts.size() && exts[i].lblk < block_num; i++){
+      extent_t &e = exts[i];
+      bm->read_blocks(e.pblk, MIN(e.len, block_num - e.lblk),
+                      buf_p + (size_t)e.lblk * bsize);
+    }
+  }
+  if(!c->delayed.empty())
+    memcpy(buf_p + (size_t)c->delay_blk * bsize, c->delayed.data(), c->delayed.size());
+  release_inode(inum);
+}
+
+
+/* alloc/free blocks if needed */
+void inode_manager::write_file(uint32_t inum, const char *buf, int size)
+{
+  /*
+   * your code goes here.
+   * note: write buf to blocks of inode inum.
+   * you need to consider the situation when the size of buf 
+   * is larger or smaller than the size of original inode
+   */
+  unsigned int block_num = size == 0 ? 0 : ((size - 1)/bsize + 1);
+
+  if(block_num > MAXFILE(bm->sb)){
+    printf("\tim: file %d too large: %d bytes\n", inum, size);
+    return;
+  }
+  // a file too large to replace in one operation is cut to size and
+  // then written over in pieces, if there is space for all of it, so
+  // only a disk filled meanwhile may leave it partly rewritten
+  if((!bm->journaling() || block_num <= piece_blocks(MAXOPBLOCKS)) &&
+     (write_whole(inum, buf, size) || !bm->op_short()))
+    return;
+  if(block_num + block_num / EPB(bm->sb) + 1 > bm->free_blocks()){
+    printf("\tim: no space to grow file %d to %d bytes\n", inum, size);
+    return;
+  }
+  inode_t* ino = get_inode(inum);
+  if(ino == NULL)
+    return;
+  uint32_t old_size = visible_size(pinned(inum), bsize);
+  release_inode(inum);
+  if((uint32_t)size >= old_size || truncate(inum, size))
+    write_range(inum, 0, buf, size);
+}
+
+// Replace the contents of inum with buf in one operation. Returns
+// false if the file is left as it was, for a full disk or, when the
+// operation is cut short, for want of log room.
+bool inode_manager::write_whole(uint32_t inum, const char *buf, int size)
+{
+  ScopedOp op(bm);
+  inode_t* ino = get_inode(inum);
+  if(ino == NULL)
+    return false;
+
+  debug_log("write file inode: %d\t size: %d\toriginal size: %d\n", inum, size, ino->size);
+  unsigned int block_num = size == 0 ? 0 : ((size - 1)/bsize + 1);
+
+  // the whole file is replaced, delayed data included
+  cached_inode *c = pinned(inum);
+  std::string().swap(c->delayed);
+
+  std::vector<extent_t> exts;
+  std::vector<blockid_t> nodes;
+  load_extents(ino, exts, nodes);
+  if(inline_data && (uint32_t)size <= INLINE_MAX){
+    std::vector<extent_t> cut;
+    free_extents(exts, 0, cut);
+    if(!store_extents(ino, exts, nodes, free_cost(cut) + 1)){
+      release_inode(inum);
+      return false;
+    }
+    free_runs(cut);
+    c->prealloc = false;
+    ino->flags |= INODE_INLINE;
+    bzero(INLINE_DATA(ino), INLINE_MAX);
+    memcpy(INLINE_DATA(ino), buf, size);
+    ino->size = size;
+    std::time_t t = std::time(0);
+    ino->atime = t;
+    ino->ctime = t;
+    ino->mtime = t;
+    put_inode(inum, ino);
+    release_inode(inum);
+    return true;
+  }
+
+  if(compressed(ino)){
+    // the new clusters replace the old ones as they are written, none
+    // read back in, and the clusters past the new end go only once all
+    // fit, so a full disk leaves the file as it was
+    uint32_t old_size = ino->size;
+    ino->size = 0;
+    if(!write_clusters(c, 0, buf, size, size)){
+      ino->size = old_size;
+      if(!bm->op_short())
+        printf("\tim: no space to grow file %d to %d bytes\n", inum, size);
+      release_inode(inum);
+      return false;
+    }
+    c->prealloc = false;
+    c->grown = c->grown || (uint32_t)size > old_size;
+    ino->size = size;
+    std::time_t t = std::time(0);
+    ino->atime = t;
+    ino->ctime = t;
+    ino->mtime = t;
+    put_inode(inum, ino);
+    release_inode(inum);
+    return true;
+  }
+
+  // every block is written, so holes get filled in as well. A file
+  // that keeps being rewritten larger gets blocks reserved past its
+  // end, so the next rewrites find them in place.
+  // blocks shared with a clone are replaced rather than overwritten.
+  // Blocks the file gives up are freed only once the new map is stored.
+  std::vector<extent_t> before(exts), dropped;
+  if(!unshare_extents(exts, 0, block_num * bsize, group_of(inum), dropped)){
+    if(!bm->op_short())
+      printf("\tim: no space to grow file %d to %d bytes\n", inum, size);
+    release_inode(inum);
+    return false;
+  }
+  uint32_t extra = (uint32_t)size > ino->size && ino->size > 0 ? prealloc_extra(block_num) : 0;
+  if(!alloc_extents(exts, 0, block_num + extra, group_of(inum))){
+    extra = 0;
+    if(!alloc_extents(exts, 0, block_num, group_of(inum))){
+      free_added(before, exts);
+      if(!bm->op_short())
+        printf("\tim: no space to grow file %d to %d bytes\n", inum, size);
+      release_inode(inum);
+      return false;
+    }
+  }
+  free_extents(exts, block_num + extra, dropped);
+  if(!store_extents(ino, exts, nodes, free_cost(dropped) + 1)){
+    free_added(before, exts);
+    if(!bm->op_short())
+      printf("\tim: no space to grow file %d to %d bytes\n", inum, size);
+    release_inode(inum);
+    return false;
+  }
+  free_runs(dropped);
+  c->prealloc = extra > 0;
+  c->grown = c->grown || (uint32_t)size > ino->size;
+  ino->size = size;
+  std::time_t t = std::time(0);
+  ino->atime = t;
+  ino->ctime = t;
+  ino->mtime = t;
+
+  // write a run at a time, the last block padded to a full block
+  uint32_t full = size / bsize;
+  for(size_t i = 0; i < exts.size() && exts[i].lblk < full; i++){
+    extent_t &e = exts[i];
+    bm->write_blocks(e.pblk, MIN(e.len, full - e.lblk), buf + (size_t)e.lblk * bsize);
+  }
+  if(full < block_num){
+    std::vector<char> last(bsize);
+    extent_t e;
+    memcpy(&last[0], buf + (size_t)full * bsize, size - full * bsize);
+    VERIFY(lookup_extent(ino, full, e));
+    bm->write_block(e.pblk + full - e.lblk, &last[0]);
+  }
+
+  put_inode(inum, ino);
+  release_inode(inum);
+  return true;
+}
+
+/* Read len bytes from offset off, stopping at the end of the file.
+ * Only the blocks covering the range are read; whole blocks go straight
+ * into buf a run at a time, and holes are zero-filled without reading. */
+void inode_manager::read_range(uint32_t inum, uint32_t off, uint32_t len, std::string &buf)
+{
+  inode_t* ino = get_inode(inum);
+  std::vector<char> block(bsize);
+  extent_t e;
+
+  buf.clear();
+  if(ino == NULL)
+    return;
+  cached_inode *c = pinned(inum);
+  uint32_t size = visible_size(c, bsize);
+  if(off >= size){
+    release_inode(inum);
+    return;
+  }
+  len = MIN(len, size - off);
+  debug_log("read range inode: %d\toff: %d\tlen: %d\n", inum, off, len);
+  if(ino->flags & INODE_INLINE){
+    buf.assign(INLINE_DATA(ino) + off, len);
+    release_inode(inum);
+    return;
+  }
+
+  buf.assign(len, 0);
+  if(compressed(ino)){
+    uint32_t cbytes = zblocks * bsize;
+    std::vector<extent_t> exts;
+    std::vector<blockid_t> nodes;
+    std::vector<char> cluster(cbytes);
+    load_extents(ino, exts, nodes);
+    for(uint32_t pos = off; pos < off + len; ){
+      uint32_t start = pos / cbytes * cbytes;
+      uint32_t n = MIN(start + cbytes, off + len) - pos;
+      read_cluster(exts, pos / cbytes, &cluster[0]);
+      memcpy(&buf[pos - off], &cluster[pos - start], n);
+      pos += n;
+    }
+  } else {
+    for(uint32_t pos = off; pos < off + len; ){
+      uint32_t lblk = pos / bsize;
+      if(!lookup_extent(ino, lblk, e)){
+        uint64_t hole_end = (uint64_t)(e.lblk + (uint64_t)e.len) * bsize;
+        pos = hole_end < off + len ? hole_end : off + len;
+        continue;
+      }
+      while(lblk < e.lblk + e.len && pos < off + len){
+        uint32_t boff = pos % bsize;
+        uint32_t n = MIN(bsize - boff, off + len - pos);
+        if(n == bsize){
+          uint32_t run = MIN(e.lblk + e.len - lblk, (off + len - pos) / bsize);
+          bm->read_blocks(e.pblk + lblk - e.lblk, run, &buf[pos - off]);
+          lblk += run;
+          pos += run * bsize;
+          continue;
+        }
+        bm->read_block(e.pblk + lblk - e.lblk, &block[0]);
+        memcpy(&buf[pos - off], &block[boff], n);
+        lblk++;
+        pos += n;
+      }
+    }
+  }
+  // delayed data is newer than any block under it
+  if(!c->delayed.empty()){
+    uint32_t start = c->delay_blk * bsize;
+    uint32_t from = off > start ? off : start;
+    if(from < off + len)
+      memcpy(&buf[from - off], &c->delayed[from - start], off + len - from);
+  }
+  release_inode(inum);
+}
+
+/* Write len bytes at offset off, growing the file if the range ends
+ * past it; a gap between the old end and off is left as a hole.
+ * Only the blocks covering the range are written and only unmapped
+ * ones among them allocated. A partially covered block is read first
+ * unless it was just allocated. A long write goes in pieces, one
+ * operation each, like xv6's filewrite: of piece_blocks at first,
+ * halved whenever one is cut short for want of log room, down to a
+ * block or a compressed cluster, and then given more room. Returns
+ * whether it was all written. */
+bool inode_manager::write_range(uint32_t inum, uint32_t off, const char *buf, uint32_t len)
+{
+  if(len > 0 && (off + len < off || (off + len - 1) / bsize >= MAXFILE(bm->sb))){
+    printf("\tim: file %d too large: %u bytes\n", inum, off + len);
+    return false;
+  }
+
+  uint32_t room = MAXOPBLOCKS;
+  uint32_t piece = piece_blocks(room);
+  inode_t* ino = get_inode(inum);
+  if(ino == NULL)
+    return false;
+  uint32_t unit = compressed(ino) ? zblocks : 1;
+  uint32_t old_size = visible_size(pinned(inum), bsize), start = off;
+  // a write that takes more than one operation would be left half done
+  // by a full disk, so it is refused up front if it could not fit: its
+  // blocks count as needed unless mapped already and not shared, and
+  // for a compressed file all of the clusters it touches, whose old
+  // blocks are only free again once the transaction commits, with
+  // room for the nodes of a map of one extent per block on top.
+  // Should it still run out, what it added past the old end is cut off
+  // again, so an append is left as it was; data it overwrote stays.
+  uint32_t first = off / bsize / unit * unit;
+  uint32_t end = len == 0 ? first : (off + len - 1) / bsize + 1;
+  if(end - first > piece){
+    uint32_t need = end - first;
+    std::vector<extent_t> exts;
+    std::vector<blockid_t> nodes;
+    load_extents(ino, exts, nodes);
+    for(size_t i = 0; i < exts.size() && !compressed(ino) && !bm->sharing(); i++){
+      uint32_t lo = MAX(exts[i].lblk, first), hi = MIN(exts[i].lblk + exts[i].len, end);
+      if(lo < hi)
+        need -= hi - lo;
+    }
+    need += need / EPB(bm->sb) + 1;
+    if(need > bm->free_blocks()){
+      printf("\tim: no space to grow file %d to %u bytes\n", inum,
+             off + len > old_size ? off + len : old_size);
+      release_inode(inum);
+      return false;
+    }
+  }
+  release_inode(inum);
+
+  do{
+    // pieces start on a block, or a cluster of a compressed file
+    uint32_t n = MIN((uint64_t)len, (uint64_t)piece * bsize - off % (unit * bsize));
+    if(write_piece(inum, off, buf, n, room)){
+      off += n;
+      buf += n;
+      len -= n;
+      continue;
+    }
+    if(!bm->op_short()){
+      // a full disk
+    } else if(piece > unit){
+      piece = MAX(piece / 2 / unit, 1) * unit;
+      continue;
+    } else if(room < LOGSIZE(bm->sb)){
+      room *= 2;
+      continue;
+    } else {
+      printf("\tim: write to file %d at %u does not fit in the log\n", inum, off);
+    }
+    if(off > start && off > old_size)
+      truncate(inum, old_size);
+    return false;
+  } while(len > 0);
+  return true;
+}
+
+// Write one piece of a write_range in an operation reserving room log
+// blocks. Returns false if the file is left as it was, for a full disk
+// or, when the operation is cut short, for want of log room.
+bool inode_manager::write_piece(uint32_t inum, uint32_t off, const char *buf, uint32_t len,
+                                uint32_t room)
+{
+  ScopedOp op(bm, room);
+  inode_t* ino = get_inode(inum);
+  std::vector<char> block(bsize);
+  extent_t e;
+
+  if(ino == NULL)
+    return false;
+  debug_log("write range inode: %d\toff: %d\tlen: %d\n", inum, off, len);
+  if(len == 0){
+    release_inode(inum);
+    return true;
+  }
+
+  uint32_t first = off / bsize, last = (off + len - 1) / bsize;
+
+  cached_inode *c = pinned(inum);
+  if(delay_write(c, off, buf, len)){
+    std::time_t t = std::time(0);
+    ino->atime = t;
+    ino->ctime = t;
+    ino->mtime = t;
+    put_inode(inum, ino);
+    release_inode(inum);
+    return true;
+  }
+  // delayed data it could not flush for want of log room stays
+  if(!c->delayed.empty()){
+    release_inode(inum);
+    return false;
+  }
+
+  uint32_t end = off + len > ino->size ? off + len : ino->size;
+  uint32_t eof = (ino->size + bsize - 1) / bsize;  // blocks holding data
+
+  // a small file stays in its inode as long as it fits
+  if(end <= INLINE_MAX && ((ino->flags & INODE_INLINE) ||
+        (inline_data && ino->eh.n == 0))){
+    if(!(ino->flags & INODE_INLINE)){
+      bzero(INLINE_DATA(ino), INLINE_MAX);
+      ino->flags |= INODE_INLINE;
+    }
+    memcpy(INLINE_DATA(ino) + off, buf, len);
+  } else if(compressed(ino)){
+    // on failure the data may still have moved out of the inode, and
+    // below blocks reserved past the end been given back, so the inode
+    // is written either way
+    if(((ino->flags & INODE_INLINE) && !uninline(inum, ino)) ||
+       !write_clusters(c, off, buf, len, end)){
+      if(!bm->op_short())
+        printf("\tim: no space to grow file %d to %u bytes\n", inum, end);
+      put_inode(inum, ino);
+      release_inode(inum);
+      return false;
+    }
+  } else {
+    if((ino->flags & INODE_INLINE) && !uninline(inum, ino)){
+      if(!bm->op_short())
+        printf("\tim: no space to grow file %d to %u bytes\n", inum, end);
+      put_inode(inum, ino);
+      release_inode(inum);
+      return false;
+    }
+
+    // a gap past the end must read as zero, so blocks reserved there
+    // are given back first
+    if(first > eof && (lookup_extent(ino, eof, e) || e.len != 0xffffffffU - eof)){
+      std::vector<extent_t> exts, cut;
+      std::vector<blockid_t> nodes;
+      load_extents(ino, exts, nodes);
+      free_extents(exts, eof, cut);
+      if(!store_extents(ino, exts, nodes, free_cost(cut) + 1)){
+        release_inode(inum);
+        return false;
+      }
+      free_runs(cut);
+      c->prealloc = false;
+    }
+
+    // bytes past the end and in holes read as zero, so a block that was
+    // not mapped, or only reserved past the end, only needs clearing
+    bool first_mapped = first < eof && lookup_extent(ino, first, e);
+    bool last_mapped = last < eof && lookup_extent(ino, last, e);
+    bool mapped = true;
+    for(uint32_t lblk = first; mapped && lblk <= last; lblk = e.lblk + e.len)
+      mapped = lookup_extent(ino, lblk, e);
+    // blocks shared with a clone get copies of their own to write to;
+    // both changes go in one map, stored before anything is written
+    if(!mapped || bm->sharing()){
+      std::vector<extent_t> exts, dropped;
+      std::vector<blockid_t> nodes;
+      load_extents(ino, exts, nodes);
+      std::vector<extent_t> before(exts);
+      // an append also reserves blocks past the new end
+      uint32_t extra = first <= eof && last >= eof ? prealloc_extra(last + 1) : 0;
+      if(!mapped && !alloc_extents(exts, first, last + 1 + extra, group_of(inum))){
+        extra = 0;
+        if(!alloc_extents(exts, first, last + 1, group_of(inum))){
+          if(!bm->op_short())
+            printf("\tim: no space to grow file %d to %u bytes\n", inum, end);
+          put_inode(inum, ino);
+          release_inode(inum);
+          return false;
+        }
+      }
+      if(!unshare_extents(exts, off, len, group_of(inum), dropped) ||
+         !store_extents(ino, exts, nodes, free_cost(dropped) + 1)){
+        free_added(before, exts);
+        if(!bm->op_short())
+          printf("\tim: no space to grow file %d to %u bytes\n", inum, end);
+        put_inode(inum, ino);
+        release_inode(inum);
+        return false;
+      }
+      free_runs(dropped);
+      c->prealloc = c->prealloc || extra > 0;
+    }
+
+    for(uint32_t pos = off; pos < off + len; ){
+      uint32_t lblk = pos / bsize;
+      VERIFY(lookup_extent(ino, lblk, e));
+      while(lblk < e.lblk + e.len && pos < off + len){
+        blockid_t id = e.pblk + lblk - e.lblk;
+        uint32_t boff = pos % bsize;
+        uint32_t n = MIN(bsize - boff, off + len - pos);
+        if(n == bsize){
+          uint32_t run = MIN(e.lblk + e.len - lblk, (off + len - pos) / bsize);
+          bm->write_blocks(id, run, buf + pos - off);
+          lblk += run;
+          pos += run * bsize;
+          continue;
+        }
+        if(lblk == first ? first_mapped : last_mapped)
+          bm->read_block(id, &block[0]);
+        else
+          bzero(&block[0], bsize);
+        memcpy(&block[boff], buf + pos - off, n);
+        bm->write_block(id, &block[0]);
+        lblk++;
+        pos += n;
+      }
+    }
+  }
+
+  c->grown = c->grown || end > ino->size;
+  ino->size = end;
+  std::time_t t = std::time(0);
+  ino->atime = t;
+  ino->ctime = t;
+  ino->mtime = t;
+  put_inode(inum, ino);
+  release_inode(inum);
+  return true;
+}
+
+// How many blocks to reserve past the end of a file growing to
+// nblocks: as many again as it holds, up to prealloc_blocks, so a file
+// that keeps growing takes a few long runs instead of one per write.
+// Nothing is reserved when it would take more than a sixteenth of the
+// free blocks.
+uint32_t inode_manager::prealloc_extra(uint32_t nblocks)
+{
+  uint32_t extra = MIN(nblocks, prealloc_blocks);
+
+  if(extra > bm->free_blocks() / 16)
+    return 0;
+  return MIN(extra, MAXFILE(bm->sb) - nblocks);
+}
+
+// Take a write into the delayed data of a file if it appends to it,
+// starting in its partly filled last block or past it, so that a run
+// of appends is given blocks, or written to the ones reserved for it,
+// in one go. The data is flushed once it fills
+// delalloc_blocks, or before a write that does not fit, which is then
+// refused unless it can start new delayed data. Returns whether the
+// write was taken; a flush the operation has no log room for leaves
+// the delayed data as it was. Called with the inode locked, inside an
+// operation.
+bool inode_manager::delay_write(cached_inode *c, uint32_t off, const char *buf, uint32_t len)
+{
+  inode_t *ino = &c->ino;
+  uint64_t max = (uint64_t)delalloc_blocks * bsize;
+  extent_t e;
+
+  if(!c->delayed.empty()){
+    uint32_t start = c->delay_blk * bsize;
+    if((off < start || off + len - start > max) && !flush_delayed(c) && !c->delayed.empty())
+      return false;
+  }
+  if(c->delayed.empty()){
+    uint32_t first = off / bsize;
+    uint32_t eof = (ino->size + bsize - 1) / bsize;
+    // a partly filled last block, or cluster of a compressed file, is
+    // taken in with what it holds, so appends smaller than that get
+    // delayed too
+    uint32_t unit = compressed(ino) ? zblocks : 1;
+    uint32_t tail = ino->size / (unit * bsize) * unit;
+    bool partial = first >= tail && first < eof;
+    if(partial)
+      first = tail;
+    if(delalloc_blocks == 0 || (ino->flags & INODE_INLINE) ||
+       (first < eof && !partial) || off + len - first * bsize > max)
+      return false;
+    // a gap must read as zero, so blocks reserved there rule it out;
+    // compressed files reserve none
+    if(first > eof && !compressed(ino) &&
+       (lookup_extent(ino, eof, e) || e.len != 0xffffffffU - eof))
+      return false;
+    c->delay_blk = first;
+    if(partial && compressed(ino)){
+      std::vector<extent_t> exts;
+      std::vector<blockid_t> nodes;
+      load_extents(ino, exts, nodes);
+      c->delayed.assign((size_t)zblocks * bsize, '\0');
+      read_cluster(exts, first / zblocks, &c->delayed[0]);
+      c->delayed.resize(ino->size - first * bsize);
+    } else if(partial){
+      c->delayed.assign(bsize, '\0');
+      if(lookup_extent(ino, first, e))
+        bm->read_block(e.pblk + first - e.lblk, &c->delayed[0]);
+      c->delayed.resize(ino->size % bsize);
+    }
+  }
+
+  uint32_t from = off - c->delay_blk * bsize;
+  if(c->delayed.size() < from + len)
+    c->delayed.resize(from + len, '\0');
+  memcpy(&c->delayed[from], buf, len);
+  c->grown = true;
+  if(c->delayed.size() == max)
+    flush_delayed(c);
+  return true;
+}
+
+// Give the delayed data of a file the blocks it lacks, in as few runs
+// as the free space allows and with more reserved past it, and write
+// it out.
+// The inode's size then takes it in. If the disk is full the data is
+// dropped and false returned; if the operation is cut short for want of
+// log room it is kept, for one with more. Called with the inode locked,
+// inside an operation.
+bool inode_manager::flush_delayed(cached_inode *c)
+{
+  inode_t *ino = &c->ino;
+  std::vector<extent_t> exts;
+  std::vector<blockid_t> nodes;
+  extent_t e;
+
+  if(c->delayed.empty())
+    return true;
+  uint32_t first = c->delay_blk;
+  uint32_t n = (c->delayed.size() + bsize - 1) / bsize;
+  uint32_t size = first * bsize + c->delayed.size();
+
+  if(compressed(ino)){
+    bool ok = write_clusters(c, first * bsize, c->delayed.data(), c->delayed.size(), size);
+    if(!ok && bm->op_short())
+      return false;
+    if(!ok)
+      printf("\tim: no space to grow file %d to %u bytes\n", c->inum, size);
+    std::string().swap(c->delayed);
+    if(ok)
+      ino->size = size;
+    ProfLock ml(&icache_m, LK_ICACHE);
+    mark_dirty(c);
+    return ok;
+  }
+
+  // blocks reserved earlier may already hold it all
+  bool mapped = true;
+  for(uint32_t lblk = first; mapped && lblk < first + n; lblk = e.lblk + e.len)
+    mapped = lookup_extent(ino, lblk, e);
+  // it fills whole blocks, so shared ones are swapped for new ones, in
+  // the same map
+  if(!mapped || bm->sharing()){
+    std::vector<extent_t> before, dropped;
+    uint32_t extra = mapped ? 0 : prealloc_extra(first + n);
+    load_extents(ino, exts, nodes);
+    before = exts;
+    if(!mapped && !alloc_extents(exts, first, first + n + extra, group_of(c->inum))){
+      extra = 0;
+      if(!alloc_extents(exts, first, first + n, group_of(c->inum))){
+        if(bm->op_short())
+          return false;
+        printf("\tim: no space to grow file %d to %u bytes\n", c->inum, size);
+        std::string().swap(c->delayed);
+        return false;
+      }
+    }
+    if(!unshare_extents(exts, first * bsize, n * bsize, group_of(c->inum), dropped) ||
+       !store_extents(ino, exts, nodes, free_cost(dropped) + 1)){
+      free_added(before, exts);
+      if(bm->op_short())
+        return false;
+      printf("\tim: no space to grow file %d to %u bytes\n", c->inum, size);
+      std::string().swap(c->delayed);
+      return false;
+    }
+    free_runs(dropped);
+    c->prealloc = c->prealloc || extra > 0;
+  }
+
+  // the last block is padded with zeros, as bytes past the end must be
+  c->delayed.resize((size_t)n * bsize, '\0');
+  for(uint32_t lblk = first; lblk < first + n; ){
+    VERIFY(lookup_extent(ino, lblk, e));
+    uint32_t run = MIN(e.lblk + e.len, first + n) - lblk;
+    bm->write_blocks(e.pblk + lblk - e.lblk, run, &c->delayed[(size_t)(lblk - first) * bsize]);
+    lblk += run;
+  }
+  std::string().swap(c->delayed);
+  ino->size = size;
+  ProfLock ml(&icache_m, LK_ICACHE);
+  mark_dirty(c);
+  return true;
+}
+
+// Give back the blocks reserved past the end of a file, unless that
+// needs more log room than the operation has left; they are then kept
+// for a later sync. Called with the inode locked, inside an operation.
+void inode_manager::trim_prealloc(cached_inode *c)
+{
+  inode_t *ino = &c->ino;
+  std::vector<extent_t> exts, cut;
+  std::vector<blockid_t> nodes;
+
+  if(ino->flags & INODE_INLINE){
+    c->prealloc = false;
+    return;
+  }
+  load_extents(ino, exts, nodes);
+  free_extents(exts, (ino->size + bsize - 1) / bsize, cut);
+  if(!store_extents(ino, exts, nodes, free_cost(cut) + 1))
+    return;
+  free_runs(cut);
+  c->prealloc = false;
+  ProfLock ml(&icache_m, LK_ICACHE);
+  mark_dirty(c);
+}
+
+/* Set the size of a file. Blocks past a smaller size are freed and the
+ * rest of the new last block cleared; a larger size just moves the end,
+ * leaving a hole that takes no space. Delayed data is flushed first, and
+ * blocks reserved past the end are given back. If a shrink needs space
+ * it cannot get, for a last block shared with a clone, the file is left
+ * as it was. A shrink that frees more than an operation can log goes
+ * down in steps, each its own operation, and an operation cut short is
+ * tried again with more room. Returns whether the file got the size. */
+bool inode_manager::truncate(uint32_t inum, uint32_t size)
+{
+  uint32_t room = MAXOPBLOCKS;
+  bool done = false;
+
+  while(!done){
+    if(truncate_step(inum, size, room, done))
+      continue;
+    if(!bm->op_short())
+      return false;
+    if(room >= LOGSIZE(bm->sb)){
+      printf("\tim: truncate of file %d to %u bytes does not fit in the log\n", inum, size);
+      return false;
+    }
+    room *= 2;
+  }
+  return true;
+}
+
+// One operation of a truncate, reserving room log blocks. If freeing
+// the blocks past size takes more of the log than half of that, only
+// those from as far down as it does not are freed, the file shrinking
+// to there at most, and done is left false. Returns false if the file
+// is left as it was.
+bool inode_manager::truncate_step(uint32_t inum, uint32_t size, uint32_t room, bool &done)
+{
+  ScopedOp op(bm, room);
+  inode_t* ino = get_inode(inum);
+  extent_t e;
+
+  if(ino == NULL)
+    return false;
+  cached_inode *c = pinned(inum);
+  if(!flush_delayed(c) && !c->delayed.empty()){
+    release_inode(inum);
+    return false;
+  }
+  debug_log("truncate inode: %d\tsize: %d\told size: %d\n", inum, size, ino->size);
+
+  if(ino->flags & INODE_INLINE){
+    if(size < ino->size)
+      bzero(INLINE_DATA(ino) + size, INLINE_MAX - size);
+    else if(size > INLINE_MAX && !uninline(inum, ino)){
+      if(!bm->op_short())
+        printf("\tim: no space to grow file %d to %u bytes\n", inum, size);
+      release_inode(inum);
+      return false;
+    }
+  } else {
+    uint32_t keep = MIN(size, ino->size);
+    std::vector<extent_t> exts, dropped;
+    std::vector<blockid_t> nodes;
+    uint32_t cbytes = zblocks * bsize;
+    load_extents(ino, exts, nodes);
+    std::vector<extent_t> before(exts);
+    uint32_t nb = keep == 0 ? 0 : ((keep - 1)/bsize + 1);
+    uint32_t limit = free_limit(exts, nb, bm->op_room() / 2);
+    // the last step may need space for the new end, as below; a
+    // truncate the disk has none for is refused before the first step
+    uint32_t tail = 0;
+    if(size < ino->size && compressed(ino) && size % cbytes != 0)
+      tail = zblocks + 1;
+    else if(size < ino->size && size % bsize != 0 && bm->sharing())
+      tail = 2;
+    if(limit > nb && tail > bm->free_blocks()){
+      printf("\tim: no space to truncate file %d to %u bytes\n", inum, size);
+      release_inode(inum);
+      return false;
+    }
+    if(limit > nb)
+      free_extents(exts, limit, dropped);
+    if(!dropped.empty()){
+      // only part of it fits: as much as does goes now
+      if(!store_extents(ino, exts, nodes, free_cost(dropped) + 1)){
+        release_inode(inum);
+        return false;
+      }
+      free_runs(dropped);
+      if(ino->size > limit * bsize)
+        ino->size = limit * bsize;
+      put_inode(inum, ino);
+      release_inode(inum);
+      return true;
+    }
+    free_extents(exts, nb, dropped);
+    // the cluster holding the new end is stored again without what
+    // lies past it, and the rest of the new last block is cleared
+    // below, in a copy of its own if a clone shares it. Either may need
+    // space; without it the file is left as it was, since what lies
+    // past the end would show again if the file grew.
+    bool ok = true;
+    if(compressed(ino) && size < ino->size && size % cbytes != 0){
+      std::vector<char> cluster(cbytes);
+      read_cluster(exts, size / cbytes, &cluster[0]);
+      bzero(&cluster[size % cbytes], cbytes - size % cbytes);
+      ok = write_cluster(exts, size / cbytes, &cluster[0], size % cbytes, group_of(inum),
+                         dropped);
+    }
+    bool clear = !compressed(ino) && size < ino->size && size % bsize != 0;
+    if(!ok || (clear && !unshare_extents(exts, size, 1, group_of(inum), dropped)) ||
+       !store_extents(ino, exts, nodes, free_cost(dropped) + 1)){
+      free_added(before, exts);
+      if(!bm->op_short())
+        printf("\tim: no space to truncate file %d to %u bytes\n", inum, size);
+      release_inode(inum);
+      return false;
+    }
+    free_runs(dropped);
+    c->prealloc = false;
+    if(clear && lookup_extent(ino, size / bsize, e)){
+      std::vector<char> block(bsize);
+      blockid_t id = e.pblk + size / bsize - e.lblk;
+      bm->read_block(id, &block[0]);
+      bzero(&block[size % bsize], bsize - size % bsize);
+      bm->write_block(id, &block[0]);
+    }
+  }
+
+  ino->size = size;
+  std::time_t t = std::time(0);
+  ino->ctime = t;
+  ino->mtime = t;
+  put_inode(inum, ino);
+  release_inode(inum);
+  done = true;
+  return true;
+}
+
+void inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
+{
+  /*
+   * your code goes here.
+   * note: get the attributes of inode inum.
+   * you can refer to "struct attr" in extent_protocol.h
+   */
+  inode_t* ino = get_inode(inum);
+  if(ino == NULL){
+    printf("[ERROR]invalid inode\n");
+    return;
+  }
+  a.type = ino->type;
+  a.atime = ino->atime;
+  a.mtime = ino->mtime;
+  a.ctime = ino->ctime;
+  a.size = visible_size(pinned(inum), bsize);
+  release_inode(inum);
+}
+
+// Count the extents inum's data is stored in; 0 for an inline or
+// empty file. Used by the benchmarks to measure fragmentation.
+uint32_t inode_manager::fragments(uint32_t inum)
+{
+  std::vector<extent_t> exts;
+  std::vector<blockid_t> nodes;
+
+  inode_t* ino = get_inode(inum);
+  if(ino == NULL)
+    return 0;
+  load_extents(ino, exts, nodes);
+  release_inode(inum);
+  return exts.size();
+}
+
+// The disk block holding block lblk of inum's data; 0 in a hole, an
+// inline file or a compressed cluster. Used by the benchmarks to damage
+// a file behind the file system's back.
+blockid_t inode_manager::block_of(uint32_t inum, uint32_t lblk)
+{
+  extent_t e;
+
+  inode_t* ino = get_inode(inum);
+  if(ino == NULL)
+    return 0;
+  blockid_t id = 0;
+  if(lookup_extent(ino, lblk, e) && !(e.len & EXT_ZIP))
+    id = e.pblk + lblk - e.lblk;
+  release_inode(inum);
+  return id;
+}
+
+// Turn compression of inum on or off. A file's blocks are stored one
+// way throughout, so a file can only change while it has none; a
+// directory always can. Returns whether inum ends up as asked.
+bool inode_manager::set_compressed(uint32_t inum, bool on)
+{
+  ScopedOp op(bm);
+  inode_t* ino = get_inode(inum);
+
+  if(ino == NULL)
+    return false;
+  if(ino->type != extent_protocol::T_FILE || (ino->flags & INODE_INLINE) || ino->eh.n == 0){
+    if(on)
+      ino->flags |= INODE_COMPRESS;
+    else
+      ino->flags &= ~INODE_COMPRESS;
+    put_inode(inum, ino);
+  }
+  bool now = (ino->flags & INODE_COMPRESS) != 0;
+  release_inode(inum);
+  return now == on;
+}
+
+// Make file dst a copy of file src that shares its blocks, copy on
+// write: dst's own blocks are freed and it takes src's block map up to
+// the end of the file, each block of which gets one more owner, so
+// only the map is written however large the file. Whichever file then
+// writes a shared block gets a copy of its own first. Inline data is
+// copied. Returns false unless both are regular files. If dst's blocks
+// and the new map do not fit in one operation's log room, it is tried
+// again with more, and with dst emptied first if even all of the log
+// is too little.
+bool inode_manager::clone(uint32_t src, uint32_t dst)
+{
+  if(src == dst)
+    return true;
+
+  bool emptied = false;
+  for(uint32_t room = MAXOPBLOCKS; ; ){
+    if(clone_map(src, dst, room))
+      return true;
+    if(!bm->op_short())
+      return false;
+    if(room < LOGSIZE(bm->sb)){
+      room *= 2;
+    } else if(!emptied){
+      truncate(dst, 0);
+      emptied = true;
+    } else {
+      printf("\tim: clone of file %d to %d does not fit in the log\n", src, dst);
+      return false;
+    }
+  }
+}
+
+// Make dst a clone of src in one operation reserving room log blocks.
+// Returns false if dst is left as it was.
+bool inode_manager::clone_map(uint32_t src, uint32_t dst, uint32_t room)
+{
+  ScopedOp op(bm, room);
+  // the two are locked in order of inum, as another clone may take them
+  uint32_t lo = MIN(src, dst), hi = MAX(src, dst);
+  inode_t *ilo = get_inode(lo);
+  if(ilo == NULL)
+    return false;
+  inode_t *ihi = get_inode(hi);
+  if(ihi == NULL){
+    release_inode(lo);
+    return false;
+  }
+  inode_t *s = src == lo ? ilo : ihi, *d = src == lo ? ihi : ilo;
+  if(s->type != extent_protocol::T_FILE || d->type != extent_protocol::T_FILE){
+    release_inode(hi);
+    release_inode(lo);
+    return false;
+  }
+  debug_log("clone inode: %d\tto: %d\tsize: %d\n", src, dst, s->size);
+
+  cached_inode *sc = pinned(src), *dc = pinned(dst);
+  if(!flush_delayed(sc) && !sc->delayed.empty()){
+    release_inode(hi);
+    release_inode(lo);
+    return false;
+  }
+  std::string().swap(dc->delayed);
+
+  std::vector<extent_t> exts, old, cut;
+  std::vector<blockid_t> nodes, old_nodes;
+  load_extents(d, old, old_nodes);
+  free_extents(old, 0, cut);
+  // blocks reserved past the end stay the source's
+  uint32_t eof = (s->size + bsize - 1) / bsize;
+  load_extents(s, exts, nodes);
+  while(!exts.empty() && exts.back().lblk >= eof)
+    exts.pop_back();
+  if(!exts.empty() && !(exts.back().len & EXT_ZIP) && exts.back().lblk + exts.back().len > eof)
+    exts.back().len = eof - exts.back().lblk;
+  // with no room for the map's nodes, dst is left as it was
+  if(!store_extents(d, exts, old_nodes, free_cost(cut) + 1)){
+    if(!bm->op_short())
+      printf("\tim: no space to clone file %d to %d\n", src, dst);
+    release_inode(hi);
+    release_inode(lo);
+    return false;
+  }
+  for(size_t i = 0; i < exts.size(); i++)
+    bm->share(exts[i].pblk, EXT_BLOCKS(exts[i], bsize));
+  free_runs(cut);
+  dc->prealloc = false;
+
+  d->flags = (d->flags & ~INODE_COMPRESS) | (s->flags & INODE_COMPRESS);
+  if(s->flags & INODE_INLINE){
+    d->flags |= INODE_INLINE;
+    memcpy(INLINE_DATA(d), INLINE_DATA(s), INLINE_MAX);
+  }
+  d->size = s->size;
+  std::time_t t = std::time(0);
+  d->ctime = t;
+  d->mtime = t;
+  put_inode(dst, d);
+  release_inode(hi);
+  release_inode(lo);
+  return true;
+}
+
+// Report the size of the file system and how much of it is free, from
+// counters the bitmaps keep as bits change. Blocks freed by the running
+// transaction count as free only once it commits.
+void inode_manager::statfs(extent_protocol::fsstat &st)
+{
+  st.block_size = bsize;
+  st.blocks = bm->sb.nblocks;
+  st.free_blocks = bm->free_blocks();
+  st.inodes = bm->sb.ninodes;
+  st.free_inodes = inode_map.free_count();
+}
+
+void inode_manager::remove_file(uint32_t inum)
+{
+  /*
+   * your code goes here
+   * note: you need to consider about both the data block and inode of the file
+   */
+  // a file whose blocks do not all fit in one operation's log room
+  // is emptied first, in as many as that takes
+  if(!remove_whole(inum) && bm->op_short()){
+    truncate(inum, 0);
+    remove_whole(inum);
+  }
+}
+
+// Free a file's blocks and its inode in one operation. Returns false
+// if it is left as it was.
+bool inode_manager::remove_whole(uint32_t inum)
+{
+  ScopedOp op(bm);
+  inode_t* ino = get_inode(inum);
+  if(ino == NULL){
+    printf("invalid inode number\n");
+    return false;
+  }
+  debug_log("remove file inode: %d\tsize: %d\n", inum, ino->size);
+
+  std::vector<extent_t> exts, cut;
+  std::vector<blockid_t> nodes;
+  load_extents(ino, exts, nodes);
+  free_extents(exts, 0, cut);
+  // the inode's bitmap block is written too
+  if(!store_extents(ino, exts, nodes, free_cost(cut) + 2)){
+    release_inode(inum);
+    return false;
+  }
+  free_runs(cut);
+  //free inode
+  clear_inode(inum);
+  release_inode(inum);
+  return true;
+}
+
+// extent tree -----------------------------------------
+
+// Find the extent holding file block lblk, reading one node per level.
+// If the block is in a hole, return false with e spanning the hole up
+// to the next mapped block, and pblk 0.
+bool inode_manager::lookup_extent(struct inode *ino, uint32_t lblk, extent_t &e)
+{
+  std::vector<char> buf(bsize);
+  extent_header_t *eh = &ino->eh;
+  extent_t *ents = ino->root;
+  uint32_t next = 0xffffffffU;  // first mapped block past this subtree
+
+  if(ino->flags & INODE_INLINE){
+    e.lblk = lblk;
+    e.pblk = 0;
+    e.len = next - lblk;
+    return false;
+  }
+  for(;;){
+    int i = eh->n - 1;
+    while(i >= 0 && ents[i].lblk > lblk)
+      i--;
+    if(i + 1 < eh->n)
+      next = ents[i + 1].lblk;
+    if(i < 0 || (eh->depth == 0 && lblk >= ents[i].lblk + ents[i].len)){
+      e.lblk = lblk;
+      e.pblk = 0;
+      e.len = next - lblk;
+      return false;
+    }
+    if(eh->depth == 0){
+      e = ents[i];
+      return true;
+    }
+    bm->read_block(ents[i].pblk, &buf[0]);
+    eh = (extent_header_t*)&buf[0];
+    ents = (extent_t*)&buf[sizeof(extent_header_t)];
+  }
+}
+
+// Read the whole block map into exts, and the node blocks of the tree
+// into nodes level by level from the root down. An inline file has an
+// empty map.
+void inode_manager::load_extents(struct inode *ino, std::vector<extent_t> &exts,
+                                 std::vector<blockid_t> &nodes)
+{
+  if(ino->flags & INODE_INLINE)
+    return;
+  std::vector<char> buf(bsize);
+  extent_header_t *eh = (extent_header_t*)&buf[0];
+  extent_t *ents = (extent_t*)&buf[sizeof(extent_header_t)];
+  std::vector<extent_t> level(ino->root, ino->root + ino->eh.n);
+
+  for(int depth = ino->eh.depth; depth > 0; depth--){
+    std::vector<extent_t> below;
+    for(size_t i = 0; i < level.size(); i++){
+      nodes.push_back(level[i].pblk);
+      bm->read_block(level[i].pblk, &buf[0]);
+      below.insert(below.end(), ents, ents + eh->n);
+    }
+    level.swap(below);
+  }
+  exts.swap(level);
+}
+
+// Write exts back as a tree packed bottom-up: full leaves of EPB(sb)
+// extents, then full interior levels until the root fits in the inode.
+// Each level reuses the node blocks in nodes that held it, in the order
+// load_extents returned them, and a node is only written if its
+// contents changed, so appending to or cutting the end off a file
+// rewrites just the last leaf and the nodes above it. Surplus nodes
+// are freed, and nodes is left listing the new tree's from the root
+// down. The map takes the place of any inline data. If the disk has no
+// room for new nodes, or the operation no log room for the nodes
+// written and freed with after blocks still left for what it does next,
+// ino and nodes are left as they were and false returned.
+bool inode_manager::store_extents(struct inode *ino, const std::vector<extent_t> &exts,
+                                  std::vector<blockid_t> &nodes, uint32_t after)
+{
+  std::vector<uint32_t> level_nodes;  // node count per level, leaves first
+  uint32_t epb = EPB(bm->sb);
+  uint32_t total = 0;
+
+  for(uint32_t n = exts.size(); n > NROOT; n = (n + epb - 1) / epb){
+    level_nodes.push_back((n + epb - 1) / epb);
+    total += level_nodes.back();
+  }
+
+  // sort the loaded nodes by the level they held, from their headers
+  std::vector<char> old((size_t)nodes.size() * bsize);
+  std::vector<std::vector<uint32_t> > held(level_nodes.size());
+  std::vector<uint32_t> spare;
+  for(uint32_t k = 0; k < nodes.size(); k++){
+    bm->read_block(nodes[k], &old[(size_t)k * bsize]);
+    uint16_t depth = ((extent_header_t*)&old[(size_t)k * bsize])->depth;
+    if(depth < held.size() && held[depth].size() < level_nodes[depth])
+      held[depth].push_back(k);
+    else
+      spare.push_back(k);
+  }
+  // the other levels' leftovers fill out levels that grew, and new index
+  // blocks go in the group of the file's last blocks
+  uint32_t group = exts.empty() ? AG_ANY : bm->group_of(exts.back().pblk);
+  std::vector<std::vector<blockid_t> > ids(level_nodes.size());
+  std::vector<blockid_t> added;
+  std::vector<int> from;  // the loaded node each of ids reuses, or -1
+  for(uint16_t depth = 0; depth < level_nodes.size(); depth++){
+    for(uint32_t j = 0; j < level_nodes[depth]; j++){
+      int k = -1;
+      if(j < held[depth].size()){
+        k = held[depth][j];
+      } else if(!spare.empty()){
+        k = spare.back();
+        spare.pop_back();
+      }
+      blockid_t id = k >= 0 ? nodes[k] : bm->alloc_block(group);
+      if(id == 0){
+        for(size_t a = 0; a < added.size(); a++)
+          bm->free_block(added[a], true);
+        return false;
+      }
+      if(k < 0)
+        added.push_back(id);
+      ids[depth].push_back(id);
+      from.push_back(k);
+    }
+  }
+
+  // build the levels in the order ids were handed out, leaves first
+  std::vector<char> tree((size_t)total * bsize);
+  std::vector<extent_t> level(exts);
+  uint32_t pos = 0;
+  for(uint16_t depth = 0; depth < level_nodes.size(); depth++){
+    std::vector<extent_t> above;
+    for(uint32_t j = 0; j < level_nodes[depth]; j++, pos++){
+      uint32_t k = j * epb;
+      char *buf = &tree[(size_t)pos * bsize];
+      extent_header_t *eh = (extent_header_t*)buf;
+      eh->n = MIN(epb, level.size() - k);
+      eh->depth = depth;
+      memcpy(buf + sizeof(extent_header_t), &level[k], eh->n * sizeof(extent_t));
+      extent_t up = { level[k].lblk, ids[depth][j], 0 };
+      above.push_back(up);
+    }
+    level.swap(above);
+  }
+
+  std::vector<bool> changed(total, true);
+  uint32_t cost = after;
+  pos = 0;
+  for(uint16_t depth = 0; depth < level_nodes.size(); depth++){
+    for(uint32_t j = 0; j < level_nodes[depth]; j++, pos++){
+      if(from[pos] >= 0)
+        changed[pos] = memcmp(&tree[(size_t)pos * bsize],
+                              &old[(size_t)from[pos] * bsize], bsize) != 0;
+      cost += changed[pos];
+    }
+  }
+  for(size_t k = 0; k < spare.size(); k++)
+    cost += bm->free_cost(nodes[spare[k]], 1);
+  if(!bm->log_room(cost)){
+    for(size_t a = 0; a < added.size(); a++)
+      bm->free_block(added[a], true);
+    return false;
+  }
+
+  pos = 0;
+  for(uint16_t depth = 0; depth < level_nodes.size(); depth++){
+    for(uint32_t j = 0; j < level_nodes[depth]; j++, pos++){
+      if(changed[pos])
+        bm->log_write(ids[depth][j], &tree[(size_t)pos * bsize]);
+    }
+  }
+  for(size_t k = 0; k < spare.size(); k++)
+    bm->free_block(nodes[spare[k]]);
+  nodes.clear();
+  for(size_t depth = ids.size(); depth-- > 0; )
+    nodes.insert(nodes.end(), ids[depth].begin(), ids[depth].end());
+  if(ino->flags & INODE_INLINE){
+    ino->flags &= ~INODE_INLINE;
+    bzero(INLINE_DATA(ino), INLINE_MAX);
+  }
+
+  bzero(ino->root, sizeof(ino->root));
+  ino->eh.n = level.size();
+  ino->eh.depth = level_nodes.size();
+  memcpy(ino->root, level.data(), level.size() * sizeof(extent_t));
+  return true;
+}
+
+// Move the data of an inline file out to a block of its own so the
+// block map can take its place. Returns false if the disk is full.
+bool inode_manager::uninline(uint32_t inum, struct inode *ino)
+{
+  std::vector<char> block(bsize);
+  std::vector<extent_t> exts;
+  std::vector<blockid_t> nodes;
+
+  if(ino->size > 0){
+    memcpy(&block[0], INLINE_DATA(ino), INLINE_MAX);
+    if(!alloc_extents(exts, 0, 1, group_of(inum)))
+      return false;
+    bm->write_block(exts[0].pblk, &block[0]);
+  }
+  if(!store_extents(ino, exts, nodes)){
+    if(!exts.empty())
+      bm->free_run(exts[0].pblk, exts[0].len, true);
+    return false;
+  }
+  return true;
+}
+
+// Whether ino's data is stored in compressed clusters.
+bool inode_manager::compressed(const struct inode *ino) const
+{
+  return (ino->flags & INODE_COMPRESS) && ino->type == extent_protocol::T_FILE;
+}
+
+static bool extent_before(const extent_t &e, uint32_t lblk)
+{
+  return e.lblk < lblk;
+}
+
+static bool extent_after(uint32_t lblk, const extent_t &e)
+{
+  return lblk < e.lblk;
+}
+
+// Read cluster cl of a compressed file, whose block map is exts, into
+// buf, which holds a whole cluster.
+void inode_manager::read_cluster(const std::vector<extent_t> &exts, uint32_t cl, char *buf)
+{
+  uint32_t first = cl * zblocks, cbytes = zblocks * bsize;
+  std::vector<extent_t>::const_iterator it;
+
+  bzero(buf, cbytes);
+  it = std::lower_bound(exts.begin(), exts.end(), first, extent_before);
+  for(; it != exts.end() && it->lblk < first + zblocks; ++it){
+    if(!(it->len & EXT_ZIP)){
+      bm->read_blocks(it->pblk, MIN(it->len, first + zblocks - it->lblk),
+                      buf + (size_t)(it->lblk - first) * bsize);
+      continue;
+    }
+    std::vector<char> z((size_t)EXT_BLOCKS(*it, bsize) * bsize);
+    bm->read_blocks(it->pblk, EXT_BLOCKS(*it, bsize), &z[0]);
+    size_t n = lz_decompress(&z[0], it->len & ~EXT_ZIP, buf, cbytes);
+    if(n == (size_t)-1){
+      printf("\tim: bad compressed cluster in block %u\n", it->pblk);
+      n = 0;
+    }
+    bzero(buf + n, cbytes - n);
+  }
+}
+
+// Store cluster cl of a compressed file from buf, which holds a whole
+// cluster with data in its first n bytes and zeros after, in place of
+// what exts maps there: compressed if that saves a block, otherwise in
+// plain blocks, and not at all if it is all zeros. New blocks go after
+// those of the cluster before, so a file written in order stays in
+// order. What the cluster held before is added to dropped, for the
+// caller to free once the new map is stored. If the disk is full, exts
+// is left as it was and false returned.
+bool inode_manager::write_cluster(std::vector<extent_t> &exts, uint32_t cl, const char *buf,
+                                  uint32_t n, uint32_t group, std::vector<extent_t> &dropped)
+{
+  uint32_t first = cl * zblocks, cbytes = zblocks * bsize;
+  std::vector<extent_t> added;
+  std::vector<char> z;
+  uint32_t zlen = 0, len;
+  blockid_t goal = 0;
+
+  std::vector<extent_t>::iterator lo, hi;
+  lo = std::lower_bound(exts.begin(), exts.end(), first, extent_before);
+  hi = std::lower_bound(lo, exts.end(), first + zblocks, extent_before);
+  if(lo != exts.begin())
+    goal = (lo - 1)->pblk + EXT_BLOCKS(*(lo - 1), bsize);
+
+  while(n > 0 && buf[n - 1] == 0)
+    n--;
+  if(n > 0){
+    z.resize(cbytes);
+    zlen = lz_compress(buf, n, &z[0], cbytes - bsize);
+  }
+  if(zlen > 0){
+    uint32_t nb = (zlen + bsize - 1) / bsize;
+    blockid_t p = bm->alloc_run(goal, group, nb, len);
+    if(len == nb){
+      bzero(&z[zlen], (size_t)nb * bsize - zlen);
+      bm->write_blocks(p, nb, &z[0]);
+      extent_t e = { first, p, EXT_ZIP | zlen };
+      added.push_back(e);
+    } else {
+      // no free run that long; plain blocks can be split up
+      if(len > 0)
+        bm->free_run(p, len, true);
+      zlen = 0;
+    }
+  }
+  for(uint32_t b = 0, nb = (n + bsize - 1) / bsize; zlen == 0 && b < nb; b += len){
+    blockid_t p = bm->alloc_run(goal, group, nb - b, len);
+    if(len == 0){
+      for(size_t k = 0; k < added.size(); k++)
+        bm->free_run(added[k].pblk, added[k].len, true);
+      return false;
+    }
+    bm->write_blocks(p, len, buf + (size_t)b * bsize);
+    extent_t e = { first + b, p, len };
+    added.push_back(e);
+    goal = p + len;
+  }
+
+  dropped.insert(dropped.end(), lo, hi);
+  lo = exts.erase(lo, hi);
+  exts.insert(lo, added.begin(), added.end());
+  return true;
+}
+
+// Write len bytes at off to a compressed file that ends at end once
+// they are written, a cluster at a time, taking in what a cluster held
+// around them; clusters past the end are dropped. If the disk fills up
+// or the operation runs out of log room, the file's map is left as it
+// was and false returned. Called with the inode locked, inside an
+// operation.
+bool inode_manager::write_clusters(cached_inode *c, uint32_t off, const char *buf,
+                                   uint32_t len, uint32_t end)
+{
+  inode_t *ino = &c->ino;
+  uint32_t cbytes = zblocks * bsize;
+  std::vector<extent_t> exts;
+  std::vector<blockid_t> nodes;
+  std::vector<char> cluster(cbytes);
+  bool ok = true;
+
+  load_extents(ino, exts, nodes);
+  std::vector<extent_t> before(exts), dropped;
+  for(uint32_t pos = off; pos < off + len; ){
+    uint32_t cl = pos / cbytes, start = cl * cbytes;
+    uint32_t n = MIN(start + cbytes, off + len) - pos;
+    if(n < cbytes && start < ino->size)
+      read_cluster(exts, cl, &cluster[0]);
+    else
+      bzero(&cluster[0], cbytes);
+    memcpy(&cluster[pos - start], buf + pos - off, n);
+    if(!write_cluster(exts, cl, &cluster[0], MIN(cbytes, end - start), group_of(c->inum),
+                      dropped)){
+      ok = false;
+      break;
+    }
+    pos += n;
+  }
+  if(ok)
+    free_extents(exts, ((uint64_t)end + cbytes - 1) / cbytes * zblocks, dropped);
+  if(!ok || !store_extents(ino, exts, nodes, free_cost(dropped) + 1)){
+    free_added(before, exts);
+    return false;
+  }
+  free_runs(dropped);
+  return true;
+}
+
+// Map the unmapped file blocks in [from, to) to new disk blocks, a
+// contiguous run at a time. A run is placed where it would continue
+// the extent before it, so a file filled in order stays contiguous,
+// and neighbouring extents are merged. Runs that continue nothing go
+// in group. If the disk fills up, the new blocks are freed and exts is
+// left as it was.
+bool inode_manager::alloc_extents(std::vector<extent_t> &exts, uint32_t from, uint32_t to,
+                                  uint32_t group)
+{
+  std::vector<extent_t> added;
+  size_t i = 0;
+
+  for(uint32_t pos = from; pos < to; ){
+    while(i < exts.size() && exts[i].lblk + exts[i].len <= pos)
+      i++;
+    if(i < exts.size() && exts[i].lblk <= pos){
+      pos = exts[i].lblk + exts[i].len;
+      continue;
+    }
+    uint32_t end = i < exts.size() ? MIN(to, exts[i].lblk) : to;
+    while(pos < end){
+      blockid_t goal = 0;
+      uint32_t len;
+      if(!added.empty() && added.back().lblk + added.back().len == pos)
+        goal = added.back().pblk + added.back().len;
+      else if(i > 0)
+        goal = exts[i - 1].pblk + (pos - exts[i - 1].lblk);
+
+      blockid_t start = bm->alloc_run(goal, group, end - pos, len);
+      if(len == 0){
+        for(size_t k = 0; k < added.size(); k++)
+          bm->free_run(added[k].pblk, added[k].len, true);
+        return false;
+      }
+      extent_t *last = added.empty() ? NULL : &added.back();
+      if(last && last->lblk + last->len == pos && last->pblk + last->len == start){
+        last->len += len;
+      } else {
+        extent_t e = { pos, start, len };
+        added.push_back(e);
+      }
+      pos += len;
+    }
+  }
+
+  // merge the new extents in, coalescing runs that line up
+  std::vector<extent_t> merged;
+  size_t a = 0, b = 0;
+  while(a < exts.size() || b < added.size()){
+    bool take_old = b == added.size() || (a < exts.size() && exts[a].lblk < added[b].lblk);
+    extent_t e = take_old ? exts[a++] : added[b++];
+    if(!merged.empty()){
+      extent_t &m = merged.back();
+      if(m.lblk + m.len == e.lblk && m.pblk + m.len == e.pblk){
+        m.len += e.len;
+        continue;
+      }
+    }
+    merged.push_back(e);
+  }
+  exts.swap(merged);
+  return true;
+}
+
+// Give the file blocks of its own wherever exts maps the bytes
+// [off, off + len) to blocks shared with a clone, so that writing there
+// leaves the clone as it was, and drop its share of those. Only a first
+// or last block the range covers in part has its contents copied; the
+// rest are about to be overwritten. Compressed clusters are never
+// written in place, so they stay shared. The shared runs given up are
+// added to dropped, for the caller to free once the new map is stored.
+// If the disk is full, exts is left as it was and false returned.
+bool inode_manager::unshare_extents(std::vector<extent_t> &exts, uint32_t off, uint32_t len,
+                                    uint32_t group, std::vector<extent_t> &dropped)
+{
+  if(len == 0 || !bm->sharing())
+    return true;
+
+  uint32_t first = off / bsize, end = (off + len - 1) / bsize + 1;
+  bool copy_first = off % bsize != 0, copy_last = (off + len) % bsize != 0;
+  std::vector<extent_t> out, added, gone;
+  std::vector<char> block(bsize);
+
+  for(size_t i = 0; i < exts.size(); i++){
+    extent_t e = exts[i];
+    if((e.len & EXT_ZIP) || e.lblk + e.len <= first || e.lblk >= end){
+      out.push_back(e);
+      continue;
+    }
+    for(uint32_t lblk = e.lblk; lblk < e.lblk + e.len; ){
+      blockid_t p = e.pblk + lblk - e.lblk;
+      uint32_t n = e.lblk + e.len - lblk;
+      bool shared = false;
+      if(lblk < first)
+        n = MIN(n, first - lblk);
+      else if(lblk < end)
+        n = bm->shared_run(p, MIN(n, end - lblk), shared);
+      extent_t piece = { lblk, p, n };
+      if(!shared){
+        out.push_back(piece);
+        lblk += n;
+        continue;
+      }
+      gone.push_back(piece);
+      for(uint32_t done = 0, got; done < n; done += got){
+        blockid_t q = bm->alloc_run(p + done, group, n - done, got);
+        if(got == 0){
+          for(size_t k = 0; k < added.size(); k++)
+            bm->free_run(added[k].pblk, added[k].len, true);
+          return false;
+        }
+        for(uint32_t b = 0; b < got; b++){
+          uint32_t l = lblk + done + b;
+          if((l == first && copy_first) || (l == end - 1 && copy_last)){
+            bm->read_block(p + done + b, &block[0]);
+            bm->write_block(q + b, &block[0]);
+          }
+        }
+        extent_t copy = { lblk + done, q, got };
+        added.push_back(copy);
+        out.push_back(copy);
+      }
+      lblk += n;
+    }
+  }
+  if(gone.empty())
+    return true;
+
+  dropped.insert(dropped.end(), gone.begin(), gone.end());
+  // pieces of one extent that still line up are joined again
+  exts.clear();
+  for(size_t i = 0; i < out.size(); i++){
+    if(!exts.empty()){
+      extent_t &m = exts.back();
+      if(!(m.len & EXT_ZIP) && !(out[i].len & EXT_ZIP) &&
+         m.lblk + m.len == out[i].lblk && m.pblk + m.len == out[i].pblk){
+        m.len += out[i].len;
+        continue;
+      }
+    }
+    exts.push_back(out[i]);
+  }
+  return true;
+}
+
+// Unmap every file block from nblocks on, adding the runs unmapped to
+// cut, for the caller to free once the new map is stored. A compressed
+// cluster is unmapped only as a whole, when it starts at nblocks or
+// past.
+void inode_manager::free_extents(std::vector<extent_t> &exts, uint32_t nblocks,
+                                 std::vector<extent_t> &cut)
+{
+  while(!exts.empty()){
+    extent_t &e = exts.back();
+    if(e.lblk >= nblocks){
+      cut.push_back(e);
+      exts.pop_back();
+      continue;
+    }
+    if(!(e.len & EXT_ZIP) && e.lblk + e.len > nblocks){
+      uint32_t keep = nblocks - e.lblk;
+      extent_t tail = { nblocks, e.pblk + keep, e.len - keep };
+      cut.push_back(tail);
+      e.len = keep;
+    }
+    break;
+  }
+}
+
+// The lowest file block from nblocks on that the blocks of exts can be
+// freed from while adding at most room blocks to the log; nblocks if
+// all of those free_extents would unmap fit. A compressed cluster goes
+// whole or not at all; a plain run may be split where it crosses into
+// another bitmap block.
+uint32_t inode_manager::free_limit(const std::vector<extent_t> &exts, uint32_t nblocks,
+                                   uint32_t room)
+{
+  uint32_t limit = 0xffffffffU;
+
+  for(size_t i = exts.size(); i-- > 0; ){
+    const extent_t &e = exts[i];
+    if(e.len & EXT_ZIP){
+      if(e.lblk < nblocks)
+        break;
+      uint32_t cost = bm->free_cost(e.pblk, EXT_BLOCKS(e, bsize));
+      if(cost > room)
+        return MIN(limit, e.lblk + zblocks);
+      room -= cost;
+      limit = e.lblk;
+      continue;
+    }
+    if(e.lblk + e.len <= nblocks)
+      break;
+    uint32_t from = e.lblk > nblocks ? e.lblk : nblocks;
+    blockid_t lo = e.pblk + from - e.lblk, hi = e.pblk + e.len;
+    uint32_t cost = bm->free_cost(lo, hi - lo);
+    if(cost > room){
+      // the lowest block whose run to the end still fits
+      blockid_t fits = hi;
+      while(lo < fits){
+        blockid_t mid = lo + (fits - lo) / 2;
+        if(bm->free_cost(mid, hi - mid) <= room)
+          fits = mid;
+        else
+          lo = mid + 1;
+      }
+      return MIN(limit, e.lblk + (fits - e.pblk));
+    }
+    room -= cost;
+    limit = from;
+  }
+  return nblocks;
+}
+
+// How many blocks freeing runs adds to the log, counted run by run.
+uint32_t inode_manager::free_cost(const std::vector<extent_t> &runs)
+{
+  uint32_t n = 0;
+
+  for(size_t k = 0; k < runs.size(); k++)
+    n += bm->free_cost(runs[k].pblk, EXT_BLOCKS(runs[k], bsize));
+  return n;
+}
+
+// How many file blocks a write takes on in one operation reserving room
+// log blocks: as many as a quarter of that in bitmap blocks covers, so
+// that a piece this large is only cut short on a fragmented disk.
+uint32_t inode_manager::piece_blocks(uint32_t room)
+{
+  uint64_t n = (uint64_t)(room / 4 > 0 ? room / 4 : 1) * BPB(bm->sb);
+
+  return MIN(n, (uint64_t)MAXFILE(bm->sb));
+}
+
+// Free the disk blocks of runs, plain or compressed.
+void inode_manager::free_runs(const std::vector<extent_t> &runs)
+{
+  for(size_t k = 0; k < runs.size(); k++)
+    bm->free_run(runs[k].pblk, EXT_BLOCKS(runs[k], bsize));
+}
+
+// Free the disk blocks exts maps that before did not: those a change
+// to a block map allocated, when the map could not be stored. They are
+// fresh, so the space is not lost until the transaction commits.
+void inode_manager::free_added(const std::vector<extent_t> &before,
+                               const std::vector<extent_t> &exts)
+{
+  for(size_t i = 0; i < exts.size(); i++){
+    const extent_t &e = exts[i];
+    std::vector<extent_t>::const_iterator it =
+        std::upper_bound(before.begin(), before.end(), e.lblk, extent_after);
+    if(e.len & EXT_ZIP){
+      if(it == before.begin() || (it - 1)->lblk != e.lblk ||
+         (it - 1)->pblk != e.pblk || (it - 1)->len != e.len)
+        bm->free_run(e.pblk, EXT_BLOCKS(e, bsize), true);
+      continue;
+    }
+    // a new run may have been merged onto an old one either side
+    blockid_t run = 0;
+    uint32_t n = 0;
+    for(uint32_t l = e.lblk; l < e.lblk + e.len; l++){
+      blockid_t p = e.pblk + l - e.lblk;
+      while(it != before.end() && it->lblk <= l)
+        ++it;
+      bool old = false;
+      if(it != before.begin()){
+        const extent_t &b = *(it - 1);
+        old = !(b.len & EXT_ZIP) && l < b.lblk + b.len && b.pblk + l - b.lblk == p;
+      }
+      if(!old && n > 0 && run + n == p){
+        n++;
+        continue;
+      }
+      if(n > 0)
+        bm->free_run(run, n, true);
+      run = p;
+      n = old ? 0 : 1;
+    }
+    if(n > 0)
+      bm->free_run(run, n, true);
+  }
+}
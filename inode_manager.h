@@ -4,98 +4,693 @@
 #define inode_h
 
 #include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "extent_protocol.h" // TODO: delete it
 
+// Default geometry. A file system records its own in the superblock
+// when it is formatted.
 #define DISK_SIZE  1024*1024*16
 #define BLOCK_SIZE 512
-#define BLOCK_NUM  (DISK_SIZE/BLOCK_SIZE)
+#define INODE_NUM  1024
+
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
 
 typedef uint32_t blockid_t;
 
+// How the file system is backed. With an empty image the disk is an
+// in-memory array of size bytes that is lost on exit; otherwise the
+// image file is mapped and reused across restarts. A size of 0 takes
+// the size of an existing image. cache_blocks bounds the block cache
+// and inode_cache the number of unpinned inodes kept in memory; 0 turns
+// either off. block_size (a power of two from MIN_BLOCK_SIZE to
+// MAX_BLOCK_SIZE), inodes and journal, which reserves a metadata log,
+// are used when the disk is formatted; an existing file system keeps
+// whatever it was made with, as do checksums, which keeps a CRC32C of
+// every block to check blocks read back from the disk, and
+// log_structured, which writes every block to the end of a log instead
+// of in place (see LFS_SEG_BYTES). dedup, on a log-structured disk,
+// points blocks with the same contents at one copy; it can be turned
+// on and off at each mount. inline_data
+// keeps files of up to INLINE_MAX bytes in their inode; files already
+// inline stay readable with it off. compress compresses the data of
+// every file created from then on (see INODE_COMPRESS).
+struct fs_options {
+  std::string image;
+  uint64_t size;
+  uint32_t cache_blocks;
+  uint32_t inode_cache;
+  uint32_t block_size;
+  uint32_t inodes;
+  bool journal;
+  bool checksums;
+  bool log_structured;
+  bool dedup;
+  bool inline_data;  // keep small files in their inode
+  bool compress;     // compress new files
+  uint32_t groups;   // most allocation groups, 0 for as many as fit
+  uint32_t delalloc_blocks;  // appended blocks held before allocating, 0 for none
+  uint32_t prealloc_blocks;  // most blocks reserved past a growing file's end
+
+  fs_options() : size(DISK_SIZE), cache_blocks(1024), inode_cache(1024),
+                 block_size(BLOCK_SIZE), inodes(INODE_NUM), journal(true),
+                 checksums(false), log_structured(false), dedup(false),
+                 inline_data(true), compress(false), groups(0),
+                 delalloc_blocks(64), prealloc_blocks(256) {}
+};
+
 // disk layer -----------------------------------------
 
 class disk {
  private:
-  unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
+  unsigned char *blocks;
+  uint64_t bytes;
+  uint32_t bsize;
+  uint32_t nblocks;
+  int fd;                   // image file, -1 for an in-memory disk
+  size_t page_size;
+  std::vector<bool> dirty;  // pages of the image written since last sync
+  pthread_mutex_t dirty_m;  // guards dirty
+
+  void map_image(const char *image, uint64_t size);
 
  public:
   disk();
-  void read_block(uint32_t id, char *buf);
-  void write_block(uint32_t id, const char *buf);
+  disk(const fs_options &opts);
+  ~disk();
+  uint32_t size() const { return nblocks; }
+  void set_block_size(uint32_t bsize);
+  void read_at(uint64_t off, char *buf, size_t len);
+  void write_at(uint64_t off, const char *buf, size_t len);
+  void read_block(uint32_t id, char *buf) { read_at((uint64_t)id * bsize, buf, bsize); }
+  void write_block(uint32_t id, const char *buf) { write_at((uint64_t)id * bsize, buf, bsize); }
+  void read_blocks(uint32_t id, uint32_t n, char *buf) { read_at((uint64_t)id * bsize, buf, (size_t)n * bsize); }
+  void write_blocks(uint32_t id, uint32_t n, const char *buf) { write_at((uint64_t)id * bsize, buf, (size_t)n * bsize); }
+  void sync();
 };
 
 // block layer -----------------------------------------
 
+#define FS_MAGIC 0x43484653  // "CHFS"
+
+// The superblock lives at byte SB_OFFSET whatever the block size, so it
+// can be read before the block size is known: in block 1 of a disk
+// with 512-byte blocks, in block 0 otherwise. Blocks 0 and 1 are never
+// allocated.
+#define SB_OFFSET 512
+
 typedef struct superblock {
-  uint32_t size;
+  uint32_t magic;
   uint32_t nblocks;
+  uint64_t size;
   uint32_t ninodes;
+  uint32_t log_start;  // first block of the journal
+  uint32_t log_size;   // blocks in the journal, 0 for none
+  uint32_t block_size; // 0 on disks formatted before it was recorded
+  uint32_t free_blocks; // as of the last sync; counted at mount
+  uint32_t free_inodes;
+  uint32_t csum_start;  // first block of the checksum table
+  uint32_t csum_blocks; // blocks in the table, 0 for none
+  uint32_t csum_dirty;  // table stale on disk since the last sync
+  uint32_t seg_blocks;  // blocks per log segment, 0 for writes in place
+  uint32_t map_start;   // first block of the block map
+  uint32_t map_blocks;  // blocks in the block map
+  uint32_t map_limit;   // blocks below this go through the map
+  uint32_t shared;      // clones may share blocks; owners are counted at mount
 } superblock_t;
 
+// The journal sits at the end of the disk: a header block naming the
+// home of each logged block, followed by the logged copies in order.
+// A header with n > 0 is a committed transaction not yet installed.
+#define LOGSIZE(sb) ((sb).log_size - 1)
+
+// The checksum table sits just before the journal: the CRC32C of each
+// block, or 0, which is not checked, for a block not written since the
+// disk was formatted. It covers every block from BBLOCK(0) up to the
+// table; the superblock is rewritten in place and the journal has its
+// own commit protocol. The table is kept in memory and written back at
+// sync. csum_dirty is set on disk when a block changes after a sync,
+// so a mount that finds it set cannot trust the table and computes it
+// again.
+#define CSUM_PER_BLOCK(sb) ((sb).block_size / sizeof(uint32_t))
+
+// Log-structured layout. The blocks the file system addresses, from
+// BBLOCK(0) up to sb.map_limit, are logical: every write of one goes
+// to the next free slot of the head segment, wherever its last copy
+// was, and the block map, just before the checksum table, says where
+// each one's latest copy lives. A block not written yet is mapped
+// nowhere and reads as zeros. The segments fill the disk from
+// BBLOCK(0) up to the map; the blocks from map_limit up to the map are
+// marked in use and never touched, so live blocks leave at least
+// 100 - LFS_FILL percent of the segments for the cleaner to gather.
+// The map is written back at each checkpoint, after every journal
+// commit and sync; a segment is reused only when no copy in it is
+// mapped, neither in memory nor by the map on disk, so a crash goes
+// back to the last checkpoint.
+//
+// With dedup a written block whose contents a live slot already holds
+// is mapped to that slot instead of taking a new one, so a slot may
+// hold the copy of several blocks and lives until none points at it.
+// Slots are found by the CRC32C of their contents and compared byte
+// for byte before they are shared. The map on disk needs no change:
+// sharing is worked out again from it at mount.
+#define LFS_SEG_BYTES (128 * 1024)
+#define LFS_MIN_SEG   16  // blocks per segment, for large blocks
+#define LFS_RESERVE   2   // segments only the cleaner may take
+#define LFS_BATCH     16  // segments the cleaner thread frees per turn
+#define LFS_FILL      80
+#define MAP_PER_BLOCK(sb) ((sb).block_size / sizeof(blockid_t))
+
+// Log blocks an operation reserves in the running transaction, unless
+// it asks for more. One that would need more is split up, or retried
+// with a larger reservation.
+#define MAXOPBLOCKS 16
+
+typedef struct log_header {
+  uint32_t n;
+  blockid_t block[];  // LOGSIZE entries
+} log_header_t;
+
+class block_manager;
+
+// Allocation groups. The disk is split into up to AG_MAX groups of at
+// least AG_MIN_BLOCKS blocks, and the inodes into as many ranges. An
+// inode is allocated in its parent directory's group and its blocks in
+// the inode's group, so a directory's files stay close together and
+// writers in different directories use different parts of the bitmaps.
+// Groups are a placement policy only; the layout on disk is unchanged.
+#define AG_MAX 16
+#define AG_MIN_BLOCKS 1024
+#define AG_ANY 0xffffffffU  // no preferred group
+
+// A free bitmap of nbits bits stored in the blocks following start.
+// The in-memory copy is laid out word for word like those blocks and
+// every change is written through, so it persists with the disk.
+//
+// The bitmap is split into allocation groups of whole words, each with
+// its own lock, scan hint and count of clear bits. An allocation starts
+// in the group it prefers and moves on to the following ones when that
+// is full; without a preference it starts in the group after the
+// previous such allocation's. Runs are allocated within one group.
+// Groups may share a bitmap block, so bits are changed and their block
+// logged under that block's lock as well.
+class bitmap {
+ private:
+  struct group {
+    pthread_mutex_t m;            // guards the group's words and hint
+    uint32_t first, end;          // words covered
+    uint32_t hint;                // word where the next scan starts
+    std::atomic<uint32_t> nfree;  // clear bits
+  };
+
+  block_manager *bm;
+  std::vector<uint64_t> words;
+  group *groups;
+  uint32_t ngroups;
+  uint32_t nwords;  // words holding bits, split evenly between the groups
+  std::vector<pthread_mutex_t> block_m;  // one per bitmap block
+  uint32_t nbits;
+  uint32_t wpb;  // words per bitmap block
+  blockid_t start;
+  std::atomic<uint32_t> next;  // group where the next scan without a preference starts
+  std::atomic<uint32_t> nfree;  // clear bits in all groups
+
+  bool isset(uint32_t b) const { return words[b / 64] & (1ULL << (b % 64)); }
+  uint32_t find_run(group &g, uint32_t n, uint32_t &len);
+  void change(uint32_t bit, uint32_t len, bool used, bool lock);
+
+ public:
+  bitmap() : bm(NULL), groups(NULL), ngroups(0), nwords(0), nbits(0),
+             wpb(0), start(0), next(0), nfree(0) {}
+  ~bitmap() { delete[] groups; }
+  void load(block_manager *bm, blockid_t start, uint32_t nbits, uint32_t ngroups);
+  uint32_t group_count() const { return ngroups; }
+  uint32_t group_of(uint32_t bit) const {
+    return ((uint64_t)(bit / 64 + 1) * ngroups - 1) / nwords;
+  }
+  uint32_t group_free(uint32_t g) const { return groups[g].nfree; }
+  uint32_t free_count() const { return nfree; }
+  bool test(uint32_t bit);
+  uint32_t alloc(uint32_t group);  // returns nbits when full
+  uint32_t alloc_run(uint32_t goal, uint32_t group, uint32_t n, uint32_t &len);
+  void set(uint32_t bit, bool used);
+  void set_run(uint32_t bit, uint32_t len, bool used);
+  void mark(uint32_t bit, uint32_t len, bool used);  // without locking
+};
+
+// Block I/O counters, reported by the benchmarks. reads and writes
+// count block_manager calls, disk_reads and disk_writes the blocks that
+// actually moved to or from the disk. They change under cache_m, but
+// commits and logged under log_m. allocs counts alloc_block and
+// alloc_run calls, which run in parallel. csum_errors counts blocks
+// read from the disk that did not match their checksum. seeks counts
+// disk writes that did not start where the one before ended, cleaned
+// the segments the log cleaner emptied and moved the blocks it copied.
+// deduped counts block writes that found their contents already on
+// the disk and wrote nothing.
+struct io_stats {
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t disk_reads;
+  uint64_t disk_writes;
+  uint64_t commits;     // journal transactions committed
+  uint64_t logged;      // blocks written to the journal
+  std::atomic<uint64_t> allocs;
+  uint64_t csum_errors;
+  uint64_t seeks;
+  uint64_t cleaned;
+  uint64_t moved;
+  uint64_t deduped;
+
+  io_stats() : reads(0), writes(0), hits(0), misses(0),
+               disk_reads(0), disk_writes(0), commits(0), logged(0),
+               allocs(0), csum_errors(0), seeks(0), cleaned(0), moved(0),
+               deduped(0) {}
+};
+
+// Lock profiling: how long locks of each kind were waited for and
+// held, in total, while it is on. The extent server bench reads it to
+// show where concurrent handlers queue. A lock that one handler at a
+// time holds for most of a run serializes the handlers; time spent
+// waiting on a condition under a lock, such as for room in the
+// journal, counts as waiting for it. claim is the extent server's hold
+// on one extent for one request.
+enum { LK_INODE, LK_ICACHE, LK_LOG, LK_CACHE, LK_BITMAP, LK_LEASE, LK_CLAIM, NLOCKS };
+extern const char *lock_names[NLOCKS];
+
+struct lock_stats {
+  uint64_t acquires[NLOCKS];
+  uint64_t contended[NLOCKS];  // found the lock taken
+  uint64_t wait_ns[NLOCKS];
+  uint64_t hold_ns[NLOCKS];
+};
+
+void lock_profiling(bool on);
+void get_lock_stats(lock_stats &s);
+uint64_t lock_clock();
+void lock_account(int kind, bool contended, uint64_t wait_ns);
+void lock_held(int kind, uint64_t since);
+uint64_t lock_acquire(pthread_mutex_t *m, int kind);
+void lock_release(pthread_mutex_t *m, int kind, uint64_t since);
+uint64_t lock_wait(pthread_cond_t *c, pthread_mutex_t *m, int kind, int wait_kind,
+                   uint64_t since, const struct timespec *until = NULL);
+
+// A ScopedLock whose waits and holds count for kind.
+class ProfLock {
+ private:
+  pthread_mutex_t *m_;
+  int kind_;
+  uint64_t since_;
+ public:
+  ProfLock(pthread_mutex_t *m, int kind)
+    : m_(m), kind_(kind), since_(lock_acquire(m, kind)) {}
+  ~ProfLock() { lock_release(m_, kind_, since_); }
+  // Wait on c, counting the time as a wait for wait_kind, no later
+  // than until by c's clock, if given.
+  void wait(pthread_cond_t *c, int wait_kind, const struct timespec *until = NULL) {
+    since_ = lock_wait(c, m_, kind_, wait_kind, since_, until);
+  }
+};
+
+struct cached_block {
+  blockid_t id;
+  bool dirty;
+  std::vector<char> data;
+};
+
 class block_manager {
  private:
   disk *d;
-  std::map <uint32_t, int> using_blocks;
+  bitmap free_map;
+
+  // Write-back LRU cache of up to cache_size blocks. The list runs
+  // from the most to the least recently used block.
+  uint32_t cache_size;
+  std::list<cached_block> lru;
+  std::unordered_map<blockid_t, std::list<cached_block>::iterator> cached;
+  pthread_mutex_t cache_m;
+
+  // Checksum of each block, and which table blocks changed since the
+  // last sync; empty without checksums. Guarded by cache_m, as every
+  // block reaches the disk through disk_read and disk_write under it.
+  std::vector<uint32_t> csums;
+  std::vector<bool> csum_changed;
+  bool csum_clean;  // sb.csum_dirty is clear on disk
+
+  // Log-structured layout, empty with writes in place. lmap gives the
+  // slot of each logical block's latest copy, 0 for none, and rmap a
+  // block living in each slot, 0 for none, with the others sharing it
+  // in sharers. Guarded by cache_m too.
+  std::vector<blockid_t> lmap;
+  std::vector<blockid_t> rmap;
+  std::vector<uint32_t> refs;      // blocks mapped to each slot
+  std::unordered_map<blockid_t, std::unordered_set<blockid_t> > sharers;
+  std::vector<bool> map_changed;   // map blocks changed since the last checkpoint
+  std::vector<uint32_t> seg_live;  // live slots in each segment
+  std::vector<bool> seg_free;
+  std::vector<uint32_t> free_segs;
+  uint32_t nsegs;
+  uint32_t head;       // segment being filled
+  uint32_t head_off;   // its next free slot
+  bool cleaning;
+  blockid_t last_write;  // where the last disk write ended
+
+  // Cleaner thread, started at mount on a log-structured disk. It
+  // sleeps on clean_c until sync or advance_head find few free
+  // segments, then frees LFS_BATCH segments at a time, letting go of
+  // cache_m between turns, until an eighth are free again. advance_head
+  // still cleans in the foreground when only the reserve is left.
+  pthread_t cleaner;
+  pthread_cond_t clean_c;  // under cache_m
+  bool cleaner_running;
+  bool cleaner_stop;
+  static void *cleaner_main(void *arg);
+  void run_cleaner();
+  bool clean_wanted() const;
+
+  // Dedup index: the live slot holding each CRC32C seen, and the CRC32C
+  // of each slot. A slot whose contents collide with another's keeps
+  // its hash but is not indexed. Empty without dedup; under cache_m.
+  bool dedup;
+  std::vector<uint32_t> slot_hash;
+  std::unordered_map<uint32_t, blockid_t> dedup_index;
+  std::vector<char> dedup_buf;
+
+  // Running journal transaction. Blocks passed to log_write stay here,
+  // not in the cache, so their home copies are untouched until commit.
+  // Operations join the transaction between begin_op and end_op, each
+  // reserving the log blocks it may add, bitmap blocks its frees will
+  // write at commit included; it commits when it is too full to admit
+  // another one, or on sync. free_bmap holds the bitmap blocks pending
+  // frees touch that are not logged yet, and reserved what operations
+  // in progress may still add.
+  pthread_mutex_t log_m;
+  pthread_cond_t log_c;
+  int outstanding;  // operations in progress
+  uint32_t reserved;
+  std::vector<blockid_t> log_ids;
+  std::vector<char> log_data;
+  std::unordered_map<blockid_t, uint32_t> log_index;
+  std::vector<std::pair<blockid_t, uint32_t> > pending_free;  // applied at commit
+  std::unordered_set<blockid_t> free_bmap;
+  uint32_t pending_blocks;
+
+  void format(const fs_options &opts);
+  void recover();
+  bool log_full(uint32_t nblocks);
+  void charge_op();
+  void commit();
+  cached_block *cache_get(blockid_t id, bool fill);
+  void cache_add(blockid_t id, const char *buf);
+  void write_cached(uint32_t id, const char *buf);
+  char *in_memory(blockid_t id, bool &logged);
+  void load_csums();
+  void disk_read(blockid_t id, uint32_t n, char *buf);
+  void disk_write(blockid_t id, uint32_t n, const char *buf);
+  void load_map();
+  bool mapped(blockid_t id) const;
+  blockid_t seg_first(uint32_t seg) const;
+  uint32_t seg_of(blockid_t slot) const;
+  void phys_read(blockid_t id, uint32_t n, char *buf);
+  void phys_write(blockid_t id, uint32_t n, const char *buf);
+  void write_slots(blockid_t slot, uint32_t n, const char *buf);
+  blockid_t find_copy(uint32_t hash, const char *data, blockid_t run,
+                      uint32_t run_len, const char *run_buf);
+  void ref(blockid_t id, blockid_t slot);
+  void unref(blockid_t id);
+  void move_slot(blockid_t slot, char *buf);
+  void advance_head();
+  void trim(blockid_t id, uint32_t len);
+  void checkpoint();
+  void clean(uint32_t want);
+  void csums_stale();
+
+  // Extra owners of the blocks that clones share, beyond the first,
+  // and how many blocks have any. Freeing a shared block drops an
+  // owner instead, when the free would have taken effect. The counts
+  // are kept in memory only: the first clone sets sb.shared, and while
+  // it is set the inode layer counts them again at mount from the
+  // block maps. Under share_m, which is taken last.
+  std::unordered_map<blockid_t, uint32_t> shares;
+  std::atomic<uint32_t> nshared;
+  pthread_mutex_t share_m;
+  void drop_owners(std::vector<std::pair<blockid_t, uint32_t> > &runs);
  public:
   block_manager();
+  block_manager(const fs_options &opts);
+  ~block_manager();
   struct superblock sb;
+  struct io_stats stats;
 
-  uint32_t alloc_block();
-  void free_block(uint32_t id);
+  uint32_t alloc_block(uint32_t group = AG_ANY);
+  void free_block(uint32_t id, bool fresh = false);
+  blockid_t alloc_run(blockid_t goal, uint32_t group, uint32_t n, uint32_t &len);
+  void free_run(blockid_t id, uint32_t len, bool fresh = false);
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(blockid_t id, uint32_t n, char *buf);
+  void write_blocks(blockid_t id, uint32_t n, const char *buf);
+  void flush();
+  void sync(uint32_t free_inodes);
+
+  bool journaling() const { return sb.log_size != 0; }
+  bool checksumming() const { return sb.csum_blocks != 0; }
+  bool log_structured() const { return sb.seg_blocks != 0; }
+  uint32_t free_blocks() const { return free_map.free_count(); }
+  void map_usage(uint32_t &blocks, uint32_t &slots);
+  void share(blockid_t id, uint32_t len);
+  uint32_t shared_run(blockid_t id, uint32_t len, bool &shared);
+  bool sharing() const { return nshared != 0; }
+  uint32_t group_count() const { return free_map.group_count(); }
+  uint32_t group_of(blockid_t id) const { return free_map.group_of(id); }
+  uint32_t group_free(uint32_t g) const { return free_map.group_free(g); }
+  void begin_op(uint32_t nblocks = MAXOPBLOCKS);
+  void end_op();
+  void log_write(uint32_t id, const char *buf);
+  uint32_t op_room() const;
+  bool log_room(uint32_t n);
+  bool op_short() const;
+  uint32_t free_cost(blockid_t id, uint32_t len);
 };
 
 // inode layer -----------------------------------------
 
-#define INODE_NUM  1024
+// The layout follows from the geometry in superblock sb.
 
 // Inodes per block.
-#define IPB           1
-//(BLOCK_SIZE / sizeof(struct inode))
+#define IPB(sb)           ((sb).block_size / sizeof(struct inode))
 
 // Block containing inode i
-#define IBLOCK(i, nblocks)     ((nblocks)/BPB + (i)/IPB + 3)
+#define IBLOCK(i, sb)     ((sb).nblocks/BPB(sb) + (sb).ninodes/BPB(sb) + (i)/IPB(sb) + 4)
 // 找到inode number = i的inode所在的Block
 
+// Block containing the free bit for inode i
+#define IMBLOCK(i, sb)    ((sb).nblocks/BPB(sb) + (i)/BPB(sb) + 3)
+
 // Bitmap bits per block
-#define BPB           (BLOCK_SIZE*8)
+#define BPB(sb)           ((sb).block_size*8)
 // 一个block有多少bit，也就是一个block作bitmap的话能表示多少个block的free情况
 
 // Block containing bit for block b
-#define BBLOCK(b) ((b)/BPB + 2)
+#define BBLOCK(b, sb) ((b)/BPB(sb) + 2)
+
+// Bitmap words per block
+#define WPB(sb)           ((sb).block_size/sizeof(uint64_t))
+
+// A file's blocks are mapped by extents, runs of contiguous disk
+// blocks sorted by file block. Up to NROOT entries live in the inode;
+// a larger map becomes a tree of node blocks, each an extent_header
+// followed by up to EPB entries. Entries of interior nodes (depth > 0)
+// use lblk for the first file block below them and pblk for the child.
+typedef struct extent {
+  uint32_t lblk;    // first file block
+  blockid_t pblk;   // first disk block
+  uint32_t len;     // number of blocks
+} extent_t;
+
+typedef struct extent_header {
+  uint16_t n;       // entries in use
+  uint16_t depth;   // 0 when the entries are extents
+} extent_header_t;
+
+#define NROOT 3
+#define EPB(sb) (((sb).block_size - sizeof(extent_header_t)) / sizeof(extent_t))
+#define MAXFILE(sb) (0xffffffffU / (sb).block_size)
+
+// A file of up to INLINE_MAX bytes, such as a symlink, is kept in the
+// inode itself when INODE_INLINE is set: its data takes the place of
+// the block map, from eh to the end of the inode.
+#define INODE_INLINE 0x1
+#define INLINE_MAX (sizeof(extent_header_t) + NROOT * sizeof(extent_t) + sizeof(uint32_t))
+#define INLINE_DATA(ino) ((char *)&(ino)->eh)
 
-#define NDIRECT 100
-#define NINDIRECT (BLOCK_SIZE / sizeof(uint)) //二级block
-#define MAXFILE (NDIRECT + NINDIRECT)
+// The data of a regular file with INODE_COMPRESS set is stored in
+// clusters of ZCLUSTER_BYTES, or ZCLUSTER_MIN blocks if that is more,
+// each compressed on its own if that saves at least a block. A
+// compressed cluster is one block map entry at the cluster's first
+// file block, whose len has EXT_ZIP set and gives the compressed
+// length in bytes; the data takes as many blocks as that needs, and
+// the cluster reads as zeros past what it decompresses to. Other
+// clusters are mapped by plain extents that never cross into the next
+// one. Files and directories created in a directory with the flag get
+// it too; it does nothing else to a directory.
+#define INODE_COMPRESS 0x2
+#define ZCLUSTER_BYTES (64 * 1024)
+#define ZCLUSTER_MIN   4
+#define EXT_ZIP 0x80000000U
+#define EXT_BLOCKS(e, bs) ((e).len & EXT_ZIP ? \
+    (((e).len & ~EXT_ZIP) + (bs) - 1) / (bs) : (e).len)
 
 typedef struct inode {
   short type;
+  uint16_t flags;
   unsigned int size;
   unsigned int atime;
   unsigned int mtime;
   unsigned int ctime;
-  blockid_t blocks[NDIRECT+1];   // Data block addresses
+  extent_header_t eh;
+  extent_t root[NROOT];   // Root of the block map
+  uint32_t reserved;
 } inode_t;
 
+// Inode cache counters, reported by the benchmarks.
+struct inode_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t allocs;      // cache entries allocated
+  uint64_t writebacks;  // dirty inodes written to their block
+
+  inode_stats() : hits(0), misses(0), allocs(0), writebacks(0) {}
+};
+
+// An inode held in memory. ref counts the callers that have it pinned;
+// each of them holds or waits for m, which serializes operations on
+// the inode.
+//
+// Data appended to a file is held in delayed, which covers the file
+// from block delay_blk on, and only given blocks when it is flushed;
+// until then ino.size is the end of the data on disk.
+// prealloc is set once blocks are reserved past the end of the file,
+// and grown whenever the file grows, so that sync can give back the
+// reservations of files that stopped growing. These are the holder's;
+// held notes whether there were either when the inode was last
+// unlocked, under icache_m, and such an inode stays in the cache.
+struct cached_inode {
+  uint32_t inum;
+  int ref;
+  bool dirty;
+  bool held;
+  pthread_mutex_t m;
+  inode_t ino;
+  uint32_t delay_blk;
+  std::string delayed;
+  bool prealloc;
+  bool grown;
+  uint64_t locked_at;  // for lock profiling
+};
+
 class inode_manager {
  private:
   block_manager *bm;
+  bitmap inode_map;
+  uint32_t bsize;
+  bool inline_data;
+  bool compress;
+  uint32_t zblocks;  // blocks per compressed cluster
+  uint32_t delalloc_blocks;
+  uint32_t prealloc_blocks;
+  std::atomic<uint32_t> dir_group;  // where the search for a new directory's group starts
+
+  // Inode cache. Pinned inodes always stay, as do ones with delayed
+  // data or reserved blocks; others are evicted least recently used
+  // first once there are more than icache_size.
+  // icache_m guards the cache and its counters and orders the updates
+  // of inode blocks; the contents of an inode are its holder's.
+  uint32_t icache_size;
+  std::list<cached_inode> ilru;
+  std::unordered_map<uint32_t, std::list<cached_inode>::iterator> icache;
+  pthread_mutex_t icache_m;
+  struct inode_stats istats;
+
+  cached_inode *icache_get(uint32_t inum, bool fill);
+  cached_inode *lock_inode(uint32_t inum, bool fill);
+  void unlock_inode(cached_inode *c);
+  void icache_trim();
+  void write_inode(cached_inode *c);
+  void mark_dirty(cached_inode *c);
+  void clear_inode(uint32_t inum);
   struct inode* get_inode(uint32_t inum);
   void put_inode(uint32_t inum, struct inode *ino);
-  blockid_t get_nth_blockid(struct inode *ino, uint32_t nth);
-  void free_nth_block(struct inode *ino, uint32_t nth);
-  void write_nth_block(struct inode *ino, uint32_t nth, std::string &);
-  void alloc_nth_block(struct inode *ino, uint32_t nth, std::string &buf, bool to_write);
-  void read_nth_block(struct inode *ino, uint32_t nth, char* buf);
+  void release_inode(uint32_t inum);
+  cached_inode *pinned(uint32_t inum);
+  bool lookup_extent(struct inode *ino, uint32_t lblk, extent_t &e);
+  void load_extents(struct inode *ino, std::vector<extent_t> &exts,
+                    std::vector<blockid_t> &nodes);
+  bool store_extents(struct inode *ino, const std::vector<extent_t> &exts,
+                     std::vector<blockid_t> &nodes, uint32_t after = 1);
+  bool alloc_extents(std::vector<extent_t> &exts, uint32_t from, uint32_t to,
+                     uint32_t group);
+  void free_extents(std::vector<extent_t> &exts, uint32_t nblocks,
+                    std::vector<extent_t> &cut);
+  uint32_t free_limit(const std::vector<extent_t> &exts, uint32_t nblocks, uint32_t room);
+  uint32_t free_cost(const std::vector<extent_t> &runs);
+  void free_runs(const std::vector<extent_t> &runs);
+  void free_added(const std::vector<extent_t> &before, const std::vector<extent_t> &exts);
+  bool unshare_extents(std::vector<extent_t> &exts, uint32_t off, uint32_t len,
+                       uint32_t group, std::vector<extent_t> &dropped);
+  bool uninline(uint32_t inum, struct inode *ino);
+  bool compressed(const struct inode *ino) const;
+  void read_cluster(const std::vector<extent_t> &exts, uint32_t cl, char *buf);
+  bool write_cluster(std::vector<extent_t> &exts, uint32_t cl, const char *buf,
+                     uint32_t n, uint32_t group, std::vector<extent_t> &dropped);
+  bool write_clusters(cached_inode *c, uint32_t off, const char *buf, uint32_t len,
+                      uint32_t end);
+  uint32_t group_of(uint32_t inum);
+  uint32_t prealloc_extra(uint32_t nblocks);
+  bool delay_write(cached_inode *c, uint32_t off, const char *buf, uint32_t len);
+  bool flush_delayed(cached_inode *c);
+  void trim_prealloc(cached_inode *c);
+  uint32_t piece_blocks(uint32_t room);
+  bool write_whole(uint32_t inum, const char *buf, int size);
+  bool write_piece(uint32_t inum, uint32_t off, const char *buf, uint32_t len,
+                   uint32_t room);
+  bool truncate_step(uint32_t inum, uint32_t size, uint32_t room, bool &done);
+  bool clone_map(uint32_t src, uint32_t dst, uint32_t room);
+  bool remove_whole(uint32_t inum);
+  void mount();
+  void count_shares();
  public:
   inode_manager();
-  uint32_t alloc_inode(uint32_t type);
+  inode_manager(const fs_options &opts);
+  ~inode_manager();
+  uint32_t alloc_inode(uint32_t type, uint32_t parent = 0);
   void free_inode(uint32_t inum);
   void read_file(uint32_t inum, char **buf, int *size);
   void write_file(uint32_t inum, const char *buf, int size);
+  void read_range(uint32_t inum, uint32_t off, uint32_t len, std::string &buf);
+  bool write_range(uint32_t inum, uint32_t off, const char *buf, uint32_t len);
+  bool truncate(uint32_t inum, uint32_t size);
   void remove_file(uint32_t inum);
   void getattr(uint32_t inum, extent_protocol::attr &a);
+  uint32_t fragments(uint32_t inum);
+  blockid_t block_of(uint32_t inum, uint32_t lblk);
+  bool set_compressed(uint32_t inum, bool on);
+  bool clone(uint32_t src, uint32_t dst);
+  void statfs(extent_protocol::fsstat &st);
+  void sync();
+  const superblock_t &super() const { return bm->sb; }
+  uint32_t alloc_groups() const { return bm->group_count(); }
+  void map_usage(uint32_t &blocks, uint32_t &slots) { bm->map_usage(blocks, slots); }
+  const struct io_stats &stats() const { return bm->stats; }
+  const struct inode_stats &inode_cache_stats() const { return istats; }
 };
 
 #endif
@@ -0,0 +1,181 @@
+// LZ compression of file data. Built with optimization even in debug
+// builds (see GNUmakefile), as it runs over every block of a
+// compressed file.
+//
+// A sequence is a token byte, the high nibble counting its literals
+// and the low one its copy's length less LZ_MIN_MATCH, each 15 meaning
+// more follows in bytes of 255 and a last one below that; then the
+// literals, then the copy's distance back in two bytes, little-endian,
+// and the rest of its length. The last sequence has no copy, and ends
+// the data.
+
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS  12
+#define LZ_SKIP_BITS  6   // misses before the scan speeds up
+
+static inline uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t hash4(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Append the rest of a length that did not fit in its nibble.
+static inline bool put_len(uint8_t *&op, uint8_t *oend, size_t len)
+{
+  for (; len >= 255; len -= 255) {
+    if (op == oend)
+      return false;
+    *op++ = 255;
+  }
+  if (op == oend)
+    return false;
+  *op++ = len;
+  return true;
+}
+
+// Append a sequence of nlit literals from lit and, if len is not 0, a
+// copy of len bytes from off back.
+static bool put_seq(uint8_t *&op, uint8_t *oend, const uint8_t *lit, size_t nlit,
+                    size_t off, size_t len)
+{
+  size_t mlen = len ? len - LZ_MIN_MATCH : 0;
+
+  if (op == oend)
+    return false;
+  *op++ = (nlit < 15 ? nlit : 15) << 4 | (mlen < 15 ? mlen : 15);
+  if (nlit >= 15 && !put_len(op, oend, nlit - 15))
+    return false;
+  if ((size_t)(oend - op) < nlit)
+    return false;
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (len == 0)
+    return true;
+  if (oend - op < 2)
+    return false;
+  *op++ = off & 0xff;
+  *op++ = off >> 8;
+  return mlen < 15 || put_len(op, oend, mlen - 15);
+}
+
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap)
+{
+  const uint8_t *in = (const uint8_t *)src, *end = in + n;
+  const uint8_t *ip = in, *anchor = in;
+  uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+  uint32_t table[1 << LZ_HASH_BITS];
+  uint32_t misses = 0;
+
+  memset(table, 0, sizeof(table));
+  while (n >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+    uint32_t v = read32(ip), h = hash4(v);
+    const uint8_t *ref = in + table[h];
+    table[h] = ip - in;
+    if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != v) {
+      // incompressible data is skipped through faster and faster
+      ip += 1 + (misses++ >> LZ_SKIP_BITS);
+      continue;
+    }
+    const uint8_t *m = ip + LZ_MIN_MATCH, *r = ref + LZ_MIN_MATCH;
+    uint64_t x = 0, y = 0;
+    while (m + 8 <= end) {
+      memcpy(&x, m, 8);
+      memcpy(&y, r, 8);
+      if (x != y)
+        break;
+      m += 8;
+      r += 8;
+    }
+    if (x != y) {
+      m += __builtin_ctzll(x ^ y) / 8;  // little-endian
+    } else {
+      while (m < end && *m == *r) {
+        m++;
+        r++;
+      }
+    }
+    if (!put_seq(op, oend, anchor, ip - anchor, ip - ref, m - ip))
+      return 0;
+    ip = anchor = m;
+    misses = 0;
+  }
+  if (!put_seq(op, oend, anchor, end - anchor, 0, 0))
+    return 0;
+  return op - (uint8_t *)dst;
+}
+
+// Read the rest of a length whose nibble was 15.
+static inline bool get_len(const uint8_t *&ip, const uint8_t *iend, size_t &len)
+{
+  uint8_t b;
+
+  do {
+    if (ip == iend)
+      return false;
+    b = *ip++;
+    len += b;
+  } while (b == 255);
+  return true;
+}
+
+size_t lz_decompress(const void *src, size_t n, void *dst, size_t cap)
+{
+  const uint8_t *ip = (const uint8_t *)src, *iend = ip + n;
+  uint8_t *out = (uint8_t *)dst, *op = out, *oend = op + cap;
+
+  for (;;) {
+    if (ip == iend)
+      return (size_t)-1;
+    uint8_t token = *ip++;
+    size_t nlit = token >> 4, len = token & 15;
+    if (nlit == 15 && !get_len(ip, iend, nlit))
+      return (size_t)-1;
+    if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit)
+      return (size_t)-1;
+    if (nlit <= 16 && iend - ip >= 16 && oend - op >= 16)
+      memcpy(op, ip, 16);  // a fixed size is copied inline
+    else
+      memcpy(op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == iend)
+      return op - out;
+
+    if (iend - ip < 2)
+      return (size_t)-1;
+    size_t off = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (len == 15 && !get_len(ip, iend, len))
+      return (size_t)-1;
+    len += LZ_MIN_MATCH;
+    if (off == 0 || off > (size_t)(op - out) || (size_t)(oend - op) < len)
+      return (size_t)-1;
+    const uint8_t *r = op - off;
+    if (off >= 8 && (size_t)(oend - op) >= len + 8) {
+      // 8 bytes at a time, each from before what it writes; the last
+      // may run past the copy into room the next sequence overwrites
+      uint8_t *e = op + len;
+      for (uint8_t *p = op; p < e; p += 8, r += 8)
+        memcpy(p, r, 8);
+      op = e;
+    } else if (off >= len) {
+      memcpy(op, r, len);
+      op += len;
+    } else {
+      // the copy overlaps what it writes, repeating the last off bytes
+      while (len-- > 0)
+        *op++ = *r++;
+    }
+  }
+}
@@ -0,0 +1,20 @@
+// LZ compression of file data.
+
+#ifndef lz_h
+#define lz_h
+
+#include <stddef.h>
+
+// Compress n bytes of src into dst, which holds cap bytes, and return
+// the compressed length, or 0 if it would be more than cap. The format
+// is a run of sequences, each some literal bytes followed by a copy of
+// earlier output, as in LZ4; it is fast rather than small.
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap);
+
+// Decompress n bytes of src into dst, which holds cap bytes, and
+// return the decompressed length, or (size_t)-1 if src is not valid
+// compressed data or does not fit. Bytes of dst past the decompressed
+// length may be overwritten too.
+size_t lz_decompress(const void *src, size_t n, void *dst, size_t cap);
+
+#endif
@@ -429,8 +429,15 @@ rpcs::rpcs(unsigned int p1, int count)
 		lossytest_ = atoi(loss_env);
 	}
 
+	// RPC_THREADS sets how many requests are handled at once
+	int nthreads = 10;
+	char *threads_env = getenv("RPC_THREADS");
+	if(threads_env != NULL && atoi(threads_env) > 0){
+		nthreads = atoi(threads_env);
+	}
+
 	reg(rpc_const::bind, this, &rpcs::rpcbind);
-	dispatchpool_ = new ThrPool(10,false);
+	dispatchpool_ = new ThrPool(nthreads,false);
 
 	listener_ = new tcpsconn(this, port_, lossytest_);
 	if (port_ == 0) {